@@ -0,0 +1,299 @@
+/**
+ * Controller Benchmark
+ *
+ * Drives mqtt_subscription_handler and the Hysteresis, State and Scheduler
+ * handlers with a synthetic topic stream, using a stub mosquitto client and
+ * a file DB sink.  Reports throughput, per message latency and heap
+ * allocations per message.
+ *
+ * Settings (environment):
+ *   BENCH_MESSAGES  - number of measured messages (default 1000000)
+ *   BENCH_WARMUP    - number of warm up messages (default 100000)
+ *   BENCH_HANDLERS  - number of topic handlers, alternating hysteresis and
+ *                     state (default 100)
+ *   BENCH_TIMERS    - number of scheduler handlers (default 10)
+ *   BENCH_TOPICS    - number of distinct device topics (default 1000)
+ *   BENCH_LOG       - 1 to log controller output at debug level (default 0)
+ *   BENCH_DB_FILE   - file receiving the DB rows as CSV (default /dev/null)
+ *   BENCH_CHECK_ALLOCS - 1 to exit with status 1 if the measured run
+ *                     allocated at all (default 0)
+ * The controller settings (HANDLER_THREADS, BATCH_INTERVAL, DB_BATCH_SIZE, ...)
+ * apply as usual.  With TRACE_RATE set, the traces are written to TRACE_FILE
+ * after the run.
+ * Latency is the time spent in mqtt_subscription_handler, which includes the
+ * handlers only when HANDLER_THREADS=0, and in the publish stage flush that
+ * follows it on the network thread.
+ */
+
+#include "bench.hpp"
+#include "batch.hpp"
+#include "config.hpp"
+#include "handlers.hpp"
+#include "insert.hpp"
+#include "log.hpp"
+#include "mqtt.hpp"
+#include "publisher.hpp"
+#include "timers.hpp"
+#include "trace.hpp"
+#include "workers.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <jsoncpp/json/json.h>
+#include <mosquitto.h>
+#include <new>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+appConfig *Config;
+WorkerPool *Workers;
+TimerService *Timers;
+PublishStage *Publisher;
+BatchStage *Batcher;
+
+//
+// Allocation counting
+//
+
+static atomic<unsigned long> allocations{0};
+
+// Replacement allocation functions, all forms so every new is paired with
+// its delete.  Kept out of line so the compiler never sees the malloc and
+// free behind a new and delete it inlined.
+__attribute__((noinline)) static void *counted_alloc(size_t size)
+{
+	allocations.fetch_add(1, memory_order_relaxed);
+	void *ptr = malloc(size ? size : 1);
+	if (!ptr) throw bad_alloc();
+	return ptr;
+}
+
+__attribute__((noinline)) static void counted_free(void *ptr) noexcept
+{
+	free(ptr);
+}
+
+void *operator new(size_t size)
+{
+	return counted_alloc(size);
+}
+
+void *operator new[](size_t size)
+{
+	return counted_alloc(size);
+}
+
+void operator delete(void *ptr) noexcept
+{
+	counted_free(ptr);
+}
+
+void operator delete[](void *ptr) noexcept
+{
+	counted_free(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept
+{
+	counted_free(ptr);
+}
+
+void operator delete[](void *ptr, size_t) noexcept
+{
+	counted_free(ptr);
+}
+
+/**
+ * Function: device_topic
+ * Description:
+ *   Topic of a synthetic device sensor
+ * Args:
+ *   idx - device index
+ * Returns:
+ *   string - topic of <location>/<device>/<device ID>/<sensor>
+ */
+static string device_topic(unsigned int idx)
+{
+	return "bench/device/device" + to_string(idx) + (idx % 2 ? "/door_state" : "/temp");
+}
+
+/**
+ * Function: bench_config
+ * Description:
+ *   Generate the handler configuration for the benchmark
+ * Args:
+ *   handlers - number of topic handlers
+ *   timers - number of scheduler handlers
+ *   topics - number of distinct device topics
+ * Returns:
+ *   Json::Value - handler configuration
+ */
+static Json::Value bench_config(unsigned int handlers, unsigned int timers, unsigned int topics)
+{
+	Json::Value config(Json::objectValue);
+
+	for (unsigned int idx = 0; idx < handlers; idx++) {
+		Json::Value handler;
+		unsigned int device = (idx * 2 + (idx % 2)) % topics;
+		handler["subTopic"] = device_topic(device);
+		handler["pubTopic"] = "bench/device/device" + to_string(device) + "/cmd/value";
+
+		if (device % 2) {
+			handler["type"] = "state";
+			handler["state"]["0"] = 0;
+			handler["state"]["1"] = -10;
+			handler["state_count"]["0"] = 5;
+			handler["state_count"]["1"] = 1;
+		}
+		else {
+			handler["type"] = "hysteresis";
+			handler["hysteresis"]["max"]["limit"] = 40;
+			handler["hysteresis"]["max"]["value"] = 0;
+			handler["hysteresis"]["max"]["repeat"] = true;
+			handler["hysteresis"]["min"]["limit"] = 30;
+			handler["hysteresis"]["min"]["value"] = 60;
+			handler["hysteresis"]["min"]["repeat"] = false;
+		}
+		config["handler" + to_string(idx)] = handler;
+	}
+
+	for (unsigned int idx = 0; idx < timers; idx++) {
+		Json::Value timer;
+		timer["type"] = "scheduler";
+		timer["pubTopic"] = "bench/timer/timer" + to_string(idx) + "/cmd/value";
+		timer["interval_ms"] = 10;
+		timer["max"] = 1;
+		timer["schedule"]["0"] = 1;
+		timer["schedule"]["0.5"] = 0;
+		config["timer" + to_string(idx)] = timer;
+	}
+
+	return config;
+}
+
+/**
+ * Function: percentile
+ * Args:
+ *   sorted - sorted latencies in nanoseconds
+ *   p - percentile in [0, 1]
+ * Returns:
+ *   latency at percentile in microseconds
+ */
+static double percentile(const vector<unsigned int> &sorted, double p)
+{
+	if (sorted.empty()) return 0;
+	size_t idx = min(sorted.size() - 1, (size_t) (p * sorted.size()));
+	return sorted[idx] / 1000.0;
+}
+
+/**
+ *  Function: main
+ *  Description:
+ *    Benchmark start point
+ */
+int main(int argc, char **argv)
+{
+	unsigned long messages = stoul(get_env("BENCH_MESSAGES", "1000000"));
+	unsigned long warmup = stoul(get_env("BENCH_WARMUP", "100000"));
+	unsigned int handler_count = stoul(get_env("BENCH_HANDLERS", "100"));
+	unsigned int timer_count = stoul(get_env("BENCH_TIMERS", "10"));
+	unsigned int topic_count = max(1ul, stoul(get_env("BENCH_TOPICS", "1000")));
+	bool logging = get_env("BENCH_LOG", "0") == "1";
+	bool check_allocs = get_env("BENCH_CHECK_ALLOCS", "0") == "1";
+
+	// Silence controller logging unless requested, results go to stdout after
+	start_logging(logging ? "debug" : "none");
+
+	// Controller setup as in main() with generated handlers
+	Config = process_env();
+	compile_handlers(bench_config(handler_count, timer_count, topic_count), Config->handlers);
+
+	start_tracing(Config->trace_rate, Config->trace_buffer);
+	start_writer(Config);
+	Workers = new WorkerPool(Config->handler_threads, Config->handler_queue_size);
+	Workers->start();
+	if (Config->batch_interval) Batcher = new BatchStage(Config->batch_size, Config->batch_interval);
+	Publisher = new PublishStage(Config->publish_queue_size, Config->publish_coalesce, Config->publish_suppress_repeats);
+	Timers = new TimerService();
+	Timers->start();
+
+	publish_handlers(load_handlers(Config->handlers, nullptr, nullptr));
+
+	// Synthetic stream, payloads wander across the hysteresis limits
+	vector<string> topics;
+	for (unsigned int idx = 0; idx < topic_count; idx++) topics.push_back(device_topic(idx));
+	vector<string> payloads;
+	mt19937 random(42);
+	for (unsigned int idx = 0; idx < 4096; idx++) payloads.push_back(to_string(random() % 2 ? 20 + random() % 30 : random() % 2));
+
+	vector<unsigned int> latencies(messages);
+	struct mosquitto_message message = {};
+
+	auto send = [&](unsigned long idx) {
+		const string &topic = topics[(idx * 7919) % topics.size()];
+		const string &payload = payloads[idx % payloads.size()];
+		message.topic = (char *) topic.c_str();
+		message.payload = (void *) payload.c_str();
+		message.payloadlen = payload.size();
+		mqtt_subscription_handler(nullptr, nullptr, &message);
+
+		// Run batches and publish queued commands as the network loop does
+		// after each message
+		if (Batcher) Batcher->flush(false);
+		Publisher->flush(nullptr, false);
+	};
+
+	for (unsigned long idx = 0; idx < warmup; idx++) send(idx);
+
+	// Measured run, drained once all workers have processed their queues
+	unsigned long start_allocations = allocations.load();
+	unsigned long start_publishes = BenchPublishes.load();
+	auto start = chrono::steady_clock::now();
+	for (unsigned long idx = 0; idx < messages; idx++) {
+		auto begin = chrono::steady_clock::now();
+		send(warmup + idx);
+		latencies[idx] = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - begin).count();
+	}
+	unsigned long run_allocations = allocations.load() - start_allocations;
+	delete Timers;
+	if (Batcher) Batcher->flush(true);
+	delete Workers;
+	delete Batcher;
+	Publisher->flush(nullptr, true);
+	auto elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	unsigned long publishes = BenchPublishes.load() - start_publishes;
+	stop_writer();
+	if (Config->trace_rate) write_trace(Config->trace_file);
+
+	stop_logging();
+
+	sort(latencies.begin(), latencies.end());
+
+	cout << "==> Controller benchmark" << endl
+		<< "handlers:          " << handler_count << " topic, " << timer_count << " timer" << endl
+		<< "topics:            " << topic_count << endl
+		<< "handler threads:   " << Config->handler_threads << endl
+		<< "messages:          " << messages << endl
+		<< "msgs/sec:          " << (unsigned long) (messages / elapsed) << endl
+		<< "latency p50 (us):  " << percentile(latencies, 0.50) << endl
+		<< "latency p99 (us):  " << percentile(latencies, 0.99) << endl
+		<< "latency p999 (us): " << percentile(latencies, 0.999) << endl
+		<< "allocs/msg:        " << (double) run_allocations / messages << endl
+		<< "publishes:         " << publishes << endl
+		<< "db rows:           " << BenchRows.load() << endl;
+
+	delete Config;
+
+	// Steady state dispatch must not touch the heap
+	if (check_allocs && run_allocations) {
+		cerr << "FAIL: " << run_allocations << " heap allocations in the measured run" << endl;
+		return 1;
+	}
+	return 0;
+}
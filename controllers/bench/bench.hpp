@@ -0,0 +1,18 @@
+#pragma once
+
+/**
+ * Benchmark Header
+ */
+
+#include <atomic>
+#include <cstdio>
+
+using namespace std;
+
+// Counters maintained by the benchmark stubs
+extern atomic<unsigned long> BenchPublishes;
+extern atomic<unsigned long> BenchRows;
+
+// Commands published through the stub client are written here as
+// "<topic> <payload>" lines, if set
+extern FILE *BenchPublishFile;
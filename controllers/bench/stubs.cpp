@@ -0,0 +1,143 @@
+/**
+ * Benchmark Stubs
+ *
+ * Stub mosquitto client and file based DB sink linked into the benchmark in
+ * place of libmosquitto and the PostgreSQL writer (insert.cpp, pool.cpp)
+ */
+
+#include "bench.hpp"
+#include "config.hpp"
+#include "insert.hpp"
+#include "message.hpp"
+#include "series.hpp"
+#include "writer.hpp"
+#include <atomic>
+#include <cstdio>
+#include <ctime>
+#include <mosquitto.h>
+#include <mutex>
+
+using namespace std;
+
+// Benchmark counters
+atomic<unsigned long> BenchPublishes{0};
+atomic<unsigned long> BenchRows{0};
+FILE *BenchPublishFile = nullptr;
+static mutex publish_lock;
+
+// Background writer and its output file
+static ReadingWriter *writer = nullptr;
+static FILE *sink = nullptr;
+
+//
+// Stub mosquitto client, nothing leaves the process
+//
+
+extern "C" {
+
+int mosquitto_lib_init(void) { return MOSQ_ERR_SUCCESS; }
+int mosquitto_lib_cleanup(void) { return MOSQ_ERR_SUCCESS; }
+struct mosquitto *mosquitto_new(const char *id, bool clean_session, void *obj) { return nullptr; }
+void mosquitto_destroy(struct mosquitto *mosq) {}
+int mosquitto_connect(struct mosquitto *mosq, const char *host, int port, int keepalive) { return MOSQ_ERR_SUCCESS; }
+int mosquitto_disconnect(struct mosquitto *mosq) { return MOSQ_ERR_SUCCESS; }
+int mosquitto_subscribe(struct mosquitto *mosq, int *mid, const char *sub, int qos) { return MOSQ_ERR_SUCCESS; }
+int mosquitto_subscribe_v5(struct mosquitto *mosq, int *mid, const char *sub, int qos, int options, const mosquitto_property *properties) { return MOSQ_ERR_SUCCESS; }
+int mosquitto_unsubscribe(struct mosquitto *mosq, int *mid, const char *sub) { return MOSQ_ERR_SUCCESS; }
+int mosquitto_int_option(struct mosquitto *mosq, enum mosq_opt_t option, int value) { return MOSQ_ERR_SUCCESS; }
+int mosquitto_property_add_varint(mosquitto_property **proplist, int identifier, uint32_t value) { return MOSQ_ERR_SUCCESS; }
+void mosquitto_property_free_all(mosquitto_property **properties) {}
+const mosquitto_property *mosquitto_property_read_varint(const mosquitto_property *proplist, int identifier, uint32_t *value, bool skip_first) { return nullptr; }
+int mosquitto_loop(struct mosquitto *mosq, int timeout, int max_packets) { return MOSQ_ERR_SUCCESS; }
+int mosquitto_reconnect(struct mosquitto *mosq) { return MOSQ_ERR_SUCCESS; }
+void mosquitto_message_callback_set(struct mosquitto *mosq, void (*on_message)(struct mosquitto *, void *, const struct mosquitto_message *)) {}
+void mosquitto_message_v5_callback_set(struct mosquitto *mosq, void (*on_message)(struct mosquitto *, void *, const struct mosquitto_message *, const mosquitto_property *)) {}
+
+int mosquitto_publish(struct mosquitto *mosq, int *mid, const char *topic, int payloadlen, const void *payload, int qos, bool retain)
+{
+	BenchPublishes.fetch_add(1, memory_order_relaxed);
+	if (BenchPublishFile) {
+		lock_guard<mutex> guard(publish_lock);
+		fprintf(BenchPublishFile, "%s %.*s\n", topic, payloadlen, (const char *) payload);
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+}
+
+//
+// File DB sink, replaces the PostgreSQL writer
+//
+
+/**
+ *  Function: start_writer
+ *  Description:
+ *    Start the background writer writing batches as CSV to BENCH_DB_FILE
+ *  Args:
+ *    config - application configuration
+ */
+void start_writer(appConfig *config)
+{
+	string path = get_env("BENCH_DB_FILE", "/dev/null");
+	sink = fopen(path.c_str(), "w");
+
+	OverloadSettings overload;
+	parse_overload_policy(config->db_overload_policy, overload.policy);
+	overload.sample_rate = config->db_sample_rate;
+	overload.hold_timeout = config->db_hold_timeout;
+
+	writer = new ReadingWriter(config->db_queue_size, config->db_batch_size, config->db_flush_interval, config->db_writer_threads, overload,
+		[](const vector<Reading> &batch, size_t count) {
+			for (size_t idx = 0; idx < count; idx++) {
+				const Reading &r = batch[idx];
+				if (sink) fprintf(sink, "%s,%s,%s,%s,%ld,%.15g\n", r.series->location.c_str(), r.series->device_type.c_str(), r.series->device_id.c_str(), r.series->sensor.c_str(), r.ts, r.reading);
+			}
+			BenchRows.fetch_add(count, memory_order_relaxed);
+			return true;
+		});
+	writer->start();
+}
+
+/**
+ *  Function: stop_writer
+ *  Description:
+ *    Flush any queued readings and stop the background writer
+ */
+void stop_writer(void)
+{
+	delete writer;
+	writer = nullptr;
+	if (sink) fclose(sink);
+	sink = nullptr;
+}
+
+/**
+ *  Function: insert_reading
+ *  Description:
+ *    Queue device readings for the file sink
+ *  Args:
+ *    config - application configuration
+ *    message - parsed message holding the device topic and sensor reading
+ */
+void insert_reading(appConfig *config, const Message &message)
+{
+	long int ts = message.ts ? message.ts : static_cast<long int> (std::time(0));
+	insert_reading(config, series().intern(message), ts, message.reading, message.trace);
+}
+
+/**
+ *  Function: insert_reading
+ *  Description:
+ *    Queue a reading of a series with its own timestamp and value for the
+ *    file sink
+ *  Args:
+ *    config - application configuration
+ *    entry - series of the reading
+ *    ts - reading timestamp in seconds since epoch
+ *    reading - sensor reading to store
+ *    trace - trace id of the message, 0 if not traced
+ */
+void insert_reading(appConfig *config, Series *entry, long int ts, double reading, uint32_t trace)
+{
+	if (writer) writer->enqueue(entry, ts, reading, trace);
+}
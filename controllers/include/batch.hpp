@@ -0,0 +1,153 @@
+#pragma once
+
+/**
+ * Micro-batch Stage Header
+ */
+
+#include "message.hpp"
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+
+class Handlers;
+
+//
+// MessageBatch Class
+//
+// Readings for one handler in columns, series index (see series().at()),
+// timestamp, integer value and reading, so handlers can evaluate a whole
+// column per loop
+//
+
+class MessageBatch
+{
+	public:
+		/**
+		 * MessageBatch Class Member Function: MessageBatch
+		 * Description:
+		 *   MessageBatch Constructor
+		 * Args:
+		 *   capacity - max readings, all columns are allocated up front
+		 */
+		MessageBatch(size_t capacity) : series(capacity), ts(capacity), values(capacity), readings(capacity) {}
+
+		/**
+		 * MessageBatch Class Member Function: append
+		 * Description:
+		 *   Add a reading, the batch must not be full
+		 * Args:
+		 *   id - series index of the message topic
+		 *   time - reading timestamp in seconds since epoch
+		 *   value - reading truncated to an integer
+		 *   reading - decoded reading
+		 */
+		void append(uint32_t id, long int time, int value, double reading)
+		{
+			series[count] = id;
+			ts[count] = time;
+			values[count] = value;
+			readings[count] = reading;
+			count++;
+		}
+
+		/**
+		 * MessageBatch Class Member Function: full
+		 * Returns:
+		 *   true if no more readings fit
+		 */
+		bool full(void) const
+		{
+			return count == values.size();
+		}
+
+		// Columns, valid up to count
+		vector<uint32_t> series;
+		vector<long int> ts;
+		vector<int> values;
+		vector<double> readings;
+		size_t count = 0;
+};
+
+/**
+ * Function: find_first
+ * Description:
+ *   Find the first value a predicate holds for.  Blocks of 16 values are
+ *   tested with a branch free reduction the compiler vectorizes, so long
+ *   runs of values that don't change a handler's state are skipped quickly.
+ * Args:
+ *   values - column
+ *   start - first index to test
+ *   count - column size
+ *   pred - callable taking a value
+ * Returns:
+ *   index of the first match, count if none
+ */
+template <typename T, typename P>
+size_t find_first(const T *values, size_t start, size_t count, P pred)
+{
+	size_t idx = start;
+	for (; idx + 16 <= count; idx += 16) {
+		bool any = false;
+		for (size_t lane = 0; lane < 16; lane++) any |= pred(values[idx + lane]);
+		if (any) break;
+	}
+	for (; idx < count; idx++) {
+		if (pred(values[idx])) return idx;
+	}
+	return count;
+}
+
+//
+// BatchStage Class
+//
+// Collects the messages for handlers taking batches into one batch per
+// handler, and hands the batches to the handler workers every interval or
+// when full.  Batches are handed over under the same lock they are filled
+// under, so a handler gets its batches in order whichever thread flushes.
+// Batches are reused once the workers are done with them.
+//
+
+class BatchStage
+{
+	public:
+		// Functions
+		BatchStage(size_t, unsigned int);
+		void add(Handlers*, const Message&);
+		void flush(bool);
+		void release(MessageBatch*);
+
+	private:
+		// Batch being filled for a handler, nullptr once sent, and whether
+		// the handler is listed in pending
+		typedef struct {
+			MessageBatch *batch;
+			bool listed;
+		} OpenBatch;
+
+		MessageBatch *acquire(void);
+
+		size_t capacity;
+		chrono::milliseconds interval;
+		chrono::steady_clock::time_point due;
+
+		// Open batch per handler, and the handlers with an open batch each
+		// listed once
+		unordered_map<Handlers *, OpenBatch> open;
+		vector<Handlers *> pending;
+		mutex lock;
+
+		// All batches and the ones not in use, released by the workers under
+		// their own lock, which may be taken while holding lock
+		vector<unique_ptr<MessageBatch>> batches;
+		vector<MessageBatch *> spare;
+		mutex spare_lock;
+};
+
+// Global batch stage, nullptr unless batching is enabled
+extern BatchStage *Batcher;
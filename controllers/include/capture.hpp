@@ -0,0 +1,71 @@
+#pragma once
+
+/**
+ * Message Capture Header
+ */
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+using namespace std;
+
+// Structures
+// Captured message, the topic is NUL terminated and both views point into
+// the capture mapping
+typedef struct {
+	uint64_t time;     // nanoseconds since the capture started
+	const char *topic;
+	string_view payload;
+} CapturedMessage;
+
+//
+// MessageCapture Class
+//
+// Records every received message to a memory mapped capture file allocated
+// up front, so recording is a memcpy on the MQTT network thread.  Messages
+// not fitting in the file aren't recorded.
+//
+
+class MessageCapture
+{
+	public:
+		// Functions
+		MessageCapture(string, size_t);
+		~MessageCapture();
+		bool record(const char*, const void*, size_t);
+
+	private:
+		string path;
+		int fd = -1;
+		char *data = nullptr;
+		size_t capacity = 0;
+		size_t used = 0;
+		size_t messages = 0;
+		bool full = false;
+		chrono::steady_clock::time_point start;
+};
+
+//
+// CaptureReader Class
+//
+// Maps a capture file read-only and iterates over its messages in the order
+// they were received
+//
+
+class CaptureReader
+{
+	public:
+		// Functions
+		CaptureReader(string);
+		~CaptureReader();
+		bool next(CapturedMessage&);
+
+	private:
+		const char *data = nullptr;
+		size_t length = 0;
+		size_t end = 0;
+		size_t offset = 0;
+};
@@ -0,0 +1,72 @@
+#pragma once
+
+/**
+ * Handler State Checkpoint Header
+ */
+
+#include "handlers.hpp"
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+
+//
+// StateCheckpoint Class
+//
+// Memory mapped file holding the state of stateful handlers, keyed by their
+// configuration fingerprint.  Saved periodically without blocking message
+// dispatch and on shutdown, and read on startup so handlers continue where
+// they stopped.  A handler whose configuration changed has a new
+// fingerprint and starts fresh.
+//
+
+class StateCheckpoint
+{
+	public:
+		// Functions
+		StateCheckpoint(string);
+		~StateCheckpoint();
+		bool restore(Handlers*);
+		bool begin(const vector<shared_ptr<Handlers>>&);
+		bool poll(void);
+		size_t save(const vector<shared_ptr<Handlers>>&);
+
+	private:
+		// File header, check is a CRC-32 of the other fields
+		typedef struct {
+			uint64_t magic;
+			uint32_t version;
+			uint32_t count;
+			uint64_t generation;
+			uint64_t check;
+		} Header;
+
+		// Saved state of one handler, check is a CRC-32 of the other fields
+		typedef struct {
+			uint64_t fingerprint;
+			uint32_t size;
+			uint32_t check;
+			char state[HANDLER_STATE_SIZE];
+		} Record;
+
+		size_t write(void);
+		bool map(size_t);
+		Record *records(void);
+
+		string path;
+		int fd = -1;
+		Header *header = nullptr;
+		size_t capacity = 0;
+
+		// Record index by fingerprint of the state read at startup
+		unordered_map<uint64_t, size_t> saved;
+
+		// Handlers of the save in progress, kept alive until written, and
+		// the snapshots their workers have yet to take
+		vector<shared_ptr<Handlers>> saving;
+		atomic<size_t> snapshots{0};
+};
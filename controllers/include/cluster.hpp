@@ -0,0 +1,14 @@
+#pragma once
+
+/**
+ * Cluster Membership Header
+ */
+
+#include <string>
+
+using namespace std;
+
+// Functions
+extern bool cluster_enabled(void);
+extern unsigned int cluster_owner(const string&, unsigned int);
+extern bool cluster_owns(const string&);
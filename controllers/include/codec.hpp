@@ -0,0 +1,40 @@
+#pragma once
+
+/**
+ * Payload Codec Header
+ */
+
+#include <string>
+#include <string_view>
+
+using namespace std;
+
+namespace Codecs
+{
+	enum type { text, binary, json };
+}
+
+// Max readings decoded from one payload
+#define PAYLOAD_MAX_FIELDS 16
+
+// Structures
+// Reading decoded from a payload.  Fields of a multi field payload are named
+// and become readings of their own sensor, the unnamed reading belongs to
+// the sensor of the message topic.
+typedef struct {
+	string_view name;
+	double reading;
+} PayloadField;
+
+// Readings of one payload and the device timestamp in seconds since epoch,
+// 0 if the payload has none.  Names point into the payload.
+typedef struct {
+	long int ts;
+	size_t count;
+	PayloadField fields[PAYLOAD_MAX_FIELDS];
+} Payload;
+
+// Functions
+extern bool set_payload_codecs(const string&);
+extern Codecs::type payload_codec(string_view);
+extern bool decode_payload(Codecs::type, string_view, Payload&);
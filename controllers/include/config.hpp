@@ -4,8 +4,9 @@
  * Application Configuration Header
  */
 
+#include "handler_config.hpp"
 #include <iostream>
-#include <jsoncpp/json/json.h>
+#include <vector>
 
 using namespace std;
 
@@ -14,9 +15,47 @@ typedef struct {
 	string mqtt_hostname;
 	unsigned short int mqtt_port;
 	string mqtt_sub_topic;
+	string payload_codecs;
+	unsigned int cluster_nodes;
+	unsigned int cluster_node_id;
+	string cluster_group;
 	unsigned int mqtt_keepalive_interval;
 	string pg_connection;
-	Json::Value handlers;
+	unsigned int pg_pool_size;
+	unsigned int db_queue_size;
+	unsigned int db_batch_size;
+	unsigned int db_flush_interval;
+	unsigned int db_writer_threads;
+	string db_overload_policy;
+	unsigned int db_sample_rate;
+	unsigned int db_hold_timeout;
+	string spool_dir;
+	unsigned long spool_segment_size;
+	unsigned int spool_max_segments;
+	vector<unsigned int> rollup_windows;
+	unsigned int rollup_grace;
+	size_t rollup_queue_size;
+	unsigned int handler_threads;
+	unsigned int handler_queue_size;
+	unsigned int batch_interval;
+	unsigned int batch_size;
+	unsigned int publish_queue_size;
+	unsigned int publish_interval;
+	unsigned int publish_coalesce;
+	bool publish_suppress_repeats;
+	string checkpoint_file;
+	unsigned int checkpoint_interval;
+	string metrics_topic;
+	unsigned int metrics_interval;
+	unsigned short int metrics_port;
+	string metrics_address;
+	unsigned int trace_rate;
+	unsigned int trace_buffer;
+	string trace_file;
+	string trace_topic;
+	string capture_file;
+	unsigned long capture_size;
+	vector<HandlerSpec> handlers;
 } appConfig;
 
 // Global configuration object
@@ -24,4 +63,5 @@ extern appConfig *Config;
 
 // Functions
 extern appConfig *process_env(void);
+extern bool load_handler_config(vector<HandlerSpec>&);
 extern string get_env(std::string const&, std::string const);
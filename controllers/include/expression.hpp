@@ -0,0 +1,60 @@
+#pragma once
+
+/**
+ * Rule Expression Header
+ */
+
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// Variables an expression can read, by index into the variables passed to
+// evaluate()
+namespace ExpressionVariables
+{
+	enum type { value, prev, last, state, count, size };
+}
+
+// Max evaluation stack depth of an expression
+#define EXPRESSION_MAX_STACK 32
+
+//
+// Expression Class
+//
+// Rule expression compiled once into stack machine bytecode.  Evaluation
+// uses a fixed stack on the C stack and never allocates.  Numbers are
+// doubles, none is NaN, comparisons and logic give 1 or 0, and NaN or 0 is
+// false.
+//
+
+class Expression
+{
+	public:
+		// Functions
+		bool compile(const string&, string&);
+		double evaluate(const double*) const;
+		bool empty(void) const;
+
+	private:
+		// Instructions
+		enum Op : unsigned char {
+			constant, load,
+			add, subtract, multiply, divide, modulo,
+			equal, not_equal, less, less_equal, greater, greater_equal,
+			negate, logical_not, truth, is_none, absolute, minimum, maximum,
+			jump, jump_false, and_jump, or_jump
+		};
+		// Jump target or variable index, and constant
+		struct Instruction
+		{
+			Op op;
+			unsigned int target;
+			double number;
+		};
+
+		// Parser state, only used by compile()
+		struct Parser;
+
+		vector<Instruction> code;
+};
@@ -0,0 +1,143 @@
+#pragma once
+
+/**
+ * Flat Hash Map Header
+ */
+
+#include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+using namespace std;
+
+//
+// FlatMap Class
+//
+// Open addressing hash map from string keys to values, stored in a single
+// array with linear probing.  Lookups take a string_view and never allocate,
+// only inserting a new key does.  Entries are never removed.
+//
+
+template <typename V>
+class FlatMap
+{
+	public:
+		/**
+		 * FlatMap Class Member Function: FlatMap
+		 * Description:
+		 *   FlatMap Constructor
+		 * Args:
+		 *   capacity - initial number of slots, rounded up to a power of 2
+		 */
+		FlatMap(size_t capacity = 64)
+		{
+			size_t size = 16;
+			while (size < capacity) size *= 2;
+			slots.resize(size);
+		}
+
+		/**
+		 * FlatMap Class Member Function: find
+		 * Args:
+		 *   key - key to look up
+		 * Returns:
+		 *   value or nullptr if the key isn't present
+		 */
+		V *find(string_view key)
+		{
+			size_t hash = hasher(key);
+			for (size_t idx = hash & (slots.size() - 1); slots[idx].used; idx = (idx + 1) & (slots.size() - 1)) {
+				if (slots[idx].hash == hash && slots[idx].key == key) return &slots[idx].value;
+			}
+			return nullptr;
+		}
+
+		/**
+		 * FlatMap Class Member Function: get
+		 * Description:
+		 *   Get the value for a key, inserting a default value if the key
+		 *   isn't present
+		 * Args:
+		 *   key - key to look up
+		 * Returns:
+		 *   value, valid until the next insert
+		 */
+		V &get(string_view key)
+		{
+			V *value = find(key);
+			if (value) return *value;
+
+			// Keep the load factor below 3/4
+			if ((count + 1) * 4 > slots.size() * 3) grow();
+
+			size_t hash = hasher(key);
+			size_t idx = hash & (slots.size() - 1);
+			while (slots[idx].used) idx = (idx + 1) & (slots.size() - 1);
+
+			Slot &slot = slots[idx];
+			slot.used = true;
+			slot.hash = hash;
+			slot.key.assign(key);
+			slot.value = V();
+			count++;
+			return slot.value;
+		}
+
+		/**
+		 * FlatMap Class Member Function: each
+		 * Description:
+		 *   Call a function for every entry, in no particular order
+		 * Args:
+		 *   visit - callable taking the key and a reference to the value
+		 */
+		template <typename F>
+		void each(F &&visit)
+		{
+			for (Slot &slot : slots) {
+				if (slot.used) visit(slot.key, slot.value);
+			}
+		}
+
+		/**
+		 * FlatMap Class Member Function: size
+		 * Returns:
+		 *   number of keys
+		 */
+		size_t size(void)
+		{
+			return count;
+		}
+
+	private:
+		struct Slot
+		{
+			bool used = false;
+			size_t hash = 0;
+			string key;
+			V value;
+		};
+
+		/**
+		 * FlatMap Class private Member Function: grow
+		 * Description:
+		 *   Double the slot array and reinsert all entries
+		 */
+		void grow(void)
+		{
+			vector<Slot> old(slots.size() * 2);
+			old.swap(slots);
+
+			for (Slot &entry : old) {
+				if (!entry.used) continue;
+
+				size_t idx = entry.hash & (slots.size() - 1);
+				while (slots[idx].used) idx = (idx + 1) & (slots.size() - 1);
+				slots[idx] = move(entry);
+			}
+		}
+
+		vector<Slot> slots;
+		size_t count = 0;
+		hash<string_view> hasher;
+};
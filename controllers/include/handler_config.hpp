@@ -0,0 +1,82 @@
+#pragma once
+
+/**
+ * Handler Configuration Header
+ */
+
+#include "expression.hpp"
+#include "lookup.hpp"
+#include <cstdint>
+#include <jsoncpp/json/json.h>
+#include <limits>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+namespace WindowStatistics
+{
+	enum type { mean, min, max };
+}
+
+// Structures
+// Hysteresis limit, value published when the limit is crossed
+typedef struct {
+	int limit = 0;
+	int value = 0;
+	bool repeat = false;
+} HysteresisLimit;
+
+// Handler configuration compiled from JSON and validated once when loaded.
+// Only the settings of the handler type are used, times are in
+// milliseconds.
+typedef struct {
+	string name;
+	string type;
+	string pub_topic;
+	string sub_topic;
+
+	// Hash of the handler name and JSON configuration, equal for unchanged
+	// handlers across reloads and restarts
+	uint64_t fingerprint = 0;
+
+	// hysteresis
+	HysteresisLimit min;
+	HysteresisLimit max;
+
+	// state, output value and required observations by input value
+	LookupTable state;
+	LookupTable state_count;
+
+	// scheduler, values by tick number, ticks repeat after the schedule length
+	unsigned int interval = 1000;
+	unsigned int ticks = 1;
+	LookupTable schedule;
+
+	// deadband and swinging_door filters
+	double deadband = 0;
+	double deviation = 0;
+	long int max_interval = 0;
+
+	// streaming statistics, window sizes in samples
+	double alpha = 0.5;
+	unsigned int window = 10;
+	WindowStatistics::type statistic = WindowStatistics::mean;
+	long int rate_per = 1000;
+
+	// pid, output limited to the range
+	double setpoint = 0;
+	double kp = 0;
+	double ki = 0;
+	double kd = 0;
+	double output_min = numeric_limits<int>::min();
+	double output_max = numeric_limits<int>::max();
+
+	// expression, output and state update rules, and the initial state
+	Expression expression;
+	Expression update;
+	double initial = 0;
+} HandlerSpec;
+
+// Functions
+extern bool compile_handlers(const Json::Value&, vector<HandlerSpec>&);
@@ -4,9 +4,13 @@
  * Handler Factory Header
  */
 
+#include "batch.hpp"
 #include "config.hpp"
+#include "handler_config.hpp"
+#include "message.hpp"
+#include "metrics.hpp"
+#include <cstdint>
 #include <iostream>
-#include <jsoncpp/json/json.h>
 #include <mosquitto.h>
 
 using namespace std;
@@ -17,32 +21,59 @@ using namespace std;
 
 namespace HandlerTypes
 {
-	enum type { none, topic, timer };
+	enum type { none, topic, timer, filter };
 }
 
+// Max bytes of state a handler saves to the state checkpoint
+#define HANDLER_STATE_SIZE 48
+
 class Handlers
 {
 	public:
 		// Factory Method
-		static Handlers *makeHandler(string, string, mosquitto*, appConfig*);
+		static Handlers *makeHandler(const HandlerSpec&, mosquitto*);
 
 		// Functions
-		Handlers(string, mosquitto*, appConfig*);
-		virtual void handleTopic(string, string);
+		Handlers(const HandlerSpec&, mosquitto*);
+		virtual ~Handlers() {}
+		virtual void handleTopic(const Message&);
 		virtual void handleTimeout(void);
+		virtual bool handlesBatch(void);
+		virtual void handleBatch(const MessageBatch&);
+		virtual bool storeReading(const Message&);
+		virtual void flushReadings(bool);
+		virtual unsigned int getInterval(void);
+		virtual unsigned int getFlushInterval(void);
+		virtual size_t saveState(char*);
+		virtual bool restoreState(const char*, size_t);
+		void snapshot(void);
+		const char *getSnapshot(size_t&);
 		HandlerTypes::type getType();
 		string getName();
-		Json::Value *getValue(string);
-		Json::Value *getMapValue(string, string);
+		string getSubTopic();
+		size_t getShard();
+		uint64_t getFingerprint();
+		uint16_t getTraceLabel();
+		Counter &getDispatchCounter();
 
 	private:
-		appConfig *config;
+		size_t shard;
+		uint64_t fingerprint;
+		size_t publish_topic = 0;
+		uint16_t trace_label = 0;
+		uint16_t publish_label = 0;
+		Counter *dispatched;
+
+		// State copied by snapshot() for the state checkpoint
+		char snapshot_state[HANDLER_STATE_SIZE];
+		size_t snapshot_size = 0;
 
 	protected:
-		void publish(string);
+		void publish(int);
+		void publishReading(double);
+		static long int sampleTime(const Message&);
 		HandlerTypes::type type;
 		string name;
-		Json::Value hconfig;
 		mosquitto *client;
 		string pubTopic;
 		string subTopic;
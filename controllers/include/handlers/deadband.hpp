@@ -0,0 +1,30 @@
+#pragma once
+
+/**
+ *  Deadband Handler Header
+ */
+
+#include "flatmap.hpp"
+#include "handlers.hpp"
+#include <mosquitto.h>
+
+class Deadband : public Handlers
+{
+	public:
+		Deadband(const HandlerSpec&, mosquitto*);
+		// check if reading is stored
+		bool storeReading(const Message &message);
+
+	private:
+		// Last stored reading per topic
+		struct Stored
+		{
+			double value;
+			long int time;
+		};
+		FlatMap<Stored> stored;
+
+		// Filter settings, time in milliseconds
+		double deadband = 0;
+		long int max_interval = 0;
+};
@@ -0,0 +1,26 @@
+#pragma once
+
+/**
+ *  EWMA Handler Header
+ */
+
+#include "handlers.hpp"
+#include <mosquitto.h>
+
+class Ewma : public Handlers
+{
+	public:
+		Ewma(const HandlerSpec&, mosquitto*);
+		// smooth handled value
+		void handleTopic(const Message &message);
+		size_t saveState(char *state);
+		bool restoreState(const char *state, size_t size);
+
+	private:
+		// Weight of the newest reading
+		double alpha;
+
+		// Current average, unset until the first reading
+		double average = 0;
+		bool primed = false;
+};
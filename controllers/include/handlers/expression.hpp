@@ -0,0 +1,27 @@
+#pragma once
+
+/**
+ *  Expression Handler Header
+ */
+
+#include "expression.hpp"
+#include "handlers.hpp"
+#include <mosquitto.h>
+
+class ExpressionHandler : public Handlers
+{
+	public:
+		ExpressionHandler(const HandlerSpec&, mosquitto*);
+		// evaluate rules for handled value
+		void handleTopic(const Message &message);
+		size_t saveState(char *state);
+		bool restoreState(const char *state, size_t size);
+
+	private:
+		// Compiled rules
+		Expression expression;
+		Expression update;
+
+		// Variables the rules read, by ExpressionVariables index
+		double variables[ExpressionVariables::size];
+};
@@ -10,20 +10,18 @@
 class Hysteresis : public Handlers
 {
 	public:
-		Hysteresis(string, mosquitto*, appConfig*);
+		Hysteresis(const HandlerSpec&, mosquitto*);
 		// check if handled topic
-		void handleTopic(string topic, string msg);
+		void handleTopic(const Message &message);
+		bool handlesBatch(void);
+		void handleBatch(const MessageBatch &batch);
+		size_t saveState(char *state);
+		bool restoreState(const char *state, size_t size);
 
 	private:
-		// Hysteresis info
-		struct HInfo
-		{
-			int limit;
-			int value;
-			bool repeat;
-		};
-		HInfo min = {0, 0, false};
-		HInfo max = {0, 0, false};
+		// Hysteresis limits
+		HysteresisLimit min;
+		HysteresisLimit max;
 
 		// State information, initial is no state
 		enum state { no_state, min_state, max_state};
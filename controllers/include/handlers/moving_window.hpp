@@ -0,0 +1,38 @@
+#pragma once
+
+/**
+ *  Moving Window Handler Header
+ */
+
+#include "handlers.hpp"
+#include "ring.hpp"
+#include <mosquitto.h>
+
+class MovingWindow : public Handlers
+{
+	public:
+		MovingWindow(const HandlerSpec&, mosquitto*);
+		// window statistic of handled value
+		void handleTopic(const Message &message);
+
+	private:
+		// Reading with its sample number
+		struct Sample
+		{
+			unsigned long number;
+			double reading;
+		};
+
+		WindowStatistics::type statistic;
+
+		// Readings in the window and their sum, the sum is recomputed once
+		// per window so rounding errors don't accumulate
+		RingBuffer<double> readings;
+		double sum = 0;
+		size_t added = 0;
+
+		// Candidates for the window min or max, readings in order of arrival
+		// that aren't superseded by a later reading, the front is the result
+		RingBuffer<Sample> extremes;
+		unsigned long samples = 0;
+};
@@ -0,0 +1,38 @@
+#pragma once
+
+/**
+ *  PID Handler Header
+ */
+
+#include "handlers.hpp"
+#include <mosquitto.h>
+
+class Pid : public Handlers
+{
+	public:
+		Pid(const HandlerSpec&, mosquitto*);
+		// control output for handled value
+		void handleTopic(const Message &message);
+		size_t saveState(char *state);
+		bool restoreState(const char *state, size_t size);
+
+	private:
+		// Controller settings
+		double setpoint;
+		double kp;
+		double ki;
+		double kd;
+		double output_min;
+		double output_max;
+
+		// Integral of the error over seconds, and the last reading with its
+		// time in milliseconds
+		struct Memory
+		{
+			double integral;
+			double reading;
+			long int time;
+		};
+		Memory memory = {};
+		bool primed = false;
+};
@@ -0,0 +1,31 @@
+#pragma once
+
+/**
+ *  Rate of Change Handler Header
+ */
+
+#include "handlers.hpp"
+#include "ring.hpp"
+#include <mosquitto.h>
+
+class RateOfChange : public Handlers
+{
+	public:
+		RateOfChange(const HandlerSpec&, mosquitto*);
+		// rate of change of handled value
+		void handleTopic(const Message &message);
+
+	private:
+		// Reading with its time in milliseconds
+		struct Sample
+		{
+			long int time;
+			double reading;
+		};
+
+		// Last size readings, the rate is taken across all of them
+		RingBuffer<Sample> samples;
+
+		// Rate unit in milliseconds
+		double per;
+};
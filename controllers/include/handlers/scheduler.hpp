@@ -5,8 +5,9 @@
  */
 
 #include "handlers.hpp"
+#include "lookup.hpp"
+#include <atomic>
 #include <iostream>
-#include <map>
 #include <mosquitto.h>
 
 using namespace std;
@@ -14,11 +15,17 @@ using namespace std;
 class Scheduler: public Handlers
 {
 	public:
-		Scheduler(string, mosquitto*, appConfig*);
+		Scheduler(const HandlerSpec&, mosquitto*);
 		void handleTimeout(void);
+		unsigned int getInterval(void);
+		size_t saveState(char *state);
+		bool restoreState(const char *state, size_t size);
 	private:
-		unsigned int tick;
+		// current tick and schedule length in ticks, interval in milliseconds.
+		// Without workers the tick is saved from another thread.
+		atomic<unsigned int> tick{0};
+		unsigned int ticks;
 		unsigned int interval;
-		unsigned int max;
-		map<int, int> schedule;
+		// values by tick number
+		LookupTable schedule;
 };
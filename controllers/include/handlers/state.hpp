@@ -5,9 +5,9 @@
  */
 
 #include "handlers.hpp"
+#include "lookup.hpp"
 #include <iostream>
 #include <limits>
-#include <map>
 #include <mosquitto.h>
 
 using namespace std;
@@ -15,13 +15,19 @@ using namespace std;
 class State : public Handlers
 {
 	public:
-		State(string name, mosquitto*, appConfig *config);
+		State(const HandlerSpec&, mosquitto*);
 		// handled topic
-		void handleTopic(string topic, string msg);
+		void handleTopic(const Message &message);
+		bool handlesBatch(void);
+		void handleBatch(const MessageBatch &batch);
+		size_t saveState(char *state);
+		bool restoreState(const char *state, size_t size);
 
 	private:
+		void changeState(int current_state);
+
 		int last_state = numeric_limits<int>::max();
 		int last_count = 0;
-		map<int, int> state;
-		map<int, int> state_count;
+		LookupTable state;
+		LookupTable state_count;
 };
@@ -0,0 +1,45 @@
+#pragma once
+
+/**
+ *  Swinging Door Handler Header
+ */
+
+#include "flatmap.hpp"
+#include "handlers.hpp"
+#include "series.hpp"
+#include <mosquitto.h>
+#include <mutex>
+
+class SwingingDoor : public Handlers
+{
+	public:
+		SwingingDoor(const HandlerSpec&, mosquitto*);
+		// check if reading is stored
+		bool storeReading(const Message &message);
+		void flushReadings(bool all);
+		unsigned int getFlushInterval(void);
+
+	private:
+		// Compression state per topic, reading times in milliseconds
+		struct Door
+		{
+			Series *series;
+			bool started;
+			long int archived_time;    // last stored reading
+			double archived_value;
+			bool held;                 // last reading received, not stored yet
+			long int held_time;
+			double held_value;
+			bool idle;                 // no reading since the last flush
+			double upper;              // narrowest door slopes since archived
+			double lower;
+		};
+		FlatMap<Door> doors;
+
+		// Guards doors, flushed from the timer thread
+		mutex lock;
+
+		// Filter settings, time in milliseconds
+		double deviation = 0;
+		long int max_interval = 0;
+};
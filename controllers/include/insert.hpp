@@ -5,5 +5,11 @@
  */
 
 #include "config.hpp"
+#include "message.hpp"
+#include "series.hpp"
+#include <cstdint>
 
-extern void insert_reading(appConfig*, const char*, const char*, const char*, const char*, int);
+extern void start_writer(appConfig*);
+extern void stop_writer(void);
+extern void insert_reading(appConfig*, const Message&);
+extern void insert_reading(appConfig*, Series*, long int, double, uint32_t = 0);
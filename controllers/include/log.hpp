@@ -0,0 +1,72 @@
+#pragma once
+
+/**
+ * Logging Header
+ */
+
+#include <atomic>
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+using namespace std;
+
+// Max length of a log line, longer lines are truncated
+#define LOG_LINE_SIZE 256
+
+// Max number of log lines queued for the logging thread
+#define LOG_BUFFER_LINES 4096
+
+namespace LogLevels
+{
+	enum level { debug, info, error, none };
+}
+
+// Current runtime log level
+extern atomic<int> LogLevel;
+
+//
+// LogLine Class
+//
+// Formats one log line on the stack and queues it for the logging thread
+// when destroyed, never blocks or allocates
+//
+
+class LogLine
+{
+	public:
+		LogLine(LogLevels::level, const char*);
+		~LogLine();
+		LogLine &operator<<(string_view);
+		LogLine &operator<<(const char*);
+		LogLine &operator<<(const string&);
+		LogLine &operator<<(char);
+		LogLine &operator<<(int);
+		LogLine &operator<<(long);
+		LogLine &operator<<(long long);
+		LogLine &operator<<(unsigned int);
+		LogLine &operator<<(unsigned long);
+		LogLine &operator<<(unsigned long long);
+		LogLine &operator<<(double);
+
+	private:
+		LogLevels::level level;
+		size_t length = 0;
+		char text[LOG_LINE_SIZE];
+};
+
+// Log statements, arguments are only evaluated if the level is enabled
+#define LOG_ENABLED(level) ((level) >= LogLevel.load(memory_order_relaxed))
+#define LOG_INFO(tag) if (!LOG_ENABLED(LogLevels::info)) ; else LogLine(LogLevels::info, tag)
+#define LOG_ERROR(tag) if (!LOG_ENABLED(LogLevels::error)) ; else LogLine(LogLevels::error, tag)
+
+// Debug statements are compiled out of release (NDEBUG) builds
+#ifdef NDEBUG
+#define LOG_DEBUG(tag) if (true) ; else LogLine(LogLevels::debug, tag)
+#else
+#define LOG_DEBUG(tag) if (!LOG_ENABLED(LogLevels::debug)) ; else LogLine(LogLevels::debug, tag)
+#endif
+
+// Functions
+extern void start_logging(string);
+extern void stop_logging(void);
@@ -0,0 +1,102 @@
+#pragma once
+
+/**
+ * Integer Lookup Table Header
+ */
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+//
+// LookupTable Class
+//
+// Read only map from integer keys to integer values.  Keys spanning a small
+// range are stored as a dense array indexed by key, otherwise as sorted key
+// and value arrays searched by binary search.
+//
+
+class LookupTable
+{
+	public:
+		/**
+		 * LookupTable Class Member Function: build
+		 * Description:
+		 *   Replace the table contents, a later entry for the same key wins
+		 * Args:
+		 *   entries - key and value pairs
+		 */
+		void build(vector<pair<int, int>> entries)
+		{
+			// Sort by key, keeping the last entry of duplicate keys
+			stable_sort(entries.begin(), entries.end(), [](const pair<int, int> &a, const pair<int, int> &b) {
+				return a.first < b.first;
+			});
+			keys.clear();
+			values.clear();
+			for (auto &entry : entries) {
+				if (!keys.empty() && keys.back() == entry.first) values.back() = entry.second;
+				else {
+					keys.push_back(entry.first);
+					values.push_back(entry.second);
+				}
+			}
+
+			// Dense when the array is at most 4 times the number of keys
+			dense.clear();
+			if (keys.empty()) return;
+			long int span = (long int) keys.back() - keys.front() + 1;
+			if (span > max<long int>(64, keys.size() * 4)) return;
+
+			base = keys.front();
+			dense.assign(span, Slot{ 0, false });
+			for (size_t idx = 0; idx < keys.size(); idx++) {
+				dense[(long int) keys[idx] - base] = Slot{ values[idx], true };
+			}
+		}
+
+		/**
+		 * LookupTable Class Member Function: find
+		 * Args:
+		 *   key - key to look up
+		 * Returns:
+		 *   value or nullptr if the key isn't present
+		 */
+		const int *find(int key) const
+		{
+			if (!dense.empty()) {
+				unsigned long idx = (unsigned long) ((long int) key - base);
+				return idx < dense.size() && dense[idx].set ? &dense[idx].value : nullptr;
+			}
+
+			auto it = lower_bound(keys.begin(), keys.end(), key);
+			return it != keys.end() && *it == key ? &values[it - keys.begin()] : nullptr;
+		}
+
+		/**
+		 * LookupTable Class Member Function: size
+		 * Returns:
+		 *   number of keys
+		 */
+		size_t size(void) const
+		{
+			return keys.size();
+		}
+
+	private:
+		struct Slot
+		{
+			int value;
+			bool set;
+		};
+
+		// Sorted keys and their values
+		vector<int> keys;
+		vector<int> values;
+
+		// Dense array indexed by key - base, empty when sparse
+		long int base = 0;
+		vector<Slot> dense;
+};
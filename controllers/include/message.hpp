@@ -0,0 +1,32 @@
+#pragma once
+
+/**
+ * Message Header
+ */
+
+#include <cstdint>
+#include <string_view>
+
+using namespace std;
+
+// Structures
+// Parsed view of a received message, only valid during the message callback
+// as all views point into the mosquitto message buffers.  The payload is
+// decoded once into the reading, handlers running on a worker only get the
+// topic and the decoded values.
+typedef struct {
+	string_view topic;
+	string_view payload;
+	string_view location;
+	string_view device_type;
+	string_view device_id;
+	string_view sensor;
+	double reading;    // decoded reading
+	int value;         // reading truncated to an integer, for integer handlers
+	long int ts;       // device timestamp in seconds since epoch, 0 if none
+	uint32_t trace;    // trace id, 0 if the message isn't traced
+} Message;
+
+// Functions
+extern bool parse_topic(Message&, const char*);
+extern void set_reading(Message&, double, long int);
@@ -0,0 +1,140 @@
+#pragma once
+
+/**
+ * Metrics Header
+ */
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+// Number of per thread cells of a counter
+#define COUNTER_SHARDS 8
+
+/**
+ * Function: metrics_thread_slot
+ * Description:
+ *   Cell index of the calling thread, threads are spread round robin
+ * Returns:
+ *   cell index in [0, COUNTER_SHARDS)
+ */
+inline size_t metrics_thread_slot(void)
+{
+	static atomic<size_t> next{0};
+	thread_local size_t slot = next.fetch_add(1, memory_order_relaxed) % COUNTER_SHARDS;
+	return slot;
+}
+
+//
+// Counter Class
+//
+// Monotonic counter split in cache line sized per thread cells, so threads
+// incrementing the same counter don't contend
+//
+
+class Counter
+{
+	public:
+		void add(uint64_t count = 1)
+		{
+			cells[metrics_thread_slot()].value.fetch_add(count, memory_order_relaxed);
+		}
+
+		uint64_t value(void) const
+		{
+			uint64_t total = 0;
+			for (const Cell &cell : cells) total += cell.value.load(memory_order_relaxed);
+			return total;
+		}
+
+	private:
+		struct alignas(64) Cell
+		{
+			atomic<uint64_t> value{0};
+		};
+		Cell cells[COUNTER_SHARDS];
+};
+
+//
+// Histogram Class
+//
+// Log-linear (HDR style) histogram of nanosecond latencies, 8 sub-buckets per
+// power of two giving ~12% relative precision from 1ns to ~2 hours
+//
+
+class Histogram
+{
+	public:
+		static const size_t BUCKETS = 16 + 40 * 8;
+
+		/**
+		 * Histogram Class Member Function: record
+		 * Description:
+		 *   Record a latency
+		 * Args:
+		 *   ns - latency in nanoseconds
+		 */
+		void record(uint64_t ns)
+		{
+			buckets[bucket(ns)].fetch_add(1, memory_order_relaxed);
+			sum.fetch_add(ns, memory_order_relaxed);
+		}
+
+		static size_t bucket(uint64_t);
+		static uint64_t upperBound(size_t);
+		uint64_t count(size_t idx) const { return buckets[idx].load(memory_order_relaxed); }
+		uint64_t total(void) const { return sum.load(memory_order_relaxed); }
+
+	private:
+		atomic<uint64_t> buckets[BUCKETS] = {};
+		atomic<uint64_t> sum{0};
+};
+
+//
+// Metrics Class
+//
+// Registry of named metrics rendered in Prometheus text format
+//
+
+class Metrics
+{
+	public:
+		typedef function<double(void)> GaugeFunc;
+
+		// Functions
+		Counter &counter(string, string, string = "");
+		Histogram &histogram(string, string, string = "");
+		void gauge(string, string, string, GaugeFunc);
+		string render(void);
+
+	private:
+		// Metrics sharing a name, one entry per label set
+		struct Family
+		{
+			string help;
+			string type;
+			map<string, unique_ptr<Counter>> counters;
+			map<string, unique_ptr<Histogram>> histograms;
+			map<string, GaugeFunc> gauges;
+		};
+
+		Family &family(const string&, const string&, const string&);
+
+		mutex lock;
+		map<string, Family> families;
+};
+
+// Functions
+extern Metrics &metrics(void);
+extern string label_value(string_view);
+extern void start_metrics_server(const string&, unsigned short int);
+extern void stop_metrics_server(void);
@@ -5,11 +5,43 @@
  */
 
 #include "handlers.hpp"
+#include "topics.hpp"
+#include <map>
+#include <memory>
 #include <mosquitto.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Structures
+// Filter handler rank by name and whether this node owns it, in cluster mode
+// the node owning the lowest ranked filter matching a topic stores its
+// readings
+typedef struct {
+	size_t rank;
+	bool owned;
+} FilterOwner;
+
+// Handlers built from one handler configuration with their topic index.
+// Published as a whole to the MQTT thread and replaced on reload, handlers
+// unchanged by a reload are shared with the next set.  In cluster mode only
+// the topic handlers owned by this node are indexed, and their subscription
+// topics are subscribed.
+typedef struct {
+	vector<shared_ptr<Handlers>> handlers;
+	TopicIndex index;
+	map<string, size_t> timers;
+	unordered_map<const Handlers *, FilterOwner> filters;
+	vector<string> subscriptions;
+} HandlerSet;
 
 // Functions
 extern void start_mqtt();
-extern mosquitto *create_mqtt_client(vector<Handlers *>*);
+extern void stop_mqtt();
+extern void request_reload();
+extern mosquitto *create_mqtt_client(void);
 extern void mqtt_subscription_handler(struct mosquitto*, void*, const struct mosquitto_message*);
-extern void init_handlers(vector<Handlers *>&, mosquitto*);
-extern void start_timer_handlers(vector<Handlers *>&);
+extern void mqtt_subscription_handler_v5(struct mosquitto*, void*, const struct mosquitto_message*, const mosquitto_property*);
+extern HandlerSet *load_handlers(const vector<HandlerSpec>&, mosquitto*, HandlerSet*);
+extern void publish_handlers(HandlerSet*);
+extern void reload_handlers(mosquitto*);
@@ -0,0 +1,70 @@
+#pragma once
+
+/**
+ * DB Connection Pool Header
+ */
+
+#include <condition_variable>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <pqxx/pqxx>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+//
+// ConnectionPool Class
+//
+
+class ConnectionPool
+{
+	private:
+		// Pooled connection and the number of registered statements prepared on it
+		struct Entry
+		{
+			unique_ptr<pqxx::connection> connection;
+			size_t prepared = 0;
+		};
+
+	public:
+		//
+		// Lease of a pooled connection, returned to the pool on destruction
+		//
+		class Lease
+		{
+			public:
+				Lease(ConnectionPool*, Entry*);
+				Lease(Lease&&);
+				Lease(const Lease&) = delete;
+				~Lease();
+				pqxx::connection &operator*();
+				pqxx::connection *operator->();
+				void invalidate(void);
+
+			private:
+				ConnectionPool *pool;
+				Entry *entry;
+		};
+
+		// Functions
+		ConnectionPool(string, size_t);
+		~ConnectionPool();
+		void prepare(string, string);
+		Lease acquire(void);
+
+	private:
+		void release(Entry*);
+		void connect(Entry*);
+
+		string connection_string;
+		vector<Entry> entries;
+		vector<Entry*> idle;
+		vector<pair<string, string>> statements;
+		mutex lock;
+		condition_variable available;
+};
+
+// Global connection pool
+extern ConnectionPool *DBPool;
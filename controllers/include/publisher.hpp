@@ -0,0 +1,74 @@
+#pragma once
+
+/**
+ * Outbound Publish Stage Header
+ */
+
+#include "queue.hpp"
+#include <chrono>
+#include <cstdint>
+#include <mosquitto.h>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+
+//
+// PublishStage Class
+//
+// Queues handler commands from any thread and publishes them from the MQTT
+// network thread, optionally coalescing commands per topic and suppressing
+// repeated values
+//
+
+class PublishStage
+{
+	public:
+		// Functions
+		PublishStage(size_t, unsigned int, bool);
+		~PublishStage();
+		size_t topic(const string&);
+		bool publish(size_t, int);
+		void flush(mosquitto*, bool);
+		size_t size(void);
+
+	private:
+		// Queued command, topic id, value and trace of the message that
+		// caused it
+		typedef struct {
+			size_t topic;
+			int value;
+			uint32_t trace;
+		} Command;
+
+		// Publish topic and its last published and pending values
+		typedef struct {
+			string name;
+			uint16_t label;
+			bool published;
+			int last;
+			bool pending;
+			int value;
+			uint32_t trace;
+			chrono::steady_clock::time_point deadline;
+		} Topic;
+
+		void send(mosquitto*, Topic&, int, uint32_t);
+
+		BoundedQueue<Command> queue;
+
+		// Coalescing window, 0 publishes every command
+		chrono::milliseconds window;
+		bool suppress;
+
+		// Topics by id, only added to, and the ids of topics with a pending value
+		vector<Topic> topics;
+		unordered_map<string, size_t> ids;
+		vector<size_t> pending;
+		mutex lock;
+};
+
+// Global publish stage
+extern PublishStage *Publisher;
@@ -0,0 +1,160 @@
+#pragma once
+
+/**
+ * Bounded Lock-free Queue Header
+ */
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+using namespace std;
+
+//
+// BoundedQueue Class
+//
+// Fixed capacity lock-free queue safe for multiple producers and consumers,
+// based on per cell sequence numbers.  Elements are filled and consumed in
+// place, so elements owning buffers (e.g. strings) keep their capacity and
+// steady state pushes don't allocate.
+//
+
+template <typename T>
+class BoundedQueue
+{
+	public:
+		/**
+		 * BoundedQueue Class Member Function: BoundedQueue
+		 * Description:
+		 *   BoundedQueue Constructor
+		 * Args:
+		 *   capacity - min number of elements, rounded up to a power of two
+		 */
+		BoundedQueue(size_t capacity)
+		{
+			size_t size = 2;
+			while (size < capacity) size <<= 1;
+
+			mask = size - 1;
+			cells.reset(new Cell[size]);
+			for (size_t idx = 0; idx < size; idx++) {
+				cells[idx].sequence.store(idx, memory_order_relaxed);
+			}
+		}
+
+		/**
+		 * BoundedQueue Class Member Function: prepare
+		 * Description:
+		 *   Run a function on every element before the queue is used, e.g.
+		 *   to reserve element buffers up front
+		 * Args:
+		 *   init - callable taking a reference to an element
+		 */
+		template <typename F>
+		void prepare(F &&init)
+		{
+			for (size_t idx = 0; idx <= mask; idx++) init(cells[idx].data);
+		}
+
+		/**
+		 * BoundedQueue Class Member Function: push
+		 * Description:
+		 *   Claim a free cell, fill it in place and publish it
+		 * Args:
+		 *   fill - callable taking a reference to the element to fill
+		 * Returns:
+		 *   false if the queue is full
+		 */
+		template <typename F>
+		bool push(F &&fill)
+		{
+			Cell *cell;
+			size_t pos = enqueue_pos.load(memory_order_relaxed);
+
+			while (true) {
+				cell = &cells[pos & mask];
+				intptr_t dif = (intptr_t) cell->sequence.load(memory_order_acquire) - (intptr_t) pos;
+				if (dif == 0) {
+					if (enqueue_pos.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) break;
+				}
+				else if (dif < 0) {
+					return false;
+				}
+				else {
+					pos = enqueue_pos.load(memory_order_relaxed);
+				}
+			}
+
+			fill(cell->data);
+			cell->sequence.store(pos + 1, memory_order_release);
+			return true;
+		}
+
+		/**
+		 * BoundedQueue Class Member Function: pop
+		 * Description:
+		 *   Claim the oldest published cell, consume it in place and free it
+		 * Args:
+		 *   consume - callable taking a reference to the element
+		 * Returns:
+		 *   false if the queue is empty
+		 */
+		template <typename F>
+		bool pop(F &&consume)
+		{
+			Cell *cell;
+			size_t pos = dequeue_pos.load(memory_order_relaxed);
+
+			while (true) {
+				cell = &cells[pos & mask];
+				intptr_t dif = (intptr_t) cell->sequence.load(memory_order_acquire) - (intptr_t) (pos + 1);
+				if (dif == 0) {
+					if (dequeue_pos.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) break;
+				}
+				else if (dif < 0) {
+					return false;
+				}
+				else {
+					pos = dequeue_pos.load(memory_order_relaxed);
+				}
+			}
+
+			consume(cell->data);
+			cell->sequence.store(pos + mask + 1, memory_order_release);
+			return true;
+		}
+
+		/**
+		 * BoundedQueue Class Member Function: size
+		 * Returns:
+		 *   approximate number of queued elements
+		 */
+		size_t size(void) const
+		{
+			size_t tail = enqueue_pos.load(memory_order_relaxed);
+			size_t head = dequeue_pos.load(memory_order_relaxed);
+			return tail > head ? tail - head : 0;
+		}
+
+		/**
+		 * BoundedQueue Class Member Function: capacity
+		 * Returns:
+		 *   max number of queued elements
+		 */
+		size_t capacity(void) const
+		{
+			return mask + 1;
+		}
+
+	private:
+		struct Cell
+		{
+			atomic<size_t> sequence;
+			T data;
+		};
+
+		unique_ptr<Cell[]> cells;
+		size_t mask;
+		alignas(64) atomic<size_t> enqueue_pos{0};
+		alignas(64) atomic<size_t> dequeue_pos{0};
+};
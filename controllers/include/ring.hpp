@@ -0,0 +1,124 @@
+#pragma once
+
+/**
+ * Ring Buffer Header
+ */
+
+#include <cstddef>
+#include <memory>
+
+using namespace std;
+
+//
+// RingBuffer Class
+//
+// Fixed capacity double ended ring for one thread.  Storage is allocated
+// once by the constructor, pushes and pops never allocate.
+//
+
+template <typename T>
+class RingBuffer
+{
+	public:
+		/**
+		 * RingBuffer Class Member Function: RingBuffer
+		 * Description:
+		 *   RingBuffer Constructor
+		 * Args:
+		 *   capacity - max number of elements, at least 1
+		 */
+		RingBuffer(size_t capacity) : cells(new T[capacity ? capacity : 1]), limit{ capacity ? capacity : 1 } {}
+
+		/**
+		 * RingBuffer Class Member Function: push_back
+		 * Description:
+		 *   Add an element after the newest, the buffer must not be full
+		 * Args:
+		 *   value - element to add
+		 */
+		void push_back(const T &value)
+		{
+			cells[wrap(head + count)] = value;
+			count++;
+		}
+
+		/**
+		 * RingBuffer Class Member Function: pop_front
+		 * Description:
+		 *   Remove the oldest element, the buffer must not be empty
+		 */
+		void pop_front(void)
+		{
+			head = wrap(head + 1);
+			count--;
+		}
+
+		/**
+		 * RingBuffer Class Member Function: pop_back
+		 * Description:
+		 *   Remove the newest element, the buffer must not be empty
+		 */
+		void pop_back(void)
+		{
+			count--;
+		}
+
+		/**
+		 * RingBuffer Class Member Function: front
+		 * Returns:
+		 *   oldest element
+		 */
+		T &front(void)
+		{
+			return cells[head];
+		}
+
+		/**
+		 * RingBuffer Class Member Function: back
+		 * Returns:
+		 *   newest element
+		 */
+		T &back(void)
+		{
+			return cells[wrap(head + count - 1)];
+		}
+
+		/**
+		 * RingBuffer Class Member Function: operator[]
+		 * Args:
+		 *   idx - position from the oldest element
+		 * Returns:
+		 *   element at the position
+		 */
+		T &operator[](size_t idx)
+		{
+			return cells[wrap(head + idx)];
+		}
+
+		/**
+		 * RingBuffer Class Member Function: clear
+		 * Description:
+		 *   Remove all elements
+		 */
+		void clear(void)
+		{
+			head = 0;
+			count = 0;
+		}
+
+		size_t size(void) const { return count; }
+		size_t capacity(void) const { return limit; }
+		bool empty(void) const { return !count; }
+		bool full(void) const { return count == limit; }
+
+	private:
+		size_t wrap(size_t idx) const
+		{
+			return idx >= limit ? idx - limit : idx;
+		}
+
+		unique_ptr<T[]> cells;
+		size_t limit;
+		size_t head = 0;
+		size_t count = 0;
+};
@@ -0,0 +1,90 @@
+#pragma once
+
+/**
+ * Reading Rollup Header
+ */
+
+#include "writer.hpp"
+#include <functional>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+
+// Structures
+typedef struct {
+	const Series *series;
+	unsigned int window;
+	long int bucket;
+	long int count;
+	double min;
+	double max;
+	double sum;
+	double last;
+	long int last_ts;
+} Rollup;
+
+//
+// RollupStage Class
+//
+// Aggregates readings per series into time buckets for a set of windows and
+// hands out buckets once they can no longer change.  Closed buckets waiting
+// to be written are capped, so a DB outage can't grow them without bound.
+//
+
+class RollupStage
+{
+	public:
+		// Bucket write function, receives the buckets and the number of valid
+		// entries, throws if they couldn't be written
+		typedef function<void(const vector<Rollup>&, size_t)> WriteFunc;
+
+		// Functions
+		RollupStage(vector<unsigned int>, unsigned int, size_t);
+		void add(const vector<Reading>&, size_t);
+		void drain(bool, WriteFunc);
+		size_t size(void);
+
+	private:
+		// Bucket statistics, an empty bucket has no readings
+		typedef struct {
+			long int start;
+			long int count;
+			double min;
+			double max;
+			double sum;
+			double last;
+			long int last_ts;
+		} Bucket;
+
+		// Series and its bucket ring per window
+		typedef struct {
+			const Series *series;
+			vector<Bucket> buckets;
+		} SeriesBuckets;
+
+		void close(const SeriesBuckets&, unsigned int, const Bucket&);
+
+		// Windows in seconds, open buckets kept per window and grace period
+		vector<unsigned int> windows;
+		unsigned int grace;
+		size_t slots;
+
+		// Bucket rings by interned series
+		unordered_map<const Series *, SeriesBuckets> series;
+
+		// Latest reading time seen and the earliest time an open bucket closes
+		long int watermark = 0;
+		long int next_close = 0;
+
+		// Closed buckets waiting to be written, at most max_closed, and open
+		// bucket count
+		vector<Rollup> closed;
+		size_t max_closed;
+		size_t pending = 0;
+		size_t open = 0;
+
+		mutex lock;
+};
@@ -0,0 +1,64 @@
+#pragma once
+
+/**
+ * Series Index Header
+ */
+
+#include "flatmap.hpp"
+#include "message.hpp"
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+using namespace std;
+
+// Structures
+// Series of readings, the topic levels the readings arrive on.  Interned
+// once per process and never freed, so a pointer to it stays valid.  The id
+// is the series table id, 0 until the DB writer has upserted the series.
+// Samples counts the readings seen by the DB writer's sampling, guarded by
+// the writer lock.
+struct Series
+{
+	string location;
+	string device_type;
+	string device_id;
+	string sensor;
+	uint32_t index;
+	atomic<int32_t> id{0};
+	uint32_t samples = 0;
+};
+
+//
+// SeriesIndex Class
+//
+// Interns series by topic, so readings reference their series instead of
+// copying its names.  Safe to use from any thread.
+//
+
+class SeriesIndex
+{
+	public:
+		// Functions
+		Series *intern(const Message&);
+		Series *intern(string_view, string_view, string_view, string_view);
+		Series *at(uint32_t);
+		size_t size(void);
+
+	private:
+		Series *find(string_view, string_view, string_view, string_view, string_view);
+
+		// Series by <location>/<device_type>/<device_id>/<sensor>, and all
+		// series in the order interned
+		FlatMap<Series *> ids;
+		vector<unique_ptr<Series>> entries;
+		string key;
+		mutex lock;
+};
+
+// Functions
+extern SeriesIndex &series(void);
@@ -0,0 +1,94 @@
+#pragma once
+
+/**
+ * Reading Spool Header
+ */
+
+#include "writer.hpp"
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+//
+// ReadingSpool Class
+//
+// Durable write-ahead queue of readings in memory mapped segment files,
+// drained to the DB by a background thread.  Readings are only removed once
+// written, so they survive DB outages and restarts.
+//
+
+class ReadingSpool
+{
+	public:
+		typedef ReadingWriter::FlushFunc FlushFunc;
+
+		// Functions
+		ReadingSpool(string, size_t, size_t, size_t, unsigned int, FlushFunc);
+		~ReadingSpool();
+		bool append(const Series*, long int, double);
+		void start(void);
+		void stop(void);
+		size_t size(void);
+		size_t bytes(void);
+
+	private:
+		// Spool position, segment sequence number and byte offset
+		typedef struct {
+			uint64_t seq;
+			uint64_t offset;
+		} Position;
+
+		// Mapped segment file
+		typedef struct {
+			uint64_t seq;
+			char *data;
+		} Segment;
+
+		// Last committed position, kept in a mapped checkpoint file
+		typedef struct {
+			uint64_t magic;
+			Position position;
+			uint64_t check;
+		} Checkpoint;
+
+		void open(void);
+		bool create(uint64_t);
+		void close(void);
+		string path(uint64_t);
+		Segment *find(uint64_t);
+		Segment *next(uint64_t);
+		size_t scan(const Segment&, size_t, size_t*);
+		size_t read(vector<Reading>&, Position&);
+		void commit(const Position&);
+		void run(void);
+
+		// Segment files
+		string dir;
+		size_t segment_size;
+		size_t max_segments;
+		deque<Segment> segments;
+		Checkpoint *checkpoint = nullptr;
+
+		// Append position and readings not yet written
+		Position head;
+		size_t pending = 0;
+
+		// Flush thresholds
+		size_t batch_size;
+		chrono::milliseconds flush_interval;
+		FlushFunc flush;
+
+		// Drain thread
+		mutex lock;
+		condition_variable ready;
+		bool running = false;
+		thread drainer;
+};
@@ -0,0 +1,57 @@
+#pragma once
+
+/**
+ * Timer Service Header
+ */
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+//
+// TimerService Class
+//
+
+class TimerService
+{
+	public:
+		typedef function<void(void)> Callback;
+
+		// Functions
+		TimerService();
+		~TimerService();
+		void start(void);
+		void stop(void);
+		size_t schedule(chrono::milliseconds, Callback);
+		void cancel(size_t);
+
+	private:
+		// Periodic timer, ordered by next deadline in a min-heap
+		struct Timer
+		{
+			chrono::steady_clock::time_point next;
+			chrono::milliseconds interval;
+			size_t callback;
+		};
+
+		void run(void);
+
+		vector<Timer> heap;
+		deque<Callback> callbacks;
+		vector<size_t> free_ids;
+		size_t active = SIZE_MAX;
+		mutex lock;
+		condition_variable changed;
+		bool running = false;
+		thread runner;
+};
+
+// Global timer service
+extern TimerService *Timers;
@@ -0,0 +1,99 @@
+#pragma once
+
+/**
+ * Topic Index Header
+ */
+
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+class Handlers;
+
+//
+// TopicIndex Class
+//
+
+class TopicIndex
+{
+	public:
+		// Functions
+		TopicIndex();
+		~TopicIndex();
+		TopicIndex(const TopicIndex&) = delete;
+		TopicIndex &operator=(const TopicIndex&) = delete;
+		void add(string_view, Handlers*);
+		size_t size(void);
+
+		/**
+		 * TopicIndex Class Member Function: match
+		 * Description:
+		 *   Call fn for every handler whose subscription filter matches the
+		 *   topic.  Cost depends on the topic depth, not the handler count.
+		 * Args:
+		 *   topic - MQTT topic of a received message
+		 *   fn - callable taking a Handlers pointer
+		 */
+		template <typename F>
+		void match(string_view topic, F &&fn) const
+		{
+			// Wildcards at the first level don't match $ topics (e.g. $SYS)
+			bool system = !topic.empty() && topic[0] == '$';
+			matchNode(root, topic, false, !system, fn);
+		}
+
+	private:
+		// Trie node for one topic level
+		struct Node
+		{
+			vector<pair<string, Node*>> children;    // exact levels sorted by name
+			Node *plus = nullptr;                    // '+' level
+			vector<Handlers*> handlers;              // filters ending at this level
+			vector<Handlers*> multi;                 // '#' filters below this level
+		};
+
+		Node *child(Node*, string_view);
+		const Node *find(const Node*, string_view) const;
+		void destroy(Node*);
+
+		/**
+		 * TopicIndex Class private Member Function: matchNode
+		 * Description:
+		 *   Match the remaining topic levels against a trie node
+		 * Args:
+		 *   node - current trie node
+		 *   rest - remaining topic levels
+		 *   done - true if all topic levels were consumed
+		 *   wildcards - false to skip wildcard filters for this level
+		 *   fn - callable taking a Handlers pointer
+		 */
+		template <typename F>
+		void matchNode(const Node *node, string_view rest, bool done, bool wildcards, F &fn) const
+		{
+			// '#' matches the parent level and any number of levels below
+			if (wildcards) {
+				for (Handlers *handler : node->multi) fn(handler);
+			}
+
+			if (done) {
+				for (Handlers *handler : node->handlers) fn(handler);
+				return;
+			}
+
+			// Split off the next level
+			size_t slash = rest.find('/');
+			string_view level = rest.substr(0, slash);
+			string_view next = slash == string_view::npos ? string_view() : rest.substr(slash + 1);
+			bool last = slash == string_view::npos;
+
+			const Node *exact = find(node, level);
+			if (exact) matchNode(exact, next, last, true, fn);
+			if (wildcards && node->plus) matchNode(node->plus, next, last, true, fn);
+		}
+
+		Node *root;
+		size_t count = 0;
+};
@@ -0,0 +1,45 @@
+#pragma once
+
+/**
+ * Message Tracing Header
+ */
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+using namespace std;
+
+// Pipeline points stamped for a traced message
+namespace TraceStages
+{
+	enum type { receive, dispatch, handler_enter, handler_exit, publish_queue, publish, db_queue, db_commit };
+}
+
+// Trace 1 of every TraceRate messages, 0 if tracing is off
+extern unsigned int TraceRate;
+
+// Trace of the message run by the calling thread's handler, 0 if none
+extern thread_local uint32_t TraceCurrent;
+
+// Functions
+extern void start_tracing(unsigned int, size_t);
+extern uint32_t next_trace(void);
+extern void trace_event(uint32_t, TraceStages::type, uint16_t = 0);
+extern uint16_t trace_label(const string&);
+extern void request_trace_dump(void);
+extern bool trace_dump_requested(void);
+extern bool write_trace(const string&);
+
+/**
+ * Function: trace_sample
+ * Description:
+ *   Decide whether a received message is traced, a single load when
+ *   tracing is off
+ * Returns:
+ *   trace id, 0 if the message isn't traced
+ */
+inline uint32_t trace_sample(void)
+{
+	return TraceRate ? next_trace() : 0;
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+/**
+ * Handler Worker Pool Header
+ */
+
+#include "batch.hpp"
+#include "handlers.hpp"
+#include "message.hpp"
+#include "queue.hpp"
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+// Structures
+namespace JobTypes
+{
+	enum type { message, timeout, snapshot, batch };
+}
+
+// Handler invocation queued for a worker with the decoded message reading
+// and trace id, the topic string is reused between jobs, or with a message
+// batch owned by the batch stage.  A job without a handler marks a drain() barrier.
+typedef struct {
+	Handlers *handler;
+	JobTypes::type type;
+	string topic;
+	double reading;
+	long int ts;
+	uint32_t trace;
+	MessageBatch *batch;
+	atomic<size_t> *snapshots;    // snapshots left to take, for a snapshot job
+} Job;
+
+//
+// WorkerPool Class
+//
+
+class WorkerPool
+{
+	public:
+		// Functions
+		WorkerPool(size_t, size_t);
+		~WorkerPool();
+		void start(void);
+		void stop(void);
+		void dispatch(Handlers*, const Message&);
+		void dispatchTimeout(Handlers*);
+		void dispatchSnapshot(Handlers*, atomic<size_t>*);
+		void dispatchBatch(Handlers*, MessageBatch*);
+		void drain(void);
+		size_t size(void);
+
+	private:
+		// Worker thread with its own job queue
+		struct Worker
+		{
+			Worker(size_t capacity) : queue(capacity) {}
+			BoundedQueue<Job> queue;
+			mutex lock;
+			condition_variable ready;
+			atomic<bool> sleeping{false};
+			atomic<unsigned long> barriers{0};
+			thread runner;
+		};
+
+		template <typename F> void push(Handlers*, F&&);
+		template <typename F> void push(Worker*, F&&);
+		void run(Worker*);
+
+		vector<unique_ptr<Worker>> workers;
+		atomic<bool> running{false};
+};
+
+// Global handler worker pool
+extern WorkerPool *Workers;
@@ -0,0 +1,109 @@
+#pragma once
+
+/**
+ * Reading Writer Header
+ */
+
+#include "series.hpp"
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+namespace OverloadPolicies
+{
+	enum type { hold, drop_newest, drop_oldest, sample };
+}
+
+// Structures
+// What the writer queue does with readings it can't keep up with.  Hold
+// keeps readings in a second buffer of the queue size for up to
+// hold_timeout milliseconds until there is space, then drops them, so a
+// short DB stall loses nothing but ingest never waits.  Sample keeps 1 of
+// every sample_rate readings per series once the queue is half full.  The
+// queue is the readings lane, commands take the handler worker and publish
+// queues (see WorkerPool and PublishStage).
+typedef struct {
+	OverloadPolicies::type policy = OverloadPolicies::drop_newest;
+	unsigned int sample_rate = 10;
+	unsigned int hold_timeout = 100;
+} OverloadSettings;
+
+// Reading of an interned series
+typedef struct {
+	Series *series;
+	long int ts;
+	double reading;
+	uint32_t trace;    // trace id of the message, 0 if not traced
+} Reading;
+
+//
+// ReadingWriter Class
+//
+
+class ReadingWriter
+{
+	public:
+		// Batch flush function, receives the batch and the number of valid
+		// entries, returns false if the batch couldn't be written
+		typedef function<bool(const vector<Reading>&, size_t)> FlushFunc;
+
+		// Functions
+		ReadingWriter(size_t, size_t, unsigned int, size_t, const OverloadSettings&, FlushFunc);
+		~ReadingWriter();
+		bool enqueue(Series*, long int, double, uint32_t = 0);
+		void start(void);
+		void stop(void);
+		size_t size(void);
+
+	private:
+		// Reading held back by the hold policy and when it was held back
+		typedef struct {
+			Reading reading;
+			chrono::steady_clock::time_point since;
+		} Deferred;
+
+		void run(void);
+		bool admit(Series*);
+		void store(const Reading&);
+		bool defer(const Reading&);
+		void expire(chrono::steady_clock::time_point);
+		void release(void);
+
+		// Bounded queue of reused slots
+		vector<Reading> slots;
+		size_t head = 0;
+		size_t count = 0;
+		size_t dropped = 0;
+
+		// Overload handling, readings held back by the hold policy in order
+		// until there is space
+		OverloadSettings overload;
+		vector<Deferred> backlog;
+		size_t backlog_head = 0;
+		size_t waiting = 0;
+
+		// Flush thresholds
+		size_t batch_size;
+		chrono::milliseconds flush_interval;
+		FlushFunc flush;
+
+		// Writer threads
+		mutex lock;
+		condition_variable ready;
+		bool running = false;
+		size_t threads;
+		vector<thread> workers;
+};
+
+// Functions
+extern bool parse_overload_policy(const string&, OverloadPolicies::type&);
@@ -0,0 +1,188 @@
+/**
+ * Capture Replay
+ *
+ * Feeds the messages of a capture file (CAPTURE_FILE of a controller run)
+ * through mqtt_subscription_handler and the configured handlers, with the
+ * benchmark stub mosquitto client and file DB sink in place of the broker
+ * and the DB.  Reports throughput and writes the published commands, so
+ * the output of two builds can be compared with diff.
+ *
+ * Settings (environment):
+ *   REPLAY_FILE    - capture file to replay
+ *   REPLAY_SPEED   - replay speed, 1 replays at the captured pace, N at N
+ *                    times the pace and max as fast as possible (default 1)
+ *   REPLAY_OUTPUT  - file receiving the published commands as
+ *                    "<topic> <value>" lines, empty disables (default empty)
+ *   BENCH_DB_FILE  - file receiving the DB rows as CSV (default /dev/null)
+ * The controller settings (HANDLER_CONFIG_FILE, HANDLER_THREADS,
+ * PAYLOAD_CODECS, ...) apply as usual.  Commands are published in the same
+ * order by every run only with HANDLER_THREADS=0 and without timer handlers
+ * or publish coalescing, which run on the wall clock.
+ */
+
+#include "bench.hpp"
+#include "batch.hpp"
+#include "capture.hpp"
+#include "codec.hpp"
+#include "config.hpp"
+#include "insert.hpp"
+#include "log.hpp"
+#include "mqtt.hpp"
+#include "publisher.hpp"
+#include "timers.hpp"
+#include "workers.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <memory>
+#include <mosquitto.h>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+using namespace std;
+
+appConfig *Config;
+WorkerPool *Workers;
+TimerService *Timers;
+PublishStage *Publisher;
+BatchStage *Batcher;
+
+/**
+ * Function: flush_stages
+ * Description:
+ *   Run due batches and publish queued commands, as the network loop does
+ *   between messages
+ */
+static void flush_stages(void)
+{
+	if (Batcher) Batcher->flush(false);
+	Publisher->flush(nullptr, false);
+}
+
+/**
+ *  Function: main
+ *  Description:
+ *    Replay start point
+ */
+int main(int argc, char **argv)
+{
+	string path = get_env("REPLAY_FILE", "");
+	string speed_setting = get_env("REPLAY_SPEED", "1");
+	string output = get_env("REPLAY_OUTPUT", "");
+
+	start_logging(get_env("LOG_LEVEL", "error"));
+
+	// 0 replays as fast as possible
+	double speed = 0;
+	if (speed_setting != "max") {
+		try
+		{
+			speed = stod(speed_setting);
+		}
+		catch (const exception &e)
+		{
+			speed = -1;
+		}
+		if (speed <= 0) {
+			LOG_ERROR("replay") << "Exiting, REPLAY_SPEED must be a positive number or max";
+			stop_logging();
+			return 1;
+		}
+	}
+
+	unique_ptr<CaptureReader> reader;
+	try
+	{
+		reader.reset(new CaptureReader(path));
+	}
+	catch (const runtime_error &e)
+	{
+		LOG_ERROR("replay") << "Exiting, " << e.what();
+		stop_logging();
+		return 1;
+	}
+
+	// Controller setup as in main() against the stubs
+	Config = process_env();
+	if (!load_handler_config(Config->handlers) || !set_payload_codecs(Config->payload_codecs)) {
+		LOG_ERROR("replay") << "Exiting, invalid configuration";
+		stop_logging();
+		return 1;
+	}
+
+	if (!output.empty()) {
+		BenchPublishFile = fopen(output.c_str(), "w");
+		if (!BenchPublishFile) {
+			LOG_ERROR("replay") << "Exiting, can't write " << output;
+			stop_logging();
+			return 1;
+		}
+	}
+
+	start_writer(Config);
+	Workers = new WorkerPool(Config->handler_threads, Config->handler_queue_size);
+	Workers->start();
+	if (Config->batch_interval) Batcher = new BatchStage(Config->batch_size, Config->batch_interval);
+	Publisher = new PublishStage(Config->publish_queue_size, Config->publish_coalesce, Config->publish_suppress_repeats);
+	Timers = new TimerService();
+	Timers->start();
+
+	publish_handlers(load_handlers(Config->handlers, nullptr, nullptr));
+
+	// Replay, paced by the capture times unless at max speed
+	CapturedMessage captured;
+	struct mosquitto_message message = {};
+	unsigned long count = 0;
+	uint64_t first = 0;
+	uint64_t last = 0;
+	auto start = chrono::steady_clock::now();
+
+	while (reader->next(captured)) {
+		if (!count) first = captured.time;
+		last = captured.time;
+
+		if (speed > 0) {
+			auto due = start + chrono::nanoseconds((uint64_t) ((captured.time - first) / speed));
+			while (chrono::steady_clock::now() < due) {
+				flush_stages();
+				this_thread::sleep_until(min(due, chrono::steady_clock::now() + chrono::milliseconds(1)));
+			}
+		}
+
+		message.topic = (char *) captured.topic;
+		message.payload = (void *) captured.payload.data();
+		message.payloadlen = captured.payload.size();
+		mqtt_subscription_handler(nullptr, nullptr, &message);
+		flush_stages();
+		count++;
+	}
+
+	// Run everything still queued, as the controller does on shutdown
+	publish_handlers(nullptr);
+	delete Timers;
+	if (Batcher) Batcher->flush(true);
+	delete Workers;
+	delete Batcher;
+	Publisher->flush(nullptr, true);
+	auto elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	stop_writer();
+	delete Publisher;
+
+	if (BenchPublishFile) fclose(BenchPublishFile);
+	stop_logging();
+
+	cout << "==> Controller replay" << endl
+		<< "capture:           " << path << endl
+		<< "speed:             " << (speed > 0 ? speed_setting + "x" : "max") << endl
+		<< "messages:          " << count << endl
+		<< "captured (s):      " << (last - first) / 1e9 << endl
+		<< "elapsed (s):       " << elapsed << endl
+		<< "msgs/sec:          " << (unsigned long) (count / max(elapsed, 1e-9)) << endl
+		<< "publishes:         " << BenchPublishes.load() << endl
+		<< "db rows:           " << BenchRows.load() << endl;
+
+	delete Config;
+	return 0;
+}
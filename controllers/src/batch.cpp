@@ -0,0 +1,131 @@
+/**
+ * Micro-batch Stage
+ *
+ * With batching enabled, messages for handlers that take batches aren't
+ * dispatched one by one.  The MQTT thread appends each reading to the
+ * column batch of the handler, and every BATCH_INTERVAL milliseconds the
+ * network loop sends the batches to the handlers' workers, where the handler
+ * evaluates each column in one loop.  Other handlers keep the per message
+ * path.
+ *
+ * A reload flushes the batches from the reload thread while the MQTT thread
+ * keeps filling them.  Batches are dispatched while holding the lock they
+ * are filled under, so a batch closed by a flush always reaches the worker
+ * before a later batch of the same handler.
+ */
+
+#include "batch.hpp"
+#include "handlers.hpp"
+#include "series.hpp"
+#include "workers.hpp"
+#include <algorithm>
+#include <ctime>
+
+using namespace std;
+
+//
+// BatchStage Class
+//
+
+/**
+ * BatchStage Class Member Function: BatchStage
+ * Description:
+ *   BatchStage Constructor
+ * Args:
+ *   capacity - max readings per batch, a full batch is sent right away
+ *   interval - milliseconds between sending batches
+ */
+BatchStage::BatchStage(size_t capacity, unsigned int interval) :
+	capacity{ max(capacity, (size_t) 1) }, interval{ interval }, due{ chrono::steady_clock::now() + this->interval }
+{
+}
+
+/**
+ * BatchStage Class Member Function: add
+ * Description:
+ *   Append a message reading to the batch of a handler
+ * Args:
+ *   handler - handler taking batches
+ *   message - message for the handler
+ */
+void BatchStage::add(Handlers *handler, const Message &message)
+{
+	uint32_t id = series().intern(message)->index;
+	unique_lock<mutex> guard(lock);
+
+	OpenBatch &entry = open[handler];
+	if (!entry.batch) {
+		entry.batch = acquire();
+		if (!entry.listed) pending.push_back(handler);
+		entry.listed = true;
+	}
+	entry.batch->append(id, message.ts ? message.ts : (long int) time(nullptr), message.value, message.reading);
+
+	// A full batch is sent right away, without workers it runs inline and
+	// is released
+	if (entry.batch->full()) {
+		MessageBatch *full = entry.batch;
+		entry.batch = nullptr;
+		Workers->dispatchBatch(handler, full);
+	}
+}
+
+/**
+ * BatchStage Class Member Function: flush
+ * Description:
+ *   Send the open batches to the handler workers once the interval has
+ *   passed
+ * Args:
+ *   all - send the open batches now, e.g. before handlers are released
+ */
+void BatchStage::flush(bool all)
+{
+	unique_lock<mutex> guard(lock);
+	auto now = chrono::steady_clock::now();
+	if (!all && now < due) return;
+	due = now + interval;
+
+	for (Handlers *handler : pending) {
+		OpenBatch &entry = open[handler];
+		MessageBatch *batch = entry.batch;
+		entry.batch = nullptr;
+		entry.listed = false;
+		if (batch) Workers->dispatchBatch(handler, batch);
+	}
+	pending.clear();
+}
+
+/**
+ * BatchStage Class Member Function: release
+ * Description:
+ *   Return a batch a handler is done with, called from the worker
+ * Args:
+ *   batch - batch to reuse
+ */
+void BatchStage::release(MessageBatch *batch)
+{
+	unique_lock<mutex> guard(spare_lock);
+	batch->count = 0;
+	spare.push_back(batch);
+}
+
+/**
+ * BatchStage Class private Member Function: acquire
+ * Description:
+ *   Get an empty batch, allocating one only if none is spare, lock must be
+ *   held
+ * Returns:
+ *   empty batch
+ */
+MessageBatch *BatchStage::acquire(void)
+{
+	unique_lock<mutex> guard(spare_lock);
+	if (spare.empty()) {
+		batches.push_back(unique_ptr<MessageBatch>(new MessageBatch(capacity)));
+		return batches.back().get();
+	}
+
+	MessageBatch *batch = spare.back();
+	spare.pop_back();
+	return batch;
+}
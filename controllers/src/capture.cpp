@@ -0,0 +1,222 @@
+/**
+ * Message Capture
+ *
+ * Records the messages received from the broker, topic, payload and receive
+ * time, to a memory mapped capture file, and reads them back for replay.
+ * The file is allocated to its max size when opened and truncated to the
+ * recorded messages when closed.  The header counts the recorded bytes
+ * after every message, so a capture cut short by a crash can still be read.
+ *
+ * File layout, native byte order:
+ *   header: uint64 magic, uint32 version, uint32 reserved, uint64 start
+ *           (wall clock nanoseconds since epoch), uint64 recorded bytes
+ *   records: uint64 time (nanoseconds since start), uint32 payload length,
+ *           uint16 topic length, uint16 reserved, topic, NUL, payload
+ */
+
+#include "capture.hpp"
+#include "log.hpp"
+#include "metrics.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+// File identifier and layout version
+#define CAPTURE_MAGIC 0x4d51545443415031ull
+#define CAPTURE_VERSION 1
+
+// Header and fixed record sizes
+#define CAPTURE_HEADER 32
+#define RECORD_FIXED 16
+
+// Metrics
+static Counter &captured = metrics().counter("controller_captured_messages_total", "Received messages recorded to the capture file");
+
+//
+// MessageCapture Class
+//
+
+/**
+ * MessageCapture Class Member Function: MessageCapture
+ * Description:
+ *   MessageCapture Constructor, creates or overwrites the capture file and
+ *   maps it.  Throws runtime_error if the file can't be created.
+ * Args:
+ *   path - capture file path
+ *   size - max capture file size in bytes
+ */
+MessageCapture::MessageCapture(string path, size_t size) : path{ path }, capacity{ size > CAPTURE_HEADER ? size : CAPTURE_HEADER }
+{
+	fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) throw runtime_error("Can't open " + path + ": " + strerror(errno));
+
+	// Allocated, so writing the mapping can't fault on a full disk
+	int ret = posix_fallocate(fd, 0, capacity);
+	void *mapped = ret ? MAP_FAILED : mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (mapped == MAP_FAILED) {
+		::close(fd);
+		throw runtime_error("Can't allocate " + path + ": " + strerror(ret ? ret : errno));
+	}
+	data = (char *) mapped;
+
+	uint64_t magic = CAPTURE_MAGIC;
+	uint32_t version = CAPTURE_VERSION;
+	uint64_t started = chrono::duration_cast<chrono::nanoseconds>(chrono::system_clock::now().time_since_epoch()).count();
+	memset(data, 0, CAPTURE_HEADER);
+	memcpy(data, &magic, sizeof(magic));
+	memcpy(data + 8, &version, sizeof(version));
+	memcpy(data + 16, &started, sizeof(started));
+	start = chrono::steady_clock::now();
+
+	LOG_INFO("capture") << "Capturing messages to " << path << ", max size = " << capacity;
+}
+
+/**
+ * MessageCapture Class Member Function: ~MessageCapture
+ * Description:
+ *   MessageCapture Destructor, truncates the file to the recorded messages
+ *   and closes it
+ */
+MessageCapture::~MessageCapture()
+{
+	munmap(data, capacity);
+	if (ftruncate(fd, CAPTURE_HEADER + used)) {
+		LOG_ERROR("capture") << "Can't truncate " << path << ": " << strerror(errno);
+	}
+	::close(fd);
+
+	LOG_INFO("capture") << "Captured " << messages << " messages to " << path;
+}
+
+/**
+ * MessageCapture Class Member Function: record
+ * Description:
+ *   Record a received message with the time since the capture started.
+ *   Must only be called from one thread at a time.
+ * Args:
+ *   topic - NUL terminated message topic
+ *   payload - message payload
+ *   length - payload size
+ * Returns:
+ *   false if the capture file is full
+ */
+bool MessageCapture::record(const char *topic, const void *payload, size_t length)
+{
+	uint64_t time = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+	size_t topic_length = strlen(topic);
+	size_t size = RECORD_FIXED + topic_length + 1 + length;
+
+	if (full) return false;
+	if (topic_length > UINT16_MAX || length > UINT32_MAX || CAPTURE_HEADER + used + size > capacity) {
+		full = true;
+		LOG_ERROR("capture") << "Capture file " << path << " full after " << messages << " messages";
+		return false;
+	}
+
+	char *record = data + CAPTURE_HEADER + used;
+	uint32_t payload_length = length;
+	uint16_t topic_size = topic_length;
+	memcpy(record, &time, sizeof(time));
+	memcpy(record + 8, &payload_length, sizeof(payload_length));
+	memcpy(record + 12, &topic_size, sizeof(topic_size));
+	memset(record + 14, 0, 2);
+	memcpy(record + RECORD_FIXED, topic, topic_length + 1);
+	if (length) memcpy(record + RECORD_FIXED + topic_length + 1, payload, length);
+
+	// Count the record last, a crash never leaves a partial record counted
+	used += size;
+	uint64_t recorded = used;
+	memcpy(data + 24, &recorded, sizeof(recorded));
+
+	messages++;
+	captured.add();
+	return true;
+}
+
+//
+// CaptureReader Class
+//
+
+/**
+ * CaptureReader Class Member Function: CaptureReader
+ * Description:
+ *   CaptureReader Constructor, maps a capture file.  Throws runtime_error if
+ *   the file can't be read or isn't a capture.
+ * Args:
+ *   path - capture file path
+ */
+CaptureReader::CaptureReader(string path)
+{
+	int fd = ::open(path.c_str(), O_RDONLY);
+	struct stat info;
+	if (fd < 0 || fstat(fd, &info)) {
+		if (fd >= 0) ::close(fd);
+		throw runtime_error("Can't open " + path + ": " + strerror(errno));
+	}
+
+	length = info.st_size;
+	void *mapped = length >= CAPTURE_HEADER ? mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+	::close(fd);
+	if (mapped == MAP_FAILED) throw runtime_error("Can't map " + path);
+	data = (const char *) mapped;
+
+	uint64_t magic;
+	uint32_t version;
+	uint64_t recorded;
+	memcpy(&magic, data, sizeof(magic));
+	memcpy(&version, data + 8, sizeof(version));
+	memcpy(&recorded, data + 24, sizeof(recorded));
+	if (magic != CAPTURE_MAGIC || version != CAPTURE_VERSION) {
+		munmap((void *) data, length);
+		throw runtime_error(path + " isn't a capture file");
+	}
+
+	end = CAPTURE_HEADER + min((uint64_t) (length - CAPTURE_HEADER), recorded);
+	offset = CAPTURE_HEADER;
+}
+
+/**
+ * CaptureReader Class Member Function: ~CaptureReader
+ * Description:
+ *   CaptureReader Destructor, unmaps the capture file
+ */
+CaptureReader::~CaptureReader()
+{
+	munmap((void *) data, length);
+}
+
+/**
+ * CaptureReader Class Member Function: next
+ * Description:
+ *   Read the next captured message
+ * Args:
+ *   message - set to the message, valid while the reader exists
+ * Returns:
+ *   false once all messages were read
+ */
+bool CaptureReader::next(CapturedMessage &message)
+{
+	if (offset + RECORD_FIXED > end) return false;
+
+	const char *record = data + offset;
+	uint32_t payload_length;
+	uint16_t topic_length;
+	memcpy(&message.time, record, sizeof(message.time));
+	memcpy(&payload_length, record + 8, sizeof(payload_length));
+	memcpy(&topic_length, record + 12, sizeof(topic_length));
+
+	size_t size = RECORD_FIXED + topic_length + 1 + payload_length;
+	if (offset + size > end) return false;
+
+	message.topic = record + RECORD_FIXED;
+	message.payload = string_view(message.topic + topic_length + 1, payload_length);
+	offset += size;
+	return true;
+}
@@ -0,0 +1,318 @@
+/**
+ * Handler State Checkpoint
+ *
+ * Stateful handlers (hysteresis, state, scheduler) keep their state in
+ * memory only.  The checkpoint saves it to a memory mapped file: each
+ * handler copies its state between its own messages on its worker, and
+ * once all copies are taken the records are written to the mapping and the
+ * header is updated.  The network thread only queues the copies and polls
+ * for them, so message dispatch never waits for a save.  On
+ * startup a handler is restored from the record with its configuration
+ * fingerprint, so handlers whose configuration changed start fresh while
+ * the others keep their state.
+ *
+ * File layout, native byte order:
+ *   header: uint64 magic, uint32 version, uint32 count, uint64 generation,
+ *           uint64 check (CRC-32 of magic, version, count and generation)
+ *   count records: uint64 fingerprint, uint32 size, uint32 checksum
+ *           (CRC-32 of fingerprint, size and state), state[48]
+ * A record torn by a crash fails its checksum and its handler starts fresh.
+ */
+
+#include "checkpoint.hpp"
+#include "log.hpp"
+#include "metrics.hpp"
+#include "workers.hpp"
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+// File identifier and layout version, the version changes when a handler
+// changes the layout of its saved state
+#define CHECKPOINT_MAGIC 0x4853544154453031ull
+#define CHECKPOINT_VERSION 2
+
+// Metrics
+static Counter &checkpoints = metrics().counter("controller_checkpoints_total", "Handler state checkpoints saved");
+
+/**
+ * Function: crc32
+ * Description:
+ *   Continue a CRC-32 (IEEE) over more data
+ * Args:
+ *   crc - CRC of the preceding data, 0 to start
+ *   data - data
+ *   length - data size
+ * Returns:
+ *   CRC of the preceding data and data
+ */
+static uint32_t crc32(uint32_t crc, const void *data, size_t length)
+{
+	crc = ~crc;
+	for (size_t idx = 0; idx < length; idx++) {
+		crc ^= ((const unsigned char *) data)[idx];
+		for (int bit = 0; bit < 8; bit++) crc = (crc >> 1) ^ (0xedb88320u & -(crc & 1));
+	}
+	return ~crc;
+}
+
+/**
+ * Function: checksum
+ * Description:
+ *   CRC-32 of a record, without its checksum field
+ * Args:
+ *   fingerprint - handler configuration fingerprint
+ *   size - state size
+ *   state - saved state
+ * Returns:
+ *   32 bit checksum
+ */
+static uint32_t checksum(uint64_t fingerprint, uint32_t size, const char *state)
+{
+	uint32_t crc = crc32(0, &fingerprint, sizeof(fingerprint));
+	crc = crc32(crc, &size, sizeof(size));
+	return crc32(crc, state, size);
+}
+
+/**
+ * Function: checksum
+ * Description:
+ *   CRC-32 of the header fields, without its check field
+ * Args:
+ *   magic - file identifier
+ *   version - layout version
+ *   count - number of records
+ *   generation - save count
+ * Returns:
+ *   32 bit checksum
+ */
+static uint32_t checksum(uint64_t magic, uint32_t version, uint32_t count, uint64_t generation)
+{
+	uint32_t crc = crc32(0, &magic, sizeof(magic));
+	crc = crc32(crc, &version, sizeof(version));
+	crc = crc32(crc, &count, sizeof(count));
+	return crc32(crc, &generation, sizeof(generation));
+}
+
+//
+// StateCheckpoint Class
+//
+
+/**
+ * StateCheckpoint Class Member Function: StateCheckpoint
+ * Description:
+ *   StateCheckpoint Constructor, opens or creates the checkpoint file and
+ *   indexes the valid records.  Throws runtime_error if the file can't be
+ *   opened.
+ * Args:
+ *   path - checkpoint file path
+ */
+StateCheckpoint::StateCheckpoint(string path) : path{ path }
+{
+	fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+	struct stat info;
+	if (fd < 0 || fstat(fd, &info)) {
+		if (fd >= 0) ::close(fd);
+		throw runtime_error("Can't open " + path + ": " + strerror(errno));
+	}
+
+	// Map the records the file already holds
+	size_t length = info.st_size;
+	if (!map(length > sizeof(Header) ? (length - sizeof(Header)) / sizeof(Record) : 0)) {
+		::close(fd);
+		throw runtime_error("Can't map " + path);
+	}
+
+	if (header->magic != CHECKPOINT_MAGIC || header->version != CHECKPOINT_VERSION ||
+		header->check != checksum(header->magic, header->version, header->count, header->generation) ||
+		header->count > capacity) {
+		if (length) {
+			LOG_ERROR("checkpoint") << "Ignoring invalid or old checkpoint " << path;
+		}
+		return;
+	}
+
+	Record *record = records();
+	for (size_t idx = 0; idx < header->count; idx++) {
+		if (record[idx].size > HANDLER_STATE_SIZE ||
+			record[idx].check != checksum(record[idx].fingerprint, record[idx].size, record[idx].state)) {
+			continue;
+		}
+		saved[record[idx].fingerprint] = idx;
+	}
+
+	LOG_INFO("checkpoint") << "Opened checkpoint " << path << ": generation = " << header->generation
+		<< ", handler states = " << saved.size();
+}
+
+/**
+ * StateCheckpoint Class Member Function: ~StateCheckpoint
+ * Description:
+ *   StateCheckpoint Destructor, unmaps and closes the checkpoint file
+ */
+StateCheckpoint::~StateCheckpoint()
+{
+	if (header) munmap(header, sizeof(Header) + capacity * sizeof(Record));
+	if (fd >= 0) ::close(fd);
+}
+
+/**
+ * StateCheckpoint Class Member Function: restore
+ * Description:
+ *   Restore a new handler from the state saved for its fingerprint.  Only
+ *   valid before the first save().
+ * Args:
+ *   handler - handler to restore
+ * Returns:
+ *   true if the handler state was restored
+ */
+bool StateCheckpoint::restore(Handlers *handler)
+{
+	auto match = saved.find(handler->getFingerprint());
+	if (match == saved.end()) return false;
+
+	const Record &record = records()[match->second];
+	return handler->restoreState(record.state, record.size);
+}
+
+/**
+ * StateCheckpoint Class Member Function: begin
+ * Description:
+ *   Start saving the state of the handlers.  Each handler copies its state
+ *   on its worker, poll() writes the checkpoint once all have.
+ * Args:
+ *   handlers - handlers to save, kept alive until written
+ * Returns:
+ *   false if the previous save is still in progress
+ */
+bool StateCheckpoint::begin(const vector<shared_ptr<Handlers>> &handlers)
+{
+	if (!saving.empty()) return false;
+
+	saving = handlers;
+	snapshots.store(saving.size(), memory_order_relaxed);
+	for (auto &handler : saving) Workers->dispatchSnapshot(handler.get(), &snapshots);
+	return true;
+}
+
+/**
+ * StateCheckpoint Class Member Function: poll
+ * Description:
+ *   Write the save in progress once every handler has copied its state,
+ *   cheap to call while the copies are pending
+ * Returns:
+ *   true if the checkpoint was written
+ */
+bool StateCheckpoint::poll(void)
+{
+	if (saving.empty() || snapshots.load(memory_order_acquire)) return false;
+	write();
+	return true;
+}
+
+/**
+ * StateCheckpoint Class Member Function: save
+ * Description:
+ *   Save the state of the handlers and wait until written, e.g. on
+ *   shutdown.  A save in progress is completed first.
+ * Args:
+ *   handlers - handlers to save
+ * Returns:
+ *   number of handler states saved
+ */
+size_t StateCheckpoint::save(const vector<shared_ptr<Handlers>> &handlers)
+{
+	if (!saving.empty()) {
+		Workers->drain();
+		write();
+	}
+
+	begin(handlers);
+	Workers->drain();
+	return write();
+}
+
+/**
+ * StateCheckpoint Class private Member Function: write
+ * Description:
+ *   Write the states copied by the handlers of the save in progress and
+ *   release the handlers.  Every snapshot must have been taken.
+ * Returns:
+ *   number of handler states saved
+ */
+size_t StateCheckpoint::write(void)
+{
+	vector<shared_ptr<Handlers>> handlers;
+	handlers.swap(saving);
+
+	// Records are overwritten, the state read at startup is gone
+	saved.clear();
+	if (handlers.size() > capacity && !map(handlers.size())) return 0;
+
+	Record *record = records();
+	size_t count = 0;
+	for (auto &handler : handlers) {
+		size_t size;
+		const char *state = handler->getSnapshot(size);
+		if (!size) continue;
+
+		Record &slot = record[count++];
+		slot.fingerprint = handler->getFingerprint();
+		slot.size = size;
+		memcpy(slot.state, state, size);
+		slot.check = checksum(slot.fingerprint, slot.size, slot.state);
+	}
+
+	header->magic = CHECKPOINT_MAGIC;
+	header->version = CHECKPOINT_VERSION;
+	header->count = count;
+	header->generation++;
+	header->check = checksum(header->magic, header->version, header->count, header->generation);
+	msync(header, sizeof(Header) + capacity * sizeof(Record), MS_ASYNC);
+
+	checkpoints.add();
+	LOG_DEBUG("checkpoint") << "Saved handler states: " << count;
+	return count;
+}
+
+/**
+ * StateCheckpoint Class private Member Function: map
+ * Description:
+ *   Size the checkpoint file for a number of records and map it.  The file
+ *   is allocated, so writing the mapping can't fault on a full disk.
+ * Args:
+ *   count - number of records
+ * Returns:
+ *   true if mapped
+ */
+bool StateCheckpoint::map(size_t count)
+{
+	size_t length = sizeof(Header) + count * sizeof(Record);
+	int ret = posix_fallocate(fd, 0, length);
+	void *mapped = ret ? MAP_FAILED : mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (mapped == MAP_FAILED) {
+		LOG_ERROR("checkpoint") << "Can't allocate " << path << ": " << strerror(ret ? ret : errno);
+		return false;
+	}
+
+	if (header) munmap(header, sizeof(Header) + capacity * sizeof(Record));
+	header = (Header *) mapped;
+	capacity = count;
+	return true;
+}
+
+/**
+ * StateCheckpoint Class private Member Function: records
+ * Returns:
+ *   records following the header
+ */
+StateCheckpoint::Record *StateCheckpoint::records(void)
+{
+	return (Record *) (header + 1);
+}
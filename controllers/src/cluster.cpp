@@ -0,0 +1,87 @@
+/**
+ * Cluster Membership
+ *
+ * Partitions handlers across the controller nodes of a cluster with
+ * rendezvous hashing.  A key is owned by the node with the highest hash of
+ * the key and node id, so every node computes the same owner without any
+ * coordination, and a change of node count only moves the keys owned by
+ * the added or removed nodes.
+ */
+
+#include "cluster.hpp"
+#include "config.hpp"
+#include <cstdint>
+
+using namespace std;
+
+/**
+ * Function: node_hash
+ * Description:
+ *   FNV-1a hash of a key and node id, with a final mix so the hashes of
+ *   consecutive node ids are unrelated
+ * Args:
+ *   key - hashed key
+ *   node - node id
+ * Returns:
+ *   64 bit hash
+ */
+static uint64_t node_hash(const string &key, unsigned int node)
+{
+	uint64_t hash = 14695981039346656037ull;
+	for (unsigned char c : key) hash = (hash ^ c) * 1099511628211ull;
+	for (int shift = 0; shift < 32; shift += 8) hash = (hash ^ ((node >> shift) & 0xff)) * 1099511628211ull;
+
+	hash ^= hash >> 33;
+	hash *= 0xff51afd7ed558ccdull;
+	hash ^= hash >> 33;
+	return hash;
+}
+
+/**
+ * Function: cluster_enabled
+ * Returns:
+ *   true if the controller runs as one node of several
+ */
+bool cluster_enabled(void)
+{
+	return Config->cluster_nodes > 1;
+}
+
+/**
+ * Function: cluster_owner
+ * Description:
+ *   Find the node owning a key
+ * Args:
+ *   key - handler name
+ *   nodes - number of nodes
+ * Returns:
+ *   owning node id
+ */
+unsigned int cluster_owner(const string &key, unsigned int nodes)
+{
+	unsigned int owner = 0;
+	uint64_t best = 0;
+
+	for (unsigned int node = 0; node < nodes; node++) {
+		uint64_t hash = node_hash(key, node);
+		if (!node || hash > best) {
+			owner = node;
+			best = hash;
+		}
+	}
+	return owner;
+}
+
+/**
+ * Function: cluster_owns
+ * Description:
+ *   Check if this node owns a key, a single node owns every key
+ * Args:
+ *   key - handler name
+ * Returns:
+ *   true if owned by this node
+ */
+bool cluster_owns(const string &key)
+{
+	return !cluster_enabled() || cluster_owner(key, Config->cluster_nodes) == Config->cluster_node_id;
+}
@@ -0,0 +1,389 @@
+/**
+ * Payload Codecs
+ *
+ * Decodes message payloads into typed readings, once per message, before
+ * the readings are stored and handed to handlers.  The codec is selected by
+ * the first PAYLOAD_CODECS rule whose topic filter matches the topic, text
+ * is used for topics matching no rule.
+ *
+ *   text   - integer or decimal number, e.g. 21 or -3.75e2
+ *   binary - big endian, by length: 4 bytes int32 reading, 8 bytes float64
+ *            reading, or 16 bytes int64 timestamp and float64 reading
+ *   json   - flat object, e.g. {"ts": 1700000000, "value": 21.5} or
+ *            {"ts": 1700000000, "temp": 21.5, "humidity": 40}.  "ts" is the
+ *            device timestamp, "value" the reading of the topic sensor and
+ *            other numeric members are readings of the sensor they name.
+ *            Other member types are ignored, nested values aren't allowed.
+ *
+ * Timestamps are seconds since epoch, values above 1e11 are taken as
+ * milliseconds.  Decoding doesn't allocate, and payloads don't need to be
+ * NUL terminated.
+ */
+
+#include "codec.hpp"
+#include "log.hpp"
+#include <charconv>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+// Timestamps above this are in milliseconds
+#define TS_MILLISECONDS 100000000000.0
+
+// Codec rules, topic filter and codec, set once before messages arrive
+static vector<pair<string, Codecs::type>> rules;
+
+/**
+ * Function: filter_matches
+ * Description:
+ *   Check an MQTT subscription filter against a topic, '+' matches one
+ *   level and '#' the remaining levels
+ * Args:
+ *   filter - topic filter, may contain wildcards
+ *   topic - message topic
+ * Returns:
+ *   true if the filter matches the topic
+ */
+static bool filter_matches(string_view filter, string_view topic)
+{
+	// Wildcards at the first level don't match $ topics
+	if (!topic.empty() && topic[0] == '$' && !filter.empty() && (filter[0] == '+' || filter[0] == '#')) return false;
+
+	while (true) {
+		size_t slash = filter.find('/');
+		string_view level = filter.substr(0, slash);
+		if (level == "#") return true;
+
+		size_t end = topic.find('/');
+		if (level != "+" && level != topic.substr(0, end)) return false;
+
+		// Both end at this level, or both continue, '#' also matches the
+		// parent level
+		if (slash == string_view::npos || end == string_view::npos) {
+			return end == string_view::npos && (slash == string_view::npos || filter.substr(slash + 1) == "#");
+		}
+		filter.remove_prefix(slash + 1);
+		topic.remove_prefix(end + 1);
+	}
+}
+
+/**
+ * Function: timestamp
+ * Description:
+ *   Convert a device timestamp to seconds since epoch
+ * Args:
+ *   ts - seconds or milliseconds since epoch
+ * Returns:
+ *   seconds since epoch, 0 if invalid
+ */
+static long int timestamp(double ts)
+{
+	if (!isfinite(ts) || ts <= 0) return 0;
+	return (long int) (ts > TS_MILLISECONDS ? ts / 1000 : ts);
+}
+
+/**
+ * Function: parse_number
+ * Description:
+ *   Parse a finite decimal number
+ * Args:
+ *   first - number start, advanced past the number
+ *   last - end of the input
+ *   value - parsed number
+ * Returns:
+ *   true if a number was parsed
+ */
+static bool parse_number(const char *&first, const char *last, double &value)
+{
+	// from_chars also takes inf and nan
+	if (first == last || (*first != '-' && *first != '.' && (*first < '0' || *first > '9'))) return false;
+
+	auto result = from_chars(first, last, value);
+	if (result.ec != errc() || !isfinite(value)) return false;
+	first = result.ptr;
+	return true;
+}
+
+/**
+ * Function: decode_text
+ * Description:
+ *   Decode an integer or decimal text reading, allowing surrounding
+ *   whitespace and a leading '+'
+ * Args:
+ *   text - payload
+ *   payload - decoded reading
+ * Returns:
+ *   true if the payload holds a number
+ */
+static bool decode_text(string_view text, Payload &payload)
+{
+	const char *first = text.data();
+	const char *last = first + text.size();
+	while (first < last && (*first == ' ' || *first == '\t')) first++;
+	if (first < last && *first == '+') first++;
+
+	double value;
+	if (!parse_number(first, last, value)) return false;
+
+	while (first < last && (*first == ' ' || *first == '\t' || *first == '\r' || *first == '\n' || *first == '\0')) first++;
+	if (first != last) return false;
+
+	payload.fields[payload.count++] = PayloadField{ {}, value };
+	return true;
+}
+
+/**
+ * Function: decode_binary
+ * Description:
+ *   Decode a fixed size big endian binary reading
+ * Args:
+ *   data - payload
+ *   payload - decoded reading and timestamp
+ * Returns:
+ *   true if the payload has one of the binary sizes
+ */
+static bool decode_binary(string_view data, Payload &payload)
+{
+	auto big_endian = [&data](size_t offset, size_t size) {
+		uint64_t value = 0;
+		for (size_t idx = 0; idx < size; idx++) value = (value << 8) | (unsigned char) data[offset + idx];
+		return value;
+	};
+	auto float64 = [&big_endian](size_t offset) {
+		uint64_t bits = big_endian(offset, 8);
+		double value;
+		memcpy(&value, &bits, sizeof(value));
+		return value;
+	};
+
+	double value;
+	if (data.size() == 4) value = (int32_t) (uint32_t) big_endian(0, 4);
+	else if (data.size() == 8) value = float64(0);
+	else if (data.size() == 16) {
+		payload.ts = timestamp((double) (int64_t) big_endian(0, 8));
+		value = float64(8);
+	}
+	else return false;
+
+	if (!isfinite(value)) return false;
+	payload.fields[payload.count++] = PayloadField{ {}, value };
+	return true;
+}
+
+/**
+ * Function: skip_space
+ * Description:
+ *   Skip JSON whitespace
+ * Args:
+ *   first - position, advanced past whitespace
+ *   last - end of the input
+ */
+static void skip_space(const char *&first, const char *last)
+{
+	while (first < last && (*first == ' ' || *first == '\t' || *first == '\r' || *first == '\n')) first++;
+}
+
+/**
+ * Function: skip_literal
+ * Description:
+ *   Skip a JSON literal
+ * Args:
+ *   first - position, advanced past the literal if present
+ *   last - end of the input
+ *   literal - true, false or null
+ * Returns:
+ *   true if the literal is present
+ */
+static bool skip_literal(const char *&first, const char *last, string_view literal)
+{
+	if ((size_t) (last - first) < literal.size() || string_view(first, literal.size()) != literal) return false;
+	first += literal.size();
+	return true;
+}
+
+/**
+ * Function: parse_string
+ * Description:
+ *   Parse a JSON string
+ * Args:
+ *   first - opening quote, advanced past the closing quote
+ *   last - end of the input
+ *   value - string contents, still escaped
+ *   escaped - set if the string contains escapes
+ * Returns:
+ *   true if the string is terminated
+ */
+static bool parse_string(const char *&first, const char *last, string_view &value, bool &escaped)
+{
+	const char *start = ++first;
+	escaped = false;
+	while (first < last && *first != '"') {
+		if (*first == '\\') {
+			escaped = true;
+			first++;
+		}
+		first++;
+	}
+	if (first >= last) return false;
+
+	value = string_view(start, first - start);
+	first++;
+	return true;
+}
+
+/**
+ * Function: decode_json
+ * Description:
+ *   Decode a flat JSON object of readings
+ * Args:
+ *   text - payload
+ *   payload - decoded readings and timestamp
+ * Returns:
+ *   true if the payload is a flat object with at least one reading
+ */
+static bool decode_json(string_view text, Payload &payload)
+{
+	const char *first = text.data();
+	const char *last = first + text.size();
+
+	skip_space(first, last);
+	if (first == last || *first++ != '{') return false;
+	skip_space(first, last);
+	if (first < last && *first == '}') return false;
+
+	while (true) {
+		string_view name;
+		bool escaped;
+		if (first == last || *first != '"' || !parse_string(first, last, name, escaped)) return false;
+		skip_space(first, last);
+		if (first == last || *first++ != ':') return false;
+		skip_space(first, last);
+		if (first == last) return false;
+
+		// Only numbers are readings, other scalars are skipped
+		double value;
+		bool number = false;
+		if (*first == '"') {
+			string_view ignored;
+			bool ignored_escaped;
+			if (!parse_string(first, last, ignored, ignored_escaped)) return false;
+		}
+		else if (skip_literal(first, last, "true") || skip_literal(first, last, "false") || skip_literal(first, last, "null")) {
+		}
+		else if (parse_number(first, last, value)) number = true;
+		else return false;
+
+		if (number) {
+			if (name == "ts") payload.ts = timestamp(value);
+			else if (name == "value") {
+				if (payload.count < PAYLOAD_MAX_FIELDS) payload.fields[payload.count++] = PayloadField{ {}, value };
+			}
+			else if (!escaped && !name.empty() && name.find_first_of("/+#") == string_view::npos &&
+				payload.count < PAYLOAD_MAX_FIELDS) {
+				// Member names become topic levels, names that can't are skipped
+				payload.fields[payload.count++] = PayloadField{ name, value };
+			}
+		}
+
+		skip_space(first, last);
+		if (first == last) return false;
+		if (*first == '}') break;
+		if (*first++ != ',') return false;
+		skip_space(first, last);
+	}
+
+	first++;
+	skip_space(first, last);
+	while (first < last && *first == '\0') first++;
+	return first == last && payload.count;
+}
+
+/**
+ * Function: set_payload_codecs
+ * Description:
+ *   Set the codec rules from a comma separated list of filter=codec pairs,
+ *   e.g. "+/+/+/raw=binary,site/#=json".  All rules are checked and every
+ *   error is logged.
+ * Args:
+ *   config - codec rules, empty decodes all payloads as text
+ * Returns:
+ *   true if all rules are valid
+ */
+bool set_payload_codecs(const string &config)
+{
+	vector<pair<string, Codecs::type>> parsed;
+	bool valid = true;
+
+	stringstream entries(config);
+	string entry;
+	while (getline(entries, entry, ',')) {
+		if (entry.empty()) continue;
+
+		size_t equals = entry.rfind('=');
+		string filter = equals == string::npos ? string() : entry.substr(0, equals);
+		string name = equals == string::npos ? string() : entry.substr(equals + 1);
+		size_t hash = filter.find('#');
+		if (filter.empty() || (hash != string::npos && hash != filter.size() - 1)) {
+			LOG_ERROR("config") << "Invalid payload codec rule: " << entry;
+			valid = false;
+			continue;
+		}
+
+		if (name == "text") parsed.push_back({ filter, Codecs::text });
+		else if (name == "binary") parsed.push_back({ filter, Codecs::binary });
+		else if (name == "json") parsed.push_back({ filter, Codecs::json });
+		else {
+			LOG_ERROR("config") << "Unknown payload codec " << name << " for " << filter;
+			valid = false;
+		}
+	}
+
+	if (!valid) return false;
+	rules = move(parsed);
+	return true;
+}
+
+/**
+ * Function: payload_codec
+ * Description:
+ *   Select the codec of a topic
+ * Args:
+ *   topic - message topic
+ * Returns:
+ *   codec of the first matching rule, text if none matches
+ */
+Codecs::type payload_codec(string_view topic)
+{
+	for (auto &rule : rules) {
+		if (filter_matches(rule.first, topic)) return rule.second;
+	}
+	return Codecs::text;
+}
+
+/**
+ * Function: decode_payload
+ * Description:
+ *   Decode a payload into its readings
+ * Args:
+ *   codec - payload codec
+ *   data - payload, not required to be NUL terminated
+ *   payload - decoded readings and timestamp
+ * Returns:
+ *   true if the payload holds at least one reading
+ */
+bool decode_payload(Codecs::type codec, string_view data, Payload &payload)
+{
+	payload.ts = 0;
+	payload.count = 0;
+
+	if (codec == Codecs::binary) return decode_binary(data, payload);
+	if (codec == Codecs::json) return decode_json(data, payload);
+	return decode_text(data, payload);
+}
@@ -5,9 +5,12 @@
  */
 
 #include "config.hpp"
+#include "log.hpp"
+#include <algorithm>
 #include <fstream>
-#include <iostream>
 #include <jsoncpp/json/json.h>
+#include <sstream>
+#include <vector>
 
 using namespace std;
 
@@ -28,6 +31,29 @@ string get_env(std::string const& key, std::string const def = "")
 	return val == NULL ? string(def) : string(val);
 }
 
+/**
+ * Function: parse_seconds
+ * Description:
+ *   Parse a duration in seconds with an optional s, m, h or d unit suffix,
+ *   e.g. 90, 1m or 1h
+ * Args:
+ *   value - duration text
+ * Returns:
+ *   unsigned int - duration in seconds
+ */
+static unsigned int parse_seconds(string const& value)
+{
+	size_t end = 0;
+	unsigned int seconds = stoul(value, &end);
+
+	switch (end < value.length() ? value[end] : 's') {
+		case 'm': return seconds * 60;
+		case 'h': return seconds * 3600;
+		case 'd': return seconds * 86400;
+		default: return seconds;
+	}
+}
+
 /**
  * Function: process_env
  * Description:
@@ -40,28 +66,94 @@ appConfig *process_env(void)
 	// Allocate a new config object
 	appConfig *config = new appConfig;
 
-	cout << "INFO processing environment variables" << endl;
+	LOG_INFO("config") << "processing environment variables";
 
 	// get all environment variables
 	config->mqtt_hostname = get_env("MQTT_HOSTNAME", "localhost");
 	config->mqtt_port = stoi(get_env("MQTT_PORT", "1883"));
 	config->pg_connection = get_env("PG_CONNECTION_STRING");
+	config->pg_pool_size = stoi(get_env("PG_POOL_SIZE", "2"));
+	config->db_queue_size = stoi(get_env("DB_QUEUE_SIZE", "10000"));
+	config->db_batch_size = stoi(get_env("DB_BATCH_SIZE", "500"));
+	config->db_flush_interval = stoi(get_env("DB_FLUSH_INTERVAL", "1000"));
+	config->db_writer_threads = stoi(get_env("DB_WRITER_THREADS", "1"));
+	config->db_overload_policy = get_env("DB_OVERLOAD_POLICY", "drop_newest");
+	config->db_sample_rate = stoi(get_env("DB_SAMPLE_RATE", "10"));
+	config->db_hold_timeout = stoi(get_env("DB_HOLD_TIMEOUT", "100"));
+	config->spool_dir = get_env("SPOOL_DIR");
+	config->spool_segment_size = stoul(get_env("SPOOL_SEGMENT_SIZE", "16777216"));
+	config->spool_max_segments = stoi(get_env("SPOOL_MAX_SEGMENTS", "64"));
+	config->rollup_grace = parse_seconds(get_env("ROLLUP_GRACE", "60"));
+	config->rollup_queue_size = stoul(get_env("ROLLUP_QUEUE_SIZE", "100000"));
+	config->handler_threads = stoi(get_env("HANDLER_THREADS", "0"));
+	config->handler_queue_size = stoi(get_env("HANDLER_QUEUE_SIZE", "1024"));
+	config->batch_interval = stoi(get_env("BATCH_INTERVAL", "0"));
+	config->batch_size = stoi(get_env("BATCH_SIZE", "256"));
+	config->publish_queue_size = stoi(get_env("PUBLISH_QUEUE_SIZE", "4096"));
+	config->publish_interval = stoi(get_env("PUBLISH_INTERVAL", "5"));
+	config->publish_coalesce = stoi(get_env("PUBLISH_COALESCE", "0"));
+	config->publish_suppress_repeats = get_env("PUBLISH_SUPPRESS_REPEATS", "0") == "1";
+	config->checkpoint_file = get_env("CHECKPOINT_FILE");
+	config->checkpoint_interval = parse_seconds(get_env("CHECKPOINT_INTERVAL", "60"));
+	config->metrics_topic = get_env("METRICS_TOPIC");
+	config->metrics_interval = stoi(get_env("METRICS_INTERVAL", "10000"));
+	config->metrics_port = stoi(get_env("METRICS_PORT", "0"));
+	config->metrics_address = get_env("METRICS_ADDRESS", "127.0.0.1");
+	config->trace_rate = stoi(get_env("TRACE_RATE", "0"));
+	config->trace_buffer = stoi(get_env("TRACE_BUFFER", "65536"));
+	config->trace_file = get_env("TRACE_FILE", "controller-trace.json");
+	config->trace_topic = get_env("TRACE_TOPIC");
+	config->capture_file = get_env("CAPTURE_FILE");
+	config->capture_size = stoul(get_env("CAPTURE_SIZE", "268435456"));
 	config->mqtt_keepalive_interval = stoi(get_env("MQTT_KEEPALIVE_INTERVAL", "60"));
 	config->mqtt_sub_topic = get_env("MQTT_SUB_TOPIC", "#");
+	config->payload_codecs = get_env("PAYLOAD_CODECS");
+	config->cluster_nodes = max(stoi(get_env("CLUSTER_NODES", "1")), 1);
+	config->cluster_node_id = stoi(get_env("CLUSTER_NODE_ID", "0"));
+	config->cluster_group = get_env("CLUSTER_GROUP", "controllers");
 
-	// get handler configuration from HANLDERS as JSON string
+	// get rollup windows from a comma separated list of durations
+	stringstream windows(get_env("ROLLUP_WINDOWS"));
+	string window;
+	while (getline(windows, window, ',')) {
+		if (window.length()) config->rollup_windows.push_back(parse_seconds(window));
+	}
+
+	return config;
+}
+
+/**
+ * Function: load_handler_config
+ * Description:
+ *   Read and compile the handler configuration from the HANDLER_CONFIG_FILE
+ *   JSON file, or the HANDLER_CONFIG JSON string if no file is set
+ * Args:
+ *   handlers - set to the compiled handler configuration
+ * Returns:
+ *   true if the configuration was parsed and is valid
+ */
+bool load_handler_config(vector<HandlerSpec> &handlers)
+{
 	Json::Reader reader;
+	Json::Value parsed;
+	bool ok;
+
 	string handlerConfigFile = get_env("HANDLER_CONFIG_FILE");
 	if (handlerConfigFile.length()) {
 		// Read configuration JSON file
 		ifstream ifs(handlerConfigFile);
-		reader.parse(ifs, config->handlers);
+		ok = reader.parse(ifs, parsed);
 	}
 	else {
 		// Read configuration from JSON string
 		string handlerConfig = get_env("HANDLER_CONFIG", "{}");
-		reader.parse(handlerConfig, config->handlers);
+		ok = reader.parse(handlerConfig, parsed);
 	}
 
-	return config;
+	if (!ok) {
+		LOG_ERROR("config") << "Invalid handler configuration: " << reader.getFormattedErrorMessages();
+		return false;
+	}
+
+	return compile_handlers(parsed, handlers);
 }
@@ -0,0 +1,484 @@
+/**
+ * Rule Expressions
+ *
+ * Small expressions over a message reading and handler state, compiled
+ * once when the handler configuration is loaded, e.g.
+ *
+ *   value > 40 && prev <= 40 ? 0 : none
+ *
+ * Operators, by increasing precedence:
+ *
+ *   c ? a : b
+ *   ||
+ *   &&
+ *   == != < <= > >=
+ *   + -
+ *   * / %
+ *   - ! (unary)
+ *
+ * Operands are numbers, the variables value, prev, last, state and count,
+ * none, parentheses and the functions abs(x), min(a, b), max(a, b) and
+ * isnone(x).  && and || only evaluate their right side when needed, and
+ * only the selected side of ?: is evaluated.
+ */
+
+#include "expression.hpp"
+#include <cctype>
+#include <charconv>
+#include <cmath>
+#include <string_view>
+
+using namespace std;
+
+/**
+ * Function: truthy
+ * Args:
+ *   value - expression value
+ * Returns:
+ *   false for 0 and none
+ */
+static inline bool truthy(double value)
+{
+	return value != 0 && !isnan(value);
+}
+
+//
+// Expression Parser
+//
+// Recursive descent parser emitting the bytecode of each operand before its
+// operator, tracking the stack depth the code needs.
+//
+
+struct Expression::Parser
+{
+	string_view text;
+	size_t pos = 0;
+	vector<Instruction> &code;
+	size_t depth = 0;
+	size_t max_depth = 0;
+	size_t nesting = 0;
+	string error;
+
+	Parser(string_view text, vector<Instruction> &code) : text{ text }, code{ code } {}
+
+	/**
+	 * Expression Parser Member Function: fail
+	 * Description:
+	 *   Set the error, keeping the first one
+	 * Args:
+	 *   message - error description
+	 * Returns:
+	 *   false
+	 */
+	bool fail(const string &message)
+	{
+		if (error.empty()) error = message + " at position " + to_string(pos + 1);
+		return false;
+	}
+
+	/**
+	 * Expression Parser Member Function: emit
+	 * Description:
+	 *   Add an instruction
+	 * Args:
+	 *   op - instruction
+	 *   change - stack depth change when it falls through
+	 *   number - constant
+	 *   target - variable index
+	 * Returns:
+	 *   instruction index, for patching jump targets
+	 */
+	size_t emit(Op op, int change, double number = 0, unsigned int target = 0)
+	{
+		code.push_back(Instruction{ op, target, number });
+		depth += change;
+		if (depth > max_depth) max_depth = depth;
+		return code.size() - 1;
+	}
+
+	/**
+	 * Expression Parser Member Function: skip
+	 * Description:
+	 *   Skip whitespace
+	 */
+	void skip(void)
+	{
+		while (pos < text.size() && (text[pos] == ' ' || text[pos] == '\t' || text[pos] == '\n' || text[pos] == '\r')) pos++;
+	}
+
+	/**
+	 * Expression Parser Member Function: accept
+	 * Description:
+	 *   Consume a token if it's next
+	 * Args:
+	 *   token - operator text
+	 * Returns:
+	 *   true if consumed
+	 */
+	bool accept(string_view token)
+	{
+		skip();
+		if (text.substr(pos, token.size()) != token) return false;
+
+		// Keep = and < of <= etc. for the longer operator
+		if (token.size() == 1 && (token == "<" || token == ">" || token == "!") && text.substr(pos + 1, 1) == "=") return false;
+		pos += token.size();
+		return true;
+	}
+
+	/**
+	 * Expression Parser Member Function: nest
+	 * Description:
+	 *   Parse a nested part, limiting the parser recursion
+	 * Args:
+	 *   part - parser function
+	 * Returns:
+	 *   false on a syntax error
+	 */
+	bool nest(bool (Parser::*part)(void))
+	{
+		if (++nesting > EXPRESSION_MAX_STACK * 4) return fail("expression too deeply nested");
+		bool parsed = (this->*part)();
+		nesting--;
+		return parsed;
+	}
+
+	/**
+	 * Expression Parser Member Function: ternary
+	 * Description:
+	 *   Parse a full expression
+	 * Returns:
+	 *   false on a syntax error
+	 */
+	bool ternary(void)
+	{
+		return nest(&Parser::conditional);
+	}
+
+	/**
+	 * Expression Parser Member Function: conditional
+	 * Description:
+	 *   Parse c ? a : b or a lower precedence expression
+	 * Returns:
+	 *   false on a syntax error
+	 */
+	bool conditional(void)
+	{
+		if (!logical_or()) return false;
+		if (!accept("?")) return true;
+
+		size_t otherwise = emit(jump_false, -1);
+		if (!ternary()) return false;
+		if (!accept(":")) return fail("expected ':'");
+
+		size_t end = emit(jump, 0);
+		code[otherwise].target = code.size();
+		depth--;
+		if (!ternary()) return false;
+		code[end].target = code.size();
+		return true;
+	}
+
+	/**
+	 * Expression Parser Member Function: logical_or
+	 * Returns:
+	 *   false on a syntax error
+	 */
+	bool logical_or(void)
+	{
+		if (!logical_and()) return false;
+		while (accept("||")) {
+			size_t skip_right = emit(or_jump, -1);
+			if (!logical_and()) return false;
+			emit(truth, 0);
+			code[skip_right].target = code.size();
+		}
+		return true;
+	}
+
+	/**
+	 * Expression Parser Member Function: logical_and
+	 * Returns:
+	 *   false on a syntax error
+	 */
+	bool logical_and(void)
+	{
+		if (!comparison()) return false;
+		while (accept("&&")) {
+			size_t skip_right = emit(and_jump, -1);
+			if (!comparison()) return false;
+			emit(truth, 0);
+			code[skip_right].target = code.size();
+		}
+		return true;
+	}
+
+	/**
+	 * Expression Parser Member Function: comparison
+	 * Returns:
+	 *   false on a syntax error
+	 */
+	bool comparison(void)
+	{
+		if (!sum()) return false;
+		while (true) {
+			Op op;
+			if (accept("==")) op = equal;
+			else if (accept("!=")) op = not_equal;
+			else if (accept("<=")) op = less_equal;
+			else if (accept(">=")) op = greater_equal;
+			else if (accept("<")) op = less;
+			else if (accept(">")) op = greater;
+			else return true;
+
+			if (!sum()) return false;
+			emit(op, -1);
+		}
+	}
+
+	/**
+	 * Expression Parser Member Function: sum
+	 * Returns:
+	 *   false on a syntax error
+	 */
+	bool sum(void)
+	{
+		if (!product()) return false;
+		while (true) {
+			Op op;
+			if (accept("+")) op = add;
+			else if (accept("-")) op = subtract;
+			else return true;
+
+			if (!product()) return false;
+			emit(op, -1);
+		}
+	}
+
+	/**
+	 * Expression Parser Member Function: product
+	 * Returns:
+	 *   false on a syntax error
+	 */
+	bool product(void)
+	{
+		if (!unary()) return false;
+		while (true) {
+			Op op;
+			if (accept("*")) op = multiply;
+			else if (accept("/")) op = divide;
+			else if (accept("%")) op = modulo;
+			else return true;
+
+			if (!unary()) return false;
+			emit(op, -1);
+		}
+	}
+
+	/**
+	 * Expression Parser Member Function: unary
+	 * Returns:
+	 *   false on a syntax error
+	 */
+	bool unary(void)
+	{
+		if (accept("-")) {
+			if (!nest(&Parser::unary)) return false;
+			emit(negate, 0);
+			return true;
+		}
+		if (accept("!")) {
+			if (!nest(&Parser::unary)) return false;
+			emit(logical_not, 0);
+			return true;
+		}
+		return primary();
+	}
+
+	/**
+	 * Expression Parser Member Function: arguments
+	 * Description:
+	 *   Parse a function argument list
+	 * Args:
+	 *   count - number of arguments expected
+	 * Returns:
+	 *   false on a syntax error
+	 */
+	bool arguments(int count)
+	{
+		if (!accept("(")) return fail("expected '('");
+		for (int idx = 0; idx < count; idx++) {
+			if (idx && !accept(",")) return fail("expected ','");
+			if (!ternary()) return false;
+		}
+		if (!accept(")")) return fail("expected ')'");
+		return true;
+	}
+
+	/**
+	 * Expression Parser Member Function: primary
+	 * Description:
+	 *   Parse a number, name, function call or parenthesized expression
+	 * Returns:
+	 *   false on a syntax error
+	 */
+	bool primary(void)
+	{
+		skip();
+		if (pos == text.size()) return fail("unexpected end");
+
+		if (accept("(")) {
+			if (!ternary()) return false;
+			if (!accept(")")) return fail("expected ')'");
+			return true;
+		}
+
+		char c = text[pos];
+		if ((c >= '0' && c <= '9') || c == '.') {
+			double number;
+			auto result = from_chars(text.data() + pos, text.data() + text.size(), number);
+			if (result.ec != errc() || !isfinite(number)) return fail("invalid number");
+			pos = result.ptr - text.data();
+			emit(constant, 1, number);
+			return true;
+		}
+
+		size_t start = pos;
+		while (pos < text.size() && (isalnum((unsigned char) text[pos]) || text[pos] == '_')) pos++;
+		string_view name = text.substr(start, pos - start);
+		if (name.empty()) return fail(string("unexpected '") + c + "'");
+
+		if (name == "value") emit(load, 1, 0, ExpressionVariables::value);
+		else if (name == "prev") emit(load, 1, 0, ExpressionVariables::prev);
+		else if (name == "last") emit(load, 1, 0, ExpressionVariables::last);
+		else if (name == "state") emit(load, 1, 0, ExpressionVariables::state);
+		else if (name == "count") emit(load, 1, 0, ExpressionVariables::count);
+		else if (name == "none") emit(constant, 1, NAN);
+		else if (name == "abs") {
+			if (!arguments(1)) return false;
+			emit(absolute, 0);
+		}
+		else if (name == "isnone") {
+			if (!arguments(1)) return false;
+			emit(is_none, 0);
+		}
+		else if (name == "min" || name == "max") {
+			if (!arguments(2)) return false;
+			emit(name == "min" ? minimum : maximum, -1);
+		}
+		else {
+			pos = start;
+			return fail("unknown name " + string(name));
+		}
+		return true;
+	}
+};
+
+//
+// Expression Class
+//
+
+/**
+ * Expression Class Member Function: compile
+ * Description:
+ *   Compile an expression, replacing any previous one
+ * Args:
+ *   text - expression
+ *   error - set to the error if invalid
+ * Returns:
+ *   true if the expression is valid
+ */
+bool Expression::compile(const string &text, string &error)
+{
+	vector<Instruction> compiled;
+	Parser parser(text, compiled);
+
+	bool valid = parser.ternary();
+	parser.skip();
+	if (valid && parser.pos != text.size()) valid = parser.fail(string("unexpected '") + text[parser.pos] + "'");
+	if (valid && parser.max_depth > EXPRESSION_MAX_STACK) valid = parser.fail("expression too deeply nested");
+
+	if (!valid) {
+		error = parser.error;
+		return false;
+	}
+
+	compiled.shrink_to_fit();
+	code = move(compiled);
+	return true;
+}
+
+/**
+ * Expression Class Member Function: evaluate
+ * Description:
+ *   Evaluate the expression
+ * Args:
+ *   variables - values of the ExpressionVariables
+ * Returns:
+ *   expression value, none (NaN) for an empty expression
+ */
+double Expression::evaluate(const double *variables) const
+{
+	if (code.empty()) return NAN;
+
+	double stack[EXPRESSION_MAX_STACK];
+	size_t top = 0;
+	const Instruction *ops = code.data();
+	size_t end = code.size();
+
+	for (size_t pc = 0; pc < end; pc++) {
+		const Instruction &ins = ops[pc];
+		switch (ins.op) {
+			case constant: stack[top++] = ins.number; break;
+			case load: stack[top++] = variables[ins.target]; break;
+			case add: top--; stack[top - 1] += stack[top]; break;
+			case subtract: top--; stack[top - 1] -= stack[top]; break;
+			case multiply: top--; stack[top - 1] *= stack[top]; break;
+			case divide: top--; stack[top - 1] /= stack[top]; break;
+			case modulo: top--; stack[top - 1] = fmod(stack[top - 1], stack[top]); break;
+			case equal: top--; stack[top - 1] = stack[top - 1] == stack[top]; break;
+			case not_equal: top--; stack[top - 1] = stack[top - 1] != stack[top]; break;
+			case less: top--; stack[top - 1] = stack[top - 1] < stack[top]; break;
+			case less_equal: top--; stack[top - 1] = stack[top - 1] <= stack[top]; break;
+			case greater: top--; stack[top - 1] = stack[top - 1] > stack[top]; break;
+			case greater_equal: top--; stack[top - 1] = stack[top - 1] >= stack[top]; break;
+			case negate: stack[top - 1] = -stack[top - 1]; break;
+			case logical_not: stack[top - 1] = !truthy(stack[top - 1]); break;
+			case truth: stack[top - 1] = truthy(stack[top - 1]); break;
+			case is_none: stack[top - 1] = isnan(stack[top - 1]); break;
+			case absolute: stack[top - 1] = fabs(stack[top - 1]); break;
+			case minimum: top--; stack[top - 1] = fmin(stack[top - 1], stack[top]); break;
+			case maximum: top--; stack[top - 1] = fmax(stack[top - 1], stack[top]); break;
+			case jump: pc = ins.target - 1; break;
+			case jump_false:
+				if (!truthy(stack[--top])) pc = ins.target - 1;
+				break;
+			case and_jump:
+				// Left side decides, keep its truth value
+				if (!truthy(stack[top - 1])) {
+					stack[top - 1] = 0;
+					pc = ins.target - 1;
+				}
+				else top--;
+				break;
+			case or_jump:
+				if (truthy(stack[top - 1])) {
+					stack[top - 1] = 1;
+					pc = ins.target - 1;
+				}
+				else top--;
+				break;
+		}
+	}
+	return stack[0];
+}
+
+/**
+ * Expression Class Member Function: empty
+ * Returns:
+ *   true if no expression was compiled
+ */
+bool Expression::empty(void) const
+{
+	return code.empty();
+}
@@ -0,0 +1,469 @@
+/**
+ * Handler Configuration
+ *
+ * Compiles the JSON handler configuration into HandlerSpec structures.  All
+ * validation happens here, once per load, so handlers only copy typed
+ * settings and never look at JSON.
+ */
+
+#include "handler_config.hpp"
+#include "log.hpp"
+#include <charconv>
+#include <cmath>
+#include <cstdlib>
+#include <jsoncpp/json/json.h>
+
+using namespace std;
+
+/**
+ * Function: invalid
+ * Description:
+ *   Log a handler configuration error
+ * Args:
+ *   name - handler name
+ *   message - error description
+ * Returns:
+ *   false
+ */
+static bool invalid(const string &name, const string &message)
+{
+	LOG_ERROR("config") << "Invalid handler " << name << ": " << message;
+	return false;
+}
+
+/**
+ * Function: fingerprint
+ * Description:
+ *   FNV-1a hash of the handler name and its JSON configuration.  Object
+ *   members are written sorted, so equal configurations hash equally.
+ * Args:
+ *   name - handler name
+ *   handler - handler JSON configuration
+ * Returns:
+ *   64 bit hash
+ */
+static uint64_t fingerprint(const string &name, const Json::Value &handler)
+{
+	Json::StreamWriterBuilder builder;
+	builder["indentation"] = "";
+	string text = name + '\0' + Json::writeString(builder, handler);
+
+	uint64_t hash = 14695981039346656037ull;
+	for (unsigned char c : text) hash = (hash ^ c) * 1099511628211ull;
+	return hash;
+}
+
+/**
+ * Function: get_string
+ * Description:
+ *   Get an optional string setting
+ * Args:
+ *   handler - handler JSON configuration
+ *   key - setting name
+ *   value - set if the setting is present
+ *   name - handler name
+ * Returns:
+ *   false if the setting isn't a string
+ */
+static bool get_string(const Json::Value &handler, const char *key, string &value, const string &name)
+{
+	if (!handler.isMember(key)) return true;
+	if (!handler[key].isString()) return invalid(name, string(key) + " must be a string");
+	value = handler[key].asString();
+	return true;
+}
+
+/**
+ * Function: get_int
+ * Description:
+ *   Get an optional integer setting
+ * Args:
+ *   handler - handler JSON configuration
+ *   key - setting name
+ *   value - set if the setting is present
+ *   name - handler name
+ * Returns:
+ *   false if the setting isn't an integer
+ */
+static bool get_int(const Json::Value &handler, const char *key, int &value, const string &name)
+{
+	if (!handler.isMember(key)) return true;
+	if (!handler[key].isInt()) return invalid(name, string(key) + " must be an integer");
+	value = handler[key].asInt();
+	return true;
+}
+
+/**
+ * Function: get_number
+ * Description:
+ *   Get an optional non negative number setting
+ * Args:
+ *   handler - handler JSON configuration
+ *   key - setting name
+ *   value - set if the setting is present
+ *   name - handler name
+ * Returns:
+ *   false if the setting isn't a non negative number
+ */
+static bool get_number(const Json::Value &handler, const char *key, double &value, const string &name)
+{
+	if (!handler.isMember(key)) return true;
+	if (!handler[key].isNumeric() || handler[key].asDouble() < 0) {
+		return invalid(name, string(key) + " must be a non negative number");
+	}
+	value = handler[key].asDouble();
+	return true;
+}
+
+/**
+ * Function: get_real
+ * Description:
+ *   Get an optional number setting that may be negative
+ * Args:
+ *   handler - handler JSON configuration
+ *   key - setting name
+ *   value - set if the setting is present
+ *   name - handler name
+ * Returns:
+ *   false if the setting isn't a number
+ */
+static bool get_real(const Json::Value &handler, const char *key, double &value, const string &name)
+{
+	if (!handler.isMember(key)) return true;
+	if (!handler[key].isNumeric()) return invalid(name, string(key) + " must be a number");
+	value = handler[key].asDouble();
+	return true;
+}
+
+/**
+ * Function: get_bool
+ * Description:
+ *   Get an optional boolean setting
+ * Args:
+ *   handler - handler JSON configuration
+ *   key - setting name
+ *   value - set if the setting is present
+ *   name - handler name
+ * Returns:
+ *   false if the setting isn't a boolean
+ */
+static bool get_bool(const Json::Value &handler, const char *key, bool &value, const string &name)
+{
+	if (!handler.isMember(key)) return true;
+	if (!handler[key].isBool()) return invalid(name, string(key) + " must be true or false");
+	value = handler[key].asBool();
+	return true;
+}
+
+/**
+ * Function: get_table
+ * Description:
+ *   Get an optional map from integer keys to integer values
+ * Args:
+ *   handler - handler JSON configuration
+ *   key - setting name
+ *   table - built from the map if the setting is present
+ *   name - handler name
+ * Returns:
+ *   false if the setting isn't a map of integers
+ */
+static bool get_table(const Json::Value &handler, const char *key, LookupTable &table, const string &name)
+{
+	if (!handler.isMember(key)) return true;
+	if (!handler[key].isObject()) return invalid(name, string(key) + " must be an object");
+
+	vector<pair<int, int>> entries;
+	for (Json::Value::const_iterator it = handler[key].begin(); it != handler[key].end(); ++it) {
+		string text = it.key().asString();
+		int input;
+		auto result = from_chars(text.data(), text.data() + text.size(), input);
+		if (result.ec != errc() || result.ptr != text.data() + text.size()) {
+			return invalid(name, string(key) + " key " + text + " must be an integer");
+		}
+		if (!it->isInt()) return invalid(name, string(key) + " value for " + text + " must be an integer");
+		entries.push_back({ input, it->asInt() });
+	}
+	table.build(entries);
+	return true;
+}
+
+/**
+ * Function: require
+ * Description:
+ *   Check a required setting is present
+ * Args:
+ *   handler - handler JSON configuration
+ *   key - setting name
+ *   name - handler name
+ * Returns:
+ *   false if the setting is missing
+ */
+static bool require(const Json::Value &handler, const char *key, const string &name)
+{
+	return handler.isMember(key) || invalid(name, string("missing ") + key);
+}
+
+/**
+ * Function: compile_limit
+ * Description:
+ *   Compile a hysteresis limit
+ * Args:
+ *   hysteresis - hysteresis JSON configuration
+ *   key - min or max
+ *   limit - compiled limit
+ *   name - handler name
+ * Returns:
+ *   false if the limit is invalid
+ */
+static bool compile_limit(const Json::Value &hysteresis, const char *key, HysteresisLimit &limit, const string &name)
+{
+	if (!hysteresis[key].isObject()) return invalid(name, string("hysteresis ") + key + " must be an object");
+
+	const Json::Value &settings = hysteresis[key];
+	return require(settings, "limit", name) && require(settings, "value", name) &&
+		get_int(settings, "limit", limit.limit, name) &&
+		get_int(settings, "value", limit.value, name) &&
+		get_bool(settings, "repeat", limit.repeat, name);
+}
+
+/**
+ * Function: compile_scheduler
+ * Description:
+ *   Compile the scheduler settings, schedule times are converted to tick
+ *   numbers
+ * Args:
+ *   handler - handler JSON configuration
+ *   spec - compiled configuration
+ * Returns:
+ *   false if the settings are invalid
+ */
+static bool compile_scheduler(const Json::Value &handler, HandlerSpec &spec)
+{
+	const string &name = spec.name;
+	double seconds = 1;
+	double length = 1;
+
+	if (!get_number(handler, "interval", seconds, name) || !get_number(handler, "max", length, name)) return false;
+
+	// Interval in milliseconds, interval_ms takes precedence
+	long long interval = llround(seconds * 1000);
+	if (handler.isMember("interval_ms")) {
+		if (!handler["interval_ms"].isUInt()) return invalid(name, "interval_ms must be a positive integer");
+		interval = handler["interval_ms"].asUInt();
+	}
+	if (interval < 1) return invalid(name, "interval must be at least 1ms");
+
+	long long period = llround(length * 1000);
+	if (period < 1) return invalid(name, "max must be at least 1ms");
+
+	spec.interval = interval;
+	spec.ticks = (period + interval - 1) / interval;
+
+	if (!handler.isMember("schedule")) return true;
+	if (!handler["schedule"].isObject()) return invalid(name, "schedule must be an object");
+
+	// Schedule times must fall on a tick to ever be published
+	vector<pair<int, int>> entries;
+	for (Json::Value::const_iterator it = handler["schedule"].begin(); it != handler["schedule"].end(); ++it) {
+		string text = it.key().asString();
+		char *end;
+		double at = strtod(text.c_str(), &end);
+		long long time = llround(at * 1000);
+		if (end == text.c_str() || *end || time < 0 || time >= period) {
+			return invalid(name, "schedule time " + text + " must be a number of seconds within max");
+		}
+		if (time % interval) return invalid(name, "schedule time " + text + " isn't a multiple of the interval");
+		if (!it->isInt()) return invalid(name, "schedule value for " + text + " must be an integer");
+		entries.push_back({ (int) (time / interval), it->asInt() });
+	}
+	spec.schedule.build(entries);
+	return true;
+}
+
+/**
+ * Function: compile_stats
+ * Description:
+ *   Compile the settings of the streaming statistics handlers, ewma,
+ *   window, rate and pid
+ * Args:
+ *   handler - handler JSON configuration
+ *   spec - compiled configuration
+ * Returns:
+ *   false if the settings are invalid
+ */
+static bool compile_stats(const Json::Value &handler, HandlerSpec &spec)
+{
+	const string &name = spec.name;
+
+	if (!require(handler, "subTopic", name) || !require(handler, "pubTopic", name)) return false;
+
+	if (spec.type == "ewma") {
+		if (!get_number(handler, "alpha", spec.alpha, name)) return false;
+		if (spec.alpha <= 0 || spec.alpha > 1) return invalid(name, "alpha must be above 0 and at most 1");
+		return true;
+	}
+
+	if (spec.type == "pid") {
+		if (!require(handler, "setpoint", name) ||
+			!get_real(handler, "setpoint", spec.setpoint, name) ||
+			!get_real(handler, "kp", spec.kp, name) ||
+			!get_real(handler, "ki", spec.ki, name) ||
+			!get_real(handler, "kd", spec.kd, name) ||
+			!get_real(handler, "outputMin", spec.output_min, name) ||
+			!get_real(handler, "outputMax", spec.output_max, name)) {
+			return false;
+		}
+		if (spec.output_min > spec.output_max) return invalid(name, "outputMin is above outputMax");
+		return true;
+	}
+
+	// Windows are allocated up front, keep them reasonable
+	if (handler.isMember("size")) {
+		if (!handler["size"].isUInt() || handler["size"].asUInt() < 1 || handler["size"].asUInt() > 65536) {
+			return invalid(name, "size must be an integer from 1 to 65536");
+		}
+		spec.window = handler["size"].asUInt();
+	}
+
+	if (spec.type == "rate") {
+		double per = 1;
+		if (!get_number(handler, "per", per, name)) return false;
+		spec.rate_per = llround(per * 1000);
+		if (spec.rate_per < 1) return invalid(name, "per must be at least 1ms");
+		if (spec.window < 2) return invalid(name, "size must be at least 2 for a rate");
+		return true;
+	}
+
+	string statistic = "mean";
+	if (!get_string(handler, "statistic", statistic, name)) return false;
+	if (statistic == "mean") spec.statistic = WindowStatistics::mean;
+	else if (statistic == "min") spec.statistic = WindowStatistics::min;
+	else if (statistic == "max") spec.statistic = WindowStatistics::max;
+	else return invalid(name, "statistic must be mean, min or max");
+	return true;
+}
+
+/**
+ * Function: compile_expression
+ * Description:
+ *   Compile the rules of an expression handler
+ * Args:
+ *   handler - handler JSON configuration
+ *   spec - compiled configuration
+ * Returns:
+ *   false if the settings are invalid
+ */
+static bool compile_expression(const Json::Value &handler, HandlerSpec &spec)
+{
+	const string &name = spec.name;
+	string expression;
+	string update;
+	string error;
+
+	if (!require(handler, "subTopic", name) || !require(handler, "pubTopic", name) || !require(handler, "expression", name) ||
+		!get_string(handler, "expression", expression, name) ||
+		!get_string(handler, "update", update, name) ||
+		!get_real(handler, "initial", spec.initial, name)) {
+		return false;
+	}
+
+	if (!spec.expression.compile(expression, error)) return invalid(name, "expression " + error);
+	if (!update.empty() && !spec.update.compile(update, error)) return invalid(name, "update " + error);
+	return true;
+}
+
+/**
+ * Function: compile_handler
+ * Description:
+ *   Compile and validate the configuration of one handler
+ * Args:
+ *   handler - handler JSON configuration
+ *   spec - compiled configuration, name must be set
+ * Returns:
+ *   false if the configuration is invalid
+ */
+static bool compile_handler(const Json::Value &handler, HandlerSpec &spec)
+{
+	const string &name = spec.name;
+
+	if (!handler.isObject()) return invalid(name, "configuration must be an object");
+	if (!handler["type"].isString()) return invalid(name, "missing type");
+
+	spec.type = handler["type"].asString();
+	spec.fingerprint = fingerprint(name, handler);
+	if (!get_string(handler, "pubTopic", spec.pub_topic, name) || !get_string(handler, "subTopic", spec.sub_topic, name)) {
+		return false;
+	}
+
+	if (spec.type == "hysteresis") {
+		if (!require(handler, "subTopic", name) || !require(handler, "pubTopic", name) || !require(handler, "hysteresis", name)) return false;
+
+		const Json::Value &hysteresis = handler["hysteresis"];
+		if (!compile_limit(hysteresis, "min", spec.min, name) || !compile_limit(hysteresis, "max", spec.max, name)) return false;
+		if (spec.min.limit > spec.max.limit) return invalid(name, "hysteresis min limit is above the max limit");
+		return true;
+	}
+	else if (spec.type == "state") {
+		return require(handler, "subTopic", name) && require(handler, "pubTopic", name) && require(handler, "state", name) &&
+			get_table(handler, "state", spec.state, name) &&
+			get_table(handler, "state_count", spec.state_count, name);
+	}
+	else if (spec.type == "scheduler") {
+		return require(handler, "pubTopic", name) && compile_scheduler(handler, spec);
+	}
+	else if (spec.type == "deadband" || spec.type == "swinging_door") {
+		double max_interval = 0;
+		if (!require(handler, "subTopic", name) ||
+			!get_number(handler, "deadband", spec.deadband, name) ||
+			!get_number(handler, "deviation", spec.deviation, name) ||
+			!get_number(handler, "maxInterval", max_interval, name)) {
+			return false;
+		}
+		spec.max_interval = (long int) (max_interval * 1000);
+		return true;
+	}
+	else if (spec.type == "ewma" || spec.type == "window" || spec.type == "rate" || spec.type == "pid") {
+		return compile_stats(handler, spec);
+	}
+	else if (spec.type == "expression") {
+		return compile_expression(handler, spec);
+	}
+
+	return invalid(name, "unknown type " + spec.type);
+}
+
+/**
+ * Function: compile_handlers
+ * Description:
+ *   Compile the JSON handler configuration, an object of handler
+ *   configurations by handler name.  All handlers are checked and every
+ *   error is logged.
+ * Args:
+ *   config - handler JSON configuration
+ *   specs - set to the compiled handlers if all are valid
+ * Returns:
+ *   true if all handlers are valid
+ */
+bool compile_handlers(const Json::Value &config, vector<HandlerSpec> &specs)
+{
+	if (!config.isObject()) {
+		LOG_ERROR("config") << "Handler configuration must be a JSON object";
+		return false;
+	}
+
+	vector<HandlerSpec> compiled;
+	bool valid = true;
+	for (Json::Value::const_iterator it = config.begin(); it != config.end(); ++it) {
+		HandlerSpec spec;
+		spec.name = it.key().asString();
+		if (!compile_handler(*it, spec)) {
+			valid = false;
+			continue;
+		}
+		compiled.push_back(move(spec));
+	}
+
+	if (!valid) return false;
+	specs = move(compiled);
+	return true;
+}
@@ -4,15 +4,34 @@
 
 #include "config.hpp"
 #include "handlers.hpp"
+#include "handlers/deadband.hpp"
+#include "handlers/ewma.hpp"
+#include "handlers/expression.hpp"
+#include "handlers/moving_window.hpp"
+#include "handlers/pid.hpp"
+#include "handlers/rate.hpp"
 #include "handlers/scheduler.hpp"
 #include "handlers/hysteresis.hpp"
 #include "handlers/state.hpp"
-#include <iostream>
-#include <jsoncpp/json/json.h>
+#include "handlers/swinging_door.hpp"
+#include "log.hpp"
+#include "metrics.hpp"
+#include "publisher.hpp"
+#include "trace.hpp"
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <climits>
+#include <cmath>
+#include <functional>
 #include <mosquitto.h>
 
 using namespace std;
 
+// Metrics
+static Counter &publishes = metrics().counter("controller_publishes_total", "Values published by handlers");
+static Counter &publish_errors = metrics().counter("controller_publish_errors_total", "Handler publishes rejected by mosquitto");
+
 //
 // Handlers Class
 //
@@ -23,31 +42,60 @@ using namespace std;
  *   Handlers factory method for creating Handlers type objects from the known
  *   handler plugins.
  * Args:
- *   handler_plugin - type of handler
- *   handler_name - name of handler instance
+ *   spec - compiled handler configuration
  *   client - mosquitto client
- *   appConfig - application configuration object
  * Returns:
  *   New handler object
  */
-Handlers *Handlers::makeHandler(string handler_plugin, string handler_name, mosquitto *client, appConfig *config)
+Handlers *Handlers::makeHandler(const HandlerSpec &spec, mosquitto *client)
 {
+	const string &handler_plugin = spec.type;
+	const string &handler_name = spec.name;
+
 	// Simple lookup for now
 	if (handler_plugin == "scheduler") {
-		cout << "INFO [handlers] Creating Scheduler instance: name = " << handler_name << endl;
-		return new Scheduler(handler_name, client, config);
+		LOG_INFO("handlers") << "Creating Scheduler instance: name = " << handler_name;
+		return new Scheduler(spec, client);
 	}
 	else if (handler_plugin == "hysteresis") {
-		cout << "INFO [handlers] Creating Hysteresis instance: name = " << handler_name << endl;
-		return new Hysteresis(handler_name, client, config);
+		LOG_INFO("handlers") << "Creating Hysteresis instance: name = " << handler_name;
+		return new Hysteresis(spec, client);
 	}
 	else if (handler_plugin == "state") {
-		cout << "INFO [handlers] Creating State instance: name = " << handler_name << endl;
-		return new State(handler_name, client, config);
+		LOG_INFO("handlers") << "Creating State instance: name = " << handler_name;
+		return new State(spec, client);
+	}
+	else if (handler_plugin == "deadband") {
+		LOG_INFO("handlers") << "Creating Deadband instance: name = " << handler_name;
+		return new Deadband(spec, client);
+	}
+	else if (handler_plugin == "swinging_door") {
+		LOG_INFO("handlers") << "Creating SwingingDoor instance: name = " << handler_name;
+		return new SwingingDoor(spec, client);
+	}
+	else if (handler_plugin == "ewma") {
+		LOG_INFO("handlers") << "Creating Ewma instance: name = " << handler_name;
+		return new Ewma(spec, client);
+	}
+	else if (handler_plugin == "window") {
+		LOG_INFO("handlers") << "Creating MovingWindow instance: name = " << handler_name;
+		return new MovingWindow(spec, client);
+	}
+	else if (handler_plugin == "rate") {
+		LOG_INFO("handlers") << "Creating RateOfChange instance: name = " << handler_name;
+		return new RateOfChange(spec, client);
+	}
+	else if (handler_plugin == "pid") {
+		LOG_INFO("handlers") << "Creating Pid instance: name = " << handler_name;
+		return new Pid(spec, client);
+	}
+	else if (handler_plugin == "expression") {
+		LOG_INFO("handlers") << "Creating ExpressionHandler instance: name = " << handler_name;
+		return new ExpressionHandler(spec, client);
 	}
 
 	// Handler not found
-	cerr << "ERROR [handlers] Invalid handler type: " << handler_plugin << endl;
+	LOG_ERROR("handlers") << "Invalid handler type: " << handler_plugin;
 	return nullptr;
 }
 
@@ -56,24 +104,24 @@ Handlers *Handlers::makeHandler(string handler_plugin, string handler_name, mosq
  * Description:
  *   Handlers Constructor
  * Args:
- *   name - name of handler instance
+ *   spec - compiled handler configuration
  *   client - mosquitto client
- *   appConfig - application configuration object
  */
-Handlers::Handlers(string name, mosquitto *client, appConfig *config) : client {client }, name{ name }
+Handlers::Handlers(const HandlerSpec &spec, mosquitto *client) :
+	fingerprint{ spec.fingerprint }, name{ spec.name }, client{ client }, pubTopic{ spec.pub_topic }, subTopic{ spec.sub_topic }
 {
-	// get handler configuration
-	hconfig = config->handlers.isMember(name) ? config->handlers[name] : new Json::Value;
+	// stable key used to pin the instance to a worker thread
+	shard = hash<string>{}(name);
 
-	// Get topics if available
-	if (hconfig.isMember("pubTopic")) {
-		// Publish topic is set
-		pubTopic = hconfig["pubTopic"].asString();
-	}
-	if (hconfig.isMember("subTopic")) {
-		// Subscription topic is set
-		subTopic = hconfig["subTopic"].asString();
-	}
+	// per instance message counter
+	dispatched = &metrics().counter("controller_handler_messages_total", "Messages and timeouts dispatched to a handler", "handler=" + label_value(name));
+
+	// id of the publish topic in the outbound stage
+	if (Publisher && !pubTopic.empty()) publish_topic = Publisher->topic(pubTopic);
+
+	// names of the handler runs and publishes in message traces
+	trace_label = ::trace_label(name);
+	if (!pubTopic.empty()) publish_label = ::trace_label(pubTopic);
 }
 
 /**
@@ -81,12 +129,11 @@ Handlers::Handlers(string name, mosquitto *client, appConfig *config) : client {
  * Description:
  *   Stub for topic based handlers
  * Args:
- *   topic - current MQTT topic for associated message
- *   msg - current message
+ *   message - current message
  */
-void Handlers::handleTopic(string topic, string msg)
+void Handlers::handleTopic(const Message &message)
 {
-	cout << "DEBUG [handlers] handleTopic stub" << endl;
+	LOG_DEBUG("handlers") << "handleTopic stub";
 }
 
 /**
@@ -96,25 +143,203 @@ void Handlers::handleTopic(string topic, string msg)
  */
 void Handlers::handleTimeout(void)
 {
-	cout << "DEBUG [handlers] handleTimeout stub" << endl;
+	LOG_DEBUG("handlers") << "handleTimeout stub";
+}
+
+/**
+ * Handlers Class Member Function: handlesBatch
+ * Description:
+ *   Handlers taking whole micro-batches of their messages override this
+ *   and handleBatch()
+ * Returns:
+ *   true if messages may be batched for the handler
+ */
+bool Handlers::handlesBatch(void)
+{
+	return false;
+}
+
+/**
+ * Handlers Class Member Function: handleBatch
+ * Description:
+ *   Stub for handlers taking batches
+ * Args:
+ *   batch - messages in arrival order
+ */
+void Handlers::handleBatch(const MessageBatch &batch)
+{
+	LOG_DEBUG("handlers") << "handleBatch stub";
+}
+
+/**
+ * Handlers Class Member Function: storeReading
+ * Description:
+ *   Stub for filter handlers, run on the MQTT thread before a reading is
+ *   queued for the DB writer
+ * Args:
+ *   message - current message
+ * Returns:
+ *   true to store the reading
+ */
+bool Handlers::storeReading(const Message &message)
+{
+	return true;
+}
+
+/**
+ * Handlers Class Member Function: flushReadings
+ * Description:
+ *   Stub for filter handlers holding readings back, called from the timer
+ *   thread every flush interval and once when the handler is released
+ * Args:
+ *   all - store every held reading, the handler is being released
+ */
+void Handlers::flushReadings(bool all)
+{
+}
+
+/**
+ * Handlers Class Member Function: getInterval
+ * Description:
+ *   Default period for timer based handlers
+ * Returns:
+ *   interval in milliseconds
+ */
+unsigned int Handlers::getInterval(void)
+{
+	return 1000;
+}
+
+/**
+ * Handlers Class Member Function: getFlushInterval
+ * Description:
+ *   Period of flushReadings() for filter handlers holding readings back
+ * Returns:
+ *   interval in milliseconds, 0 for no flush timer
+ */
+unsigned int Handlers::getFlushInterval(void)
+{
+	return 0;
+}
+
+/**
+ * Handlers Class Member Function: saveState
+ * Description:
+ *   Stub for stateless handlers, stateful handlers write the state that
+ *   should survive a restart
+ * Args:
+ *   state - buffer of HANDLER_STATE_SIZE bytes
+ * Returns:
+ *   state size, 0 for no state
+ */
+size_t Handlers::saveState(char *state)
+{
+	return 0;
+}
+
+/**
+ * Handlers Class Member Function: restoreState
+ * Description:
+ *   Stub for stateless handlers, stateful handlers take back the state they
+ *   saved before a restart
+ * Args:
+ *   state - saved state
+ *   size - saved state size
+ * Returns:
+ *   true if the state was restored
+ */
+bool Handlers::restoreState(const char *state, size_t size)
+{
+	return false;
+}
+
+/**
+ * Handlers Class Member Function: snapshot
+ * Description:
+ *   Copy the handler state for the state checkpoint, must run where the
+ *   handler runs, i.e. as a job on its worker
+ */
+void Handlers::snapshot(void)
+{
+	snapshot_size = saveState(snapshot_state);
+}
+
+/**
+ * Handlers Class Member Function: getSnapshot
+ * Description:
+ *   returns the state copied by the last snapshot()
+ * Args:
+ *   size - set to the state size, 0 for no state
+ * Returns:
+ *   Handler state
+ */
+const char *Handlers::getSnapshot(size_t &size)
+{
+	size = snapshot_size;
+	return snapshot_state;
 }
 
 /**
  * Handlers Class protected Member Function: publish
  * Description:
- *   Generic function to publish messages to the instance pubTopic
+ *   Generic function to publish values to the instance pubTopic, queued for
+ *   the MQTT network thread by the outbound stage if there is one
  * Args:
- *   text - message to publish
+ *   value - value to publish as text
  */
-void Handlers::publish(string text)
+void Handlers::publish(int value)
 {
+	if (TraceCurrent) trace_event(TraceCurrent, TraceStages::publish_queue, publish_label);
+
+	if (Publisher) {
+		Publisher->publish(publish_topic, value);
+		return;
+	}
+
 	int ret;
+	char text[16];
+
+	// Format on the stack, publishing doesn't allocate
+	int length = to_chars(text, text + sizeof(text), value).ptr - text;
 
-	cout << "DEBUG [Handlers] Publishing value: " << text
-		<< ", for topic: " << pubTopic
-		<< endl;
-	ret = mosquitto_publish(client, NULL, pubTopic.c_str(), text.length(), text.c_str(), 0, false);
-	if (ret) cerr << "ERROR [Handlers] Can't publish to Mosquitto server: " << ret << endl;
+	LOG_DEBUG("Handlers") << "Publishing value: " << value
+		<< ", for topic: " << pubTopic;
+	ret = mosquitto_publish(client, NULL, pubTopic.c_str(), length, text, 0, false);
+	if (TraceCurrent) trace_event(TraceCurrent, TraceStages::publish, publish_label);
+	publishes.add();
+	if (ret) {
+		publish_errors.add();
+		LOG_ERROR("Handlers") << "Can't publish to Mosquitto server: " << ret;
+	}
+}
+
+/**
+ * Handlers Class protected Member Function: publishReading
+ * Description:
+ *   Publish a computed reading rounded to an integer command value
+ * Args:
+ *   reading - value to publish, clamped to the int range
+ */
+void Handlers::publishReading(double reading)
+{
+	if (isnan(reading)) return;
+	publish((int) llround(max((double) INT_MIN, min((double) INT_MAX, reading))));
+}
+
+/**
+ * Handlers Class protected Static Member Function: sampleTime
+ * Description:
+ *   Time of a message reading for handlers working on rates
+ * Args:
+ *   message - current message
+ * Returns:
+ *   device timestamp, or the time received without one, in milliseconds
+ *   since epoch
+ */
+long int Handlers::sampleTime(const Message &message)
+{
+	if (message.ts) return message.ts * 1000;
+	return chrono::duration_cast<chrono::milliseconds>(chrono::system_clock::now().time_since_epoch()).count();
 }
 
 /**
@@ -130,47 +355,75 @@ string Handlers::getName()
 }
 
 /**
- * Handlers Class Member Function: getType
+ * Handlers Class Member Function: getSubTopic
  * Description:
- *   returns the type of handler
+ *   returns the subscription filter of a topic handler, may contain MQTT
+ *   wildcards
  * Returns:
- *   topic or timer
+ *   Handler subscription topic
  */
-HandlerTypes::type Handlers::getType()
+string Handlers::getSubTopic()
 {
-	return type;
+	return subTopic;
 }
 
 /**
- * Handlers Class Member Function: getValue
+ * Handlers Class Member Function: getShard
  * Description:
- *   Get JSON Value from handler config
- * Args:
- *   key - configuration property to get value for
+ *   returns the key used to select the worker thread running this handler
  * Returns:
- *   json value object
+ *   Handler shard key
  */
-Json::Value *Handlers::getValue(string key)
+size_t Handlers::getShard()
 {
-	if (hconfig.isMember(key))
-		return &hconfig[key];
-	else
-		return nullptr;
+	return shard;
 }
 
 /**
- * Handlers Class Member Function: getMapValue
+ * Handlers Class Member Function: getFingerprint
  * Description:
- *   Get JSON Value from map for a given index
- * Args:
- *   key - configuration property to get value for
+ *   returns the hash of the handler configuration, used to find handlers
+ *   unchanged by a reload
+ * Returns:
+ *   Handler configuration fingerprint
+ */
+uint64_t Handlers::getFingerprint()
+{
+	return fingerprint;
+}
+
+/**
+ * Handlers Class Member Function: getTraceLabel
+ * Description:
+ *   returns the label naming the handler in message traces
+ * Returns:
+ *   Handler trace label
+ */
+uint16_t Handlers::getTraceLabel()
+{
+	return trace_label;
+}
+
+/**
+ * Handlers Class Member Function: getDispatchCounter
+ * Description:
+ *   returns the counter of messages and timeouts dispatched to the handler
  * Returns:
- *   json value object
+ *   Handler dispatch counter
  */
-Json::Value *Handlers::getMapValue(string key, string idx)
+Counter &Handlers::getDispatchCounter()
 {
-	if (hconfig.isMember(key))
-		return &hconfig[key][idx];
-	else
-		return nullptr;
+	return *dispatched;
+}
+
+/**
+ * Handlers Class Member Function: getType
+ * Description:
+ *   returns the type of handler
+ * Returns:
+ *   topic or timer
+ */
+HandlerTypes::type Handlers::getType()
+{
+	return type;
 }
@@ -0,0 +1,60 @@
+/**
+ * This handler filters the readings stored in the DB for the topics matching
+ * its subscription topic.  A reading is only stored if it differs from the
+ * last stored reading of the same topic by more than the deadband, or if the
+ * last stored reading is older than maxInterval seconds, in reading time.
+ *
+ * Configuration:
+ *  {
+ *    "type": "deadband",          // this handler type
+ *    "subTopic": "farm/+/+/temp", // topics filtered, may use wildcards
+ *    "deadband": 1,               // drop readings within +-1 of the last stored
+ *    "maxInterval": 60            // store at least one reading per 60 seconds,
+ *                                 // 0 never forces a store
+ *  }
+ */
+
+#include "handlers.hpp"
+#include "handlers/deadband.hpp"
+#include <cmath>
+#include <mosquitto.h>
+
+/**
+ * Deadband Handler Class Member Function: Deadband
+ * Description:
+ *   Deadband Constructor
+ * Args:
+ *   spec - compiled handler configuration
+ *   client - mosquitto client
+ */
+Deadband::Deadband(const HandlerSpec &spec, mosquitto *client) :
+	Handlers(spec, client), deadband{ spec.deadband }, max_interval{ spec.max_interval }
+{
+	// Setup type of handler
+	type = HandlerTypes::filter;
+}
+
+/**
+ * Deadband Handler Class Member Function: storeReading
+ * Description:
+ *   Decide whether the reading of a message matching the subscription topic
+ *   is stored
+ * Args:
+ *   message - current message
+ * Returns:
+ *   true to store the reading
+ */
+bool Deadband::storeReading(const Message &message)
+{
+	long int now = sampleTime(message);
+	Stored *last = stored.find(message.topic);
+
+	if (last && fabs(message.reading - last->value) <= deadband && (!max_interval || now - last->time < max_interval)) {
+		return false;
+	}
+
+	if (!last) last = &stored.get(message.topic);
+	last->value = message.reading;
+	last->time = now;
+	return true;
+}
@@ -0,0 +1,85 @@
+/**
+ * This handler publishes the exponentially weighted moving average of the
+ * handled value, smoothing noisy sensors.  Each reading moves the average
+ * by alpha of its difference to the average, the first reading sets it.
+ * The average is published, rounded, for every reading, e.g. to a topic
+ * handled by a hysteresis handler.
+ *
+ * Configuration:
+ *  {
+ *    "type": "ewma",                           // this handler type
+ *    "subTopic": "farm/tractor/device1/temp",  // sensor averaged
+ *    "pubTopic": "farm/tractor/device1/temp_avg",
+ *    "alpha": 0.2                              // weight of the newest reading,
+ *                                              // above 0 and at most 1
+ *  }
+ */
+
+#include "handlers.hpp"
+#include "handlers/ewma.hpp"
+#include <cstring>
+#include <mosquitto.h>
+
+/**
+ * EWMA Handler Class Member Function: Ewma
+ * Description:
+ *   Ewma Constructor
+ * Args:
+ *   spec - compiled handler configuration
+ *   client - mosquitto client
+ */
+Ewma::Ewma(const HandlerSpec &spec, mosquitto *client) : Handlers(spec, client), alpha{ spec.alpha }
+{
+	// Setup type of handler
+	type = HandlerTypes::topic;
+}
+
+/**
+ * EWMA Handler Class Member Function: handleTopic
+ * Description:
+ *   Process message for a topic matching the subscription topic
+ * Args:
+ *   message - current message
+ */
+void Ewma::handleTopic(const Message &message)
+{
+	if (primed) average += alpha * (message.reading - average);
+	else average = message.reading;
+	primed = true;
+
+	publishReading(average);
+}
+
+/**
+ * EWMA Handler Class Member Function: saveState
+ * Description:
+ *   Save the current average
+ * Args:
+ *   state - buffer of HANDLER_STATE_SIZE bytes
+ * Returns:
+ *   state size, 0 before the first reading
+ */
+size_t Ewma::saveState(char *state)
+{
+	if (!primed) return 0;
+	memcpy(state, &average, sizeof(average));
+	return sizeof(average);
+}
+
+/**
+ * EWMA Handler Class Member Function: restoreState
+ * Description:
+ *   Continue from a saved average
+ * Args:
+ *   state - saved state
+ *   size - saved state size
+ * Returns:
+ *   true if the state was restored
+ */
+bool Ewma::restoreState(const char *state, size_t size)
+{
+	if (size != sizeof(average)) return false;
+	memcpy(&average, state, sizeof(average));
+	primed = true;
+	return true;
+}
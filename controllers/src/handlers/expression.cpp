@@ -0,0 +1,109 @@
+/**
+ * This handler evaluates a rule expression for every reading of the handled
+ * value and publishes the result, rounded, unless it's none.  An optional
+ * update expression is evaluated after it and its result becomes the
+ * handler state, so rules can carry state between readings.  The rules see
+ *
+ *   value - current reading
+ *   prev  - previous reading, none for the first reading
+ *   last  - last value published, none until the first publish
+ *   state - handler state, initial until the first update
+ *   count - number of readings before the current one
+ *
+ * Rules are compiled when the configuration is loaded, see expression.cpp
+ * for the syntax.
+ *
+ * Configuration:
+ *  {
+ *    "type": "expression",                     // this handler type
+ *    "subTopic": "farm/tractor/device1/temp",  // sensor value
+ *    "pubTopic": "farm/tractor/device1/cmd/fan",
+ *    "expression": "value > 40 && !(prev > 40) ? 1 : value < 35 && last == 1 ? 0 : none",
+ *    "update": "state + 1",                    // optional, state after each reading
+ *    "initial": 0                              // optional, initial state (default 0)
+ *  }
+ */
+
+#include "handlers.hpp"
+#include "handlers/expression.hpp"
+#include <cmath>
+#include <cstring>
+#include <mosquitto.h>
+
+using namespace std;
+
+/**
+ * Expression Handler Class Member Function: ExpressionHandler
+ * Description:
+ *   ExpressionHandler Constructor
+ * Args:
+ *   spec - compiled handler configuration
+ *   client - mosquitto client
+ */
+ExpressionHandler::ExpressionHandler(const HandlerSpec &spec, mosquitto *client) :
+	Handlers(spec, client), expression{ spec.expression }, update{ spec.update }
+{
+	// Setup type of handler
+	type = HandlerTypes::topic;
+
+	variables[ExpressionVariables::value] = 0;
+	variables[ExpressionVariables::prev] = NAN;
+	variables[ExpressionVariables::last] = NAN;
+	variables[ExpressionVariables::state] = spec.initial;
+	variables[ExpressionVariables::count] = 0;
+}
+
+/**
+ * Expression Handler Class Member Function: handleTopic
+ * Description:
+ *   Process message for a topic matching the subscription topic
+ * Args:
+ *   message - current message
+ */
+void ExpressionHandler::handleTopic(const Message &message)
+{
+	variables[ExpressionVariables::value] = message.reading;
+
+	double output = expression.evaluate(variables);
+	if (!isnan(output)) {
+		publishReading(output);
+		variables[ExpressionVariables::last] = output;
+	}
+	if (!update.empty()) variables[ExpressionVariables::state] = update.evaluate(variables);
+
+	variables[ExpressionVariables::prev] = message.reading;
+	variables[ExpressionVariables::count]++;
+}
+
+/**
+ * Expression Handler Class Member Function: saveState
+ * Description:
+ *   Save the previous reading, last value published, state and count
+ * Args:
+ *   state - buffer of HANDLER_STATE_SIZE bytes
+ * Returns:
+ *   state size
+ */
+size_t ExpressionHandler::saveState(char *state)
+{
+	// All variables after the current reading
+	memcpy(state, variables + ExpressionVariables::prev, sizeof(double) * (ExpressionVariables::size - 1));
+	return sizeof(double) * (ExpressionVariables::size - 1);
+}
+
+/**
+ * Expression Handler Class Member Function: restoreState
+ * Description:
+ *   Continue with the saved variables
+ * Args:
+ *   state - saved state
+ *   size - saved state size
+ * Returns:
+ *   true if the state was restored
+ */
+bool ExpressionHandler::restoreState(const char *state, size_t size)
+{
+	if (size != sizeof(double) * (ExpressionVariables::size - 1)) return false;
+	memcpy(variables + ExpressionVariables::prev, state, size);
+	return true;
+}
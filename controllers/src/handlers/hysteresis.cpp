@@ -32,93 +32,171 @@
  * Description:
  *   Hysteresis Constructor
  * Args:
- *   name - name of handler instance
+ *   spec - compiled handler configuration
  *   client - mosquitto client
- *   appConfig - application configuration object
  */
-Hysteresis::Hysteresis(string name, mosquitto *client, appConfig *config) : Handlers(name, client, config)
+Hysteresis::Hysteresis(const HandlerSpec &spec, mosquitto *client) : Handlers(spec, client), min{ spec.min }, max{ spec.max }
 {
 	// Setup type of handler
 	type = HandlerTypes::topic;
+}
 
-	// Check if hysteresis configuration is setup
-	if (hconfig.isMember("hysteresis")) {
-		Json::Value hysteresis = hconfig["hysteresis"];
+/**
+ * Hysteresis Handler Class Member Function: handleTopic
+ * Description:
+ *   Process message for a topic matching the subscription topic
+ * Args:
+ *   message - current message
+ */
+void Hysteresis::handleTopic(const Message &message)
+{
+	int value = message.value;
 
-		// Check if min is configured
-		if (hysteresis.isMember("min")) {
-			min.limit = hysteresis["min"]["limit"].asInt();
-			min.value = hysteresis["min"]["value"].asInt();
-			min.repeat = hysteresis["min"]["repeat"].asBool();
+	// Set initial state
+	if (current_state == no_state) {
+		// If no state, then set the current state based on the current value
+		if (value <= min.limit) {
+			current_state = min_state;
+			publish(min.value);
+		}
+		else if (value >= max.limit) {
+			current_state = max_state;
+			publish(max.value);
+		}
+
+		// Nothing else to do until we get next value
+		return;
+	}
+
+	// Perform Hysteresis
+	if (current_state == min_state) {
+		// currently min state
+		if (value >= max.limit) {
+			// max triggered
+			publish(max.value);
+			current_state = max_state;
+			return;
 		}
 
-		// Check if max is configured
-		if (hysteresis.isMember("max")) {
-			max.limit = hysteresis["max"]["limit"].asInt();
-			max.value = hysteresis["max"]["value"].asInt();
-			max.repeat = hysteresis["max"]["repeat"].asBool();
+		// check if we need to publish again
+		if (min.repeat) {
+			publish(min.value);
+		}
+	}
+	else if (current_state == max_state) {
+		// currently max state
+		if (value <= min.limit) {
+			// min triggered
+			publish(min.value);
+			current_state = min_state;
+			return;
+		}
+
+		// check if we need to publish again
+		if (max.repeat) {
+			publish(max.value);
 		}
 	}
 }
 
 /**
- * Hysteresis Handler Class Member Function: handleTopic
+ * Hysteresis Handler Class Member Function: handlesBatch
+ * Returns:
+ *   true, messages may be batched
+ */
+bool Hysteresis::handlesBatch(void)
+{
+	return true;
+}
+
+/**
+ * Hysteresis Handler Class Member Function: handleBatch
  * Description:
- *   Process topic and message.  Ignore if not configured to handle.
- *   Supports only explicit topic matches.
+ *   Process a batch of messages, publishing as handleTopic() would for each.
+ *   Values are scanned for the next limit crossing, so runs that don't
+ *   switch states are only visited again when the state repeats.
  * Args:
- *   topic - current MQTT topic for associated message
- *   msg - current message
+ *   batch - messages in arrival order
  */
-void Hysteresis::handleTopic(string topic, string msg)
+void Hysteresis::handleBatch(const MessageBatch &batch)
 {
-	if (topic == subTopic) {
-		int value = stoi(msg);
+	const int *values = batch.values.data();
+	size_t count = batch.count;
+	int low = min.limit;
+	int high = max.limit;
+	size_t idx = 0;
 
-		// Set initial state
+	while (idx < count) {
+		size_t next;
 		if (current_state == no_state) {
-			// If no state, then set the current state based on the current value
-			if (value <= min.limit) {
+			// First value past either limit sets the state
+			next = find_first(values, idx, count, [low, high](int value) { return (value <= low) | (value >= high); });
+			if (next == count) break;
+
+			if (values[next] <= low) {
 				current_state = min_state;
-				publish(to_string(min.value));
+				publish(min.value);
 			}
-			else if (value >= max.limit) {
+			else {
 				current_state = max_state;
-				publish(to_string(max.value));
+				publish(max.value);
 			}
-
-			// Nothing else to do until we get next value
-			return;
 		}
-
-		// Perform Hysteresis
-		if (current_state == min_state) {
-			// currently min state
-			if (value >= max.limit) {
-				// max triggered
-				publish(to_string(max.value));
-				current_state = max_state;
-				return;
-			}
-
-			// check if we need to publish again
+		else if (current_state == min_state) {
+			next = find_first(values, idx, count, [high](int value) { return value >= high; });
 			if (min.repeat) {
-				publish(to_string(min.value));
-			}
-		}
-		else if (current_state == max_state) {
-			// currently max state
-			if (value <= min.limit) {
-				// min triggered
-				publish(to_string(min.value));
-				current_state = min_state;
-				return;
+				for (; idx < next; idx++) publish(min.value);
 			}
+			if (next == count) break;
 
-			// check if we need to publish again
+			// max triggered
+			publish(max.value);
+			current_state = max_state;
+		}
+		else {
+			next = find_first(values, idx, count, [low](int value) { return value <= low; });
 			if (max.repeat) {
-				publish(to_string(max.value));
+				for (; idx < next; idx++) publish(max.value);
 			}
+			if (next == count) break;
+
+			// min triggered
+			publish(min.value);
+			current_state = min_state;
 		}
+		idx = next + 1;
 	}
 }
+
+/**
+ * Hysteresis Handler Class Member Function: saveState
+ * Description:
+ *   Save the current hysteresis state
+ * Args:
+ *   state - buffer of HANDLER_STATE_SIZE bytes
+ * Returns:
+ *   state size
+ */
+size_t Hysteresis::saveState(char *state)
+{
+	state[0] = (char) current_state;
+	return 1;
+}
+
+/**
+ * Hysteresis Handler Class Member Function: restoreState
+ * Description:
+ *   Restore the hysteresis state, so a restart doesn't publish the current
+ *   state again
+ * Args:
+ *   state - saved state
+ *   size - saved state size
+ * Returns:
+ *   true if the state was restored
+ */
+bool Hysteresis::restoreState(const char *state, size_t size)
+{
+	if (size != 1 || state[0] < no_state || state[0] > max_state) return false;
+	current_state = (enum state) state[0];
+	return true;
+}
@@ -0,0 +1,80 @@
+/**
+ * This handler publishes the mean, min or max of the last size readings of
+ * the handled value, rounded, for every reading.  Until size readings have
+ * arrived the statistic covers the readings so far.  Each reading takes
+ * constant time, min and max are kept with a monotonic queue of the window
+ * readings that can still become the result.
+ *
+ * Configuration:
+ *  {
+ *    "type": "window",                         // this handler type
+ *    "subTopic": "farm/tractor/device1/temp",  // sensor tracked
+ *    "pubTopic": "farm/tractor/device1/temp_max",
+ *    "size": 60,                               // readings in the window, 1 to 65536
+ *    "statistic": "max"                        // mean (default), min or max
+ *  }
+ */
+
+#include "handlers.hpp"
+#include "handlers/moving_window.hpp"
+#include <mosquitto.h>
+
+/**
+ * Moving Window Handler Class Member Function: MovingWindow
+ * Description:
+ *   MovingWindow Constructor
+ * Args:
+ *   spec - compiled handler configuration
+ *   client - mosquitto client
+ */
+MovingWindow::MovingWindow(const HandlerSpec &spec, mosquitto *client) :
+	Handlers(spec, client), statistic{ spec.statistic }, readings(spec.window),
+	extremes(spec.statistic == WindowStatistics::mean ? 1 : spec.window)
+{
+	// Setup type of handler
+	type = HandlerTypes::topic;
+}
+
+/**
+ * Moving Window Handler Class Member Function: handleTopic
+ * Description:
+ *   Process message for a topic matching the subscription topic
+ * Args:
+ *   message - current message
+ */
+void MovingWindow::handleTopic(const Message &message)
+{
+	double reading = message.reading;
+
+	if (statistic == WindowStatistics::mean) {
+		if (readings.full()) {
+			sum -= readings.front();
+			readings.pop_front();
+		}
+		readings.push_back(reading);
+		sum += reading;
+
+		if (++added == readings.capacity()) {
+			sum = 0;
+			for (size_t idx = 0; idx < readings.size(); idx++) sum += readings[idx];
+			added = 0;
+		}
+
+		publishReading(sum / readings.size());
+		return;
+	}
+
+	// Drop readings that left the window, then the ones the new reading
+	// supersedes
+	unsigned long number = samples++;
+	if (!extremes.empty() && extremes.front().number + extremes.capacity() <= number) extremes.pop_front();
+	if (statistic == WindowStatistics::max) {
+		while (!extremes.empty() && extremes.back().reading <= reading) extremes.pop_back();
+	}
+	else {
+		while (!extremes.empty() && extremes.back().reading >= reading) extremes.pop_back();
+	}
+	extremes.push_back(Sample{ number, reading });
+
+	publishReading(extremes.front().reading);
+}
@@ -0,0 +1,122 @@
+/**
+ * This handler is a PID controller driving the handled value towards a
+ * setpoint.  For every reading the output, limited to outputMin and
+ * outputMax, is published rounded:
+ *
+ *   output = kp * error + ki * integral(error) - kd * d(reading)/dt
+ *
+ * where error is setpoint - reading and time is in seconds, from the device
+ * timestamps or the time received.  The derivative is taken of the reading
+ * rather than the error, so changing the setpoint on a reload doesn't kick
+ * the output.  While the output is at a limit the error isn't integrated
+ * further in that direction, so the integral doesn't wind up.
+ *
+ * Configuration:
+ *  {
+ *    "type": "pid",                            // this handler type
+ *    "subTopic": "farm/barn/device3/temp",     // process value
+ *    "pubTopic": "farm/barn/device3/cmd/heater",
+ *    "setpoint": 21,                           // target process value
+ *    "kp": 8,                                  // proportional gain
+ *    "ki": 0.05,                               // integral gain, per second
+ *    "kd": 0,                                  // derivative gain, seconds
+ *    "outputMin": 0,                           // output limits (default int range)
+ *    "outputMax": 100
+ *  }
+ */
+
+#include "handlers.hpp"
+#include "handlers/pid.hpp"
+#include <algorithm>
+#include <cstring>
+#include <mosquitto.h>
+
+using namespace std;
+
+/**
+ * PID Handler Class Member Function: Pid
+ * Description:
+ *   Pid Constructor
+ * Args:
+ *   spec - compiled handler configuration
+ *   client - mosquitto client
+ */
+Pid::Pid(const HandlerSpec &spec, mosquitto *client) :
+	Handlers(spec, client), setpoint{ spec.setpoint }, kp{ spec.kp }, ki{ spec.ki }, kd{ spec.kd },
+	output_min{ spec.output_min }, output_max{ spec.output_max }
+{
+	// Setup type of handler
+	type = HandlerTypes::topic;
+}
+
+/**
+ * PID Handler Class Member Function: handleTopic
+ * Description:
+ *   Process message for a topic matching the subscription topic
+ * Args:
+ *   message - current message
+ */
+void Pid::handleTopic(const Message &message)
+{
+	long int now = sampleTime(message);
+	double error = setpoint - message.reading;
+
+	// Integral and derivative need the time since the last reading, readings
+	// without a later time only update the proportional term
+	double seconds = primed && now > memory.time ? (now - memory.time) / 1000.0 : 0;
+	double derivative = seconds ? (message.reading - memory.reading) / seconds : 0;
+	double integral = memory.integral + error * seconds;
+
+	double output = kp * error + ki * integral - kd * derivative;
+	if (output > output_max) {
+		if (error * ki > 0) integral = memory.integral;
+		output = output_max;
+	}
+	else if (output < output_min) {
+		if (error * ki < 0) integral = memory.integral;
+		output = output_min;
+	}
+
+	memory.integral = integral;
+	if (seconds || !primed) {
+		memory.reading = message.reading;
+		memory.time = now;
+	}
+	primed = true;
+
+	publishReading(output);
+}
+
+/**
+ * PID Handler Class Member Function: saveState
+ * Description:
+ *   Save the integral
+ * Args:
+ *   state - buffer of HANDLER_STATE_SIZE bytes
+ * Returns:
+ *   state size
+ */
+size_t Pid::saveState(char *state)
+{
+	memcpy(state, &memory.integral, sizeof(memory.integral));
+	return sizeof(memory.integral);
+}
+
+/**
+ * PID Handler Class Member Function: restoreState
+ * Description:
+ *   Continue with the saved integral, so a restart doesn't lose the
+ *   settled output.  The time down isn't integrated, the first reading
+ *   after a restart starts the timing again.
+ * Args:
+ *   state - saved state
+ *   size - saved state size
+ * Returns:
+ *   true if the state was restored
+ */
+bool Pid::restoreState(const char *state, size_t size)
+{
+	if (size != sizeof(memory.integral)) return false;
+	memcpy(&memory.integral, state, sizeof(memory.integral));
+	return true;
+}
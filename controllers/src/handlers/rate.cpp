@@ -0,0 +1,54 @@
+/**
+ * This handler publishes the rate of change of the handled value, the
+ * change from the oldest to the newest of the last size readings divided
+ * by the time between them, rounded.  Reading times are the device
+ * timestamps, or the time received for readings without one.  Nothing is
+ * published until two readings with different times have arrived.
+ *
+ * Configuration:
+ *  {
+ *    "type": "rate",                           // this handler type
+ *    "subTopic": "farm/tractor/device1/temp",  // sensor tracked
+ *    "pubTopic": "farm/tractor/device1/temp_rate",
+ *    "size": 5,                                // readings spanned, 2 (default 10) to 65536
+ *    "per": 60                                 // rate per 60 seconds (default 1)
+ *  }
+ */
+
+#include "handlers.hpp"
+#include "handlers/rate.hpp"
+#include <mosquitto.h>
+
+/**
+ * Rate of Change Handler Class Member Function: RateOfChange
+ * Description:
+ *   RateOfChange Constructor
+ * Args:
+ *   spec - compiled handler configuration
+ *   client - mosquitto client
+ */
+RateOfChange::RateOfChange(const HandlerSpec &spec, mosquitto *client) :
+	Handlers(spec, client), samples(spec.window), per{ (double) spec.rate_per }
+{
+	// Setup type of handler
+	type = HandlerTypes::topic;
+}
+
+/**
+ * Rate of Change Handler Class Member Function: handleTopic
+ * Description:
+ *   Process message for a topic matching the subscription topic
+ * Args:
+ *   message - current message
+ */
+void RateOfChange::handleTopic(const Message &message)
+{
+	if (samples.full()) samples.pop_front();
+	samples.push_back(Sample{ sampleTime(message), message.reading });
+
+	Sample &oldest = samples.front();
+	Sample &newest = samples.back();
+	if (newest.time <= oldest.time) return;
+
+	publishReading((newest.reading - oldest.reading) * per / (newest.time - oldest.time));
+}
@@ -4,11 +4,12 @@
  * Configuration:
  *  {
  *    "type": "scheduler",   // this handler type
- *    "interval": 1,         // interval in seconds
- *    "max": 10,             // max number of intervals
+ *    "interval": 1,         // interval in seconds, may be fractional
+ *    "interval_ms": 1000,   // or interval in milliseconds
+ *    "max": 10,             // schedule length in seconds, then repeats
  *    "schedule": {          // schedule to perform
- *      0: 1,                // at interval 0 set the value 1
- *      5: 0                 // at interval 5 set the value 0
+ *      0: 1,                // at 0 seconds set the value 1
+ *      5: 0                 // at 5 seconds set the value 0
  *    },
  *    "pubTopic": "foo"      // publish new value to this publish topic
  *  }
@@ -16,9 +17,8 @@
 
 #include "handlers.hpp"
 #include "handlers/scheduler.hpp"
-#include <jsoncpp/json/json.h>
+#include <cstring>
 #include <mosquitto.h>
-#include <iostream>
 
 using namespace std;
 
@@ -27,26 +27,26 @@ using namespace std;
  * Description:
  *   Scheduler Constructor
  * Args:
- *   name - name of handler instance
+ *   spec - compiled handler configuration
  *   client - mosquitto client
- *   appConfig - application configuration object
  */
-Scheduler::Scheduler(string name, mosquitto *client, appConfig *config) : Handlers(name, client, config)
+Scheduler::Scheduler(const HandlerSpec &spec, mosquitto *client) :
+	Handlers(spec, client), ticks{ spec.ticks }, interval{ spec.interval }, schedule{ spec.schedule }
 {
 	// Setup type of handler
 	type = HandlerTypes::timer;
+}
 
-	// Init
-	tick = 0;
-
-	// Get configuration values
-	interval = hconfig.isMember("interval") ? hconfig["interval"].asInt() : 1;
-	max = hconfig.isMember("max") ? hconfig["max"].asInt() : 1;
-	if (hconfig.isMember("schedule")) {
-		for(Json::Value::const_iterator it=hconfig["schedule"].begin(); it != hconfig["schedule"].end(); ++it) {
-			schedule[stoi(it.key().asString())] = it->asInt();
-		}
-	}
+/**
+ * Scheduler Handler Class Member Function: getInterval
+ * Description:
+ *   Period between schedule ticks
+ * Returns:
+ *   interval in milliseconds
+ */
+unsigned int Scheduler::getInterval(void)
+{
+	return interval;
 }
 
 /**
@@ -56,14 +56,50 @@ Scheduler::Scheduler(string name, mosquitto *client, appConfig *config) : Handle
  */
 void Scheduler::handleTimeout(void)
 {
-	// Get value for interval value
-	auto value = schedule.find(tick);
-	if (value != schedule.end()) {
+	// Get value for the current tick
+	unsigned int current = tick.load(memory_order_relaxed);
+	const int *value = schedule.find(current);
+	if (value) {
 		// Found value so publish value
-		publish(to_string(value->second));
+		publish(*value);
 	}
 
 	// Increment tick for next interval
-	tick += interval;
-	if (tick >= max) tick = 0;
+	tick.store(current + 1 < ticks ? current + 1 : 0, memory_order_relaxed);
+}
+
+/**
+ * Scheduler Handler Class Member Function: saveState
+ * Description:
+ *   Save the next schedule tick
+ * Args:
+ *   state - buffer of HANDLER_STATE_SIZE bytes
+ * Returns:
+ *   state size
+ */
+size_t Scheduler::saveState(char *state)
+{
+	unsigned int current = tick.load(memory_order_relaxed);
+	memcpy(state, &current, sizeof(current));
+	return sizeof(current);
+}
+
+/**
+ * Scheduler Handler Class Member Function: restoreState
+ * Description:
+ *   Continue the schedule at the saved tick instead of its start
+ * Args:
+ *   state - saved state
+ *   size - saved state size
+ * Returns:
+ *   true if the state was restored
+ */
+bool Scheduler::restoreState(const char *state, size_t size)
+{
+	unsigned int current;
+	if (size != sizeof(current)) return false;
+	memcpy(&current, state, sizeof(current));
+	if (current >= ticks) return false;
+	tick.store(current, memory_order_relaxed);
+	return true;
 }
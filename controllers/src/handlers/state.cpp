@@ -16,9 +16,9 @@
 
 #include "handlers.hpp"
 #include "handlers/state.hpp"
-#include <jsoncpp/json/json.h>
+#include "log.hpp"
+#include <cstring>
 #include <mosquitto.h>
-#include <iostream>
 
 using namespace std;
 
@@ -27,68 +27,132 @@ using namespace std;
  * Description:
  *   State Constructor
  * Args:
- *   name - name of handler instance
+ *   spec - compiled handler configuration
  *   client - mosquitto client
- *   appConfig - application configuration object
  */
-State::State(string name, mosquitto *client, appConfig *config) : Handlers(name, client, config)
+State::State(const HandlerSpec &spec, mosquitto *client) : Handlers(spec, client), state{ spec.state }, state_count{ spec.state_count }
 {
 	// Setup type of handler
 	type = HandlerTypes::topic;
+}
 
-	// Get configuration values
-	if (hconfig.isMember("state")) {
-		for(Json::Value::const_iterator it=hconfig["state"].begin(); it != hconfig["state"].end(); ++it) {
-			state[stoi(it.key().asString())] = it->asInt();
-		}
+/**
+ * State Handler Class Member Function: handleTopic
+ * Description:
+ *   Process message for a topic matching the subscription topic
+ * Args:
+ *   message - current message
+ */
+void State::handleTopic(const Message &message)
+{
+	// check message against current state
+	int current_state = message.value;
+	if (current_state != last_state) {
+		changeState(current_state);
 	}
-	if (hconfig.isMember("state_count")) {
-		for(Json::Value::const_iterator it=hconfig["state_count"].begin(); it != hconfig["state_count"].end(); ++it) {
-			state_count[stoi(it.key().asString())] = it->asInt();
-		}
+	else {
+		// Always reset last count if the state hasn't changed
+		last_count = 0;
 	}
 }
 
 /**
- * State Handler Class Member Function: handleTopic
+ * State Handler Class Member Function: handlesBatch
+ * Returns:
+ *   true, messages may be batched
+ */
+bool State::handlesBatch(void)
+{
+	return true;
+}
+
+/**
+ * State Handler Class Member Function: handleBatch
  * Description:
- *   Process topic and message.  Ignore if not configured to handle.
- *   Supports only explicit topic matches.
+ *   Process a batch of messages as handleTopic() would for each.  Runs of
+ *   the last state are skipped in one scan, they only reset the count.
  * Args:
- *   topic - current MQTT topic for associated message
- *   msg - current message
+ *   batch - messages in arrival order
  */
-void State::handleTopic(string topic, string msg)
+void State::handleBatch(const MessageBatch &batch)
 {
-	// verify this instance handles topic
-	if (topic == subTopic) {
-		// check message against current state
-		int current_state = stoi(msg);
-		if (current_state != last_state) {
-			// Get count for current state
-			auto count = state_count.find(current_state);
-			if (count != state_count.end()) {
-				// state count configuration exists, check if satisified
-				if (++last_count < count->second) {
-					// did not exceed limit
-					return;
-				}
-			}
-			// Get value for current state
-			auto value = state.find(current_state);
-			if (value != state.end()) {
-				publish(to_string(value->second));
-			}
-			else {
-				cerr << "ERROR [State] invalid state received: " << current_state << endl;
-			}
+	const int *values = batch.values.data();
+	size_t count = batch.count;
+	size_t idx = 0;
 
-			// Successfully changed states
-			last_state = current_state;
-		}
-		else {
-			// Always reset last count if the state hasn't changed
-			last_count = 0;
+	while (idx < count) {
+		int last = last_state;
+		size_t next = find_first(values, idx, count, [last](int value) { return value != last; });
+		if (next > idx) last_count = 0;
+		if (next == count) break;
+
+		changeState(values[next]);
+		idx = next + 1;
+	}
+}
+
+/**
+ * State Handler Class private Member Function: changeState
+ * Description:
+ *   Count an observation of a state other than the last one, and change
+ *   states once it has been observed often enough
+ * Args:
+ *   current_state - observed state
+ */
+void State::changeState(int current_state)
+{
+	// Get count for current state
+	const int *count = state_count.find(current_state);
+	if (count) {
+		// state count configuration exists, check if satisified
+		if (++last_count < *count) {
+			// did not exceed limit
+			return;
 		}
 	}
+	// Get value for current state
+	const int *value = state.find(current_state);
+	if (value) {
+		publish(*value);
+	}
+	else {
+		LOG_ERROR("State") << "invalid state received: " << current_state;
+	}
+
+	// Successfully changed states
+	last_state = current_state;
+}
+
+/**
+ * State Handler Class Member Function: saveState
+ * Description:
+ *   Save the last state and the observations counted towards a new state
+ * Args:
+ *   state - buffer of HANDLER_STATE_SIZE bytes
+ * Returns:
+ *   state size
+ */
+size_t State::saveState(char *state)
+{
+	memcpy(state, &last_state, sizeof(last_state));
+	memcpy(state + sizeof(last_state), &last_count, sizeof(last_count));
+	return sizeof(last_state) + sizeof(last_count);
+}
+
+/**
+ * State Handler Class Member Function: restoreState
+ * Description:
+ *   Restore the last state and observation count
+ * Args:
+ *   state - saved state
+ *   size - saved state size
+ * Returns:
+ *   true if the state was restored
+ */
+bool State::restoreState(const char *state, size_t size)
+{
+	if (size != sizeof(last_state) + sizeof(last_count)) return false;
+	memcpy(&last_state, state, sizeof(last_state));
+	memcpy(&last_count, state + sizeof(last_state), sizeof(last_count));
+	return true;
 }
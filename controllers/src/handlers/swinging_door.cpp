@@ -0,0 +1,143 @@
+/**
+ * This handler filters the readings stored in the DB for the topics matching
+ * its subscription topic with swinging door compression.  Readings are held
+ * back while a straight line from the last stored reading stays within
+ * +-deviation of every reading since.  Once no such line exists, the held
+ * reading is stored and becomes the new start of the line.  A reading is
+ * also stored if the last stored reading is older than maxInterval seconds.
+ * Times are reading times, the device timestamp when the message has one.
+ *
+ * A held reading is also stored once its series has been quiet for a whole
+ * maxInterval, checked by a timer, and when the handler is released on a
+ * reload or shutdown, so the newest value of a series is never lost.
+ *
+ * Configuration:
+ *  {
+ *    "type": "swinging_door",     // this handler type
+ *    "subTopic": "farm/+/+/temp", // topics filtered, may use wildcards
+ *    "deviation": 2,              // max distance of a reading from the line
+ *    "maxInterval": 300           // store at least one reading per 300 seconds,
+ *                                 // 0 never forces a store
+ *  }
+ */
+
+#include "handlers.hpp"
+#include "handlers/swinging_door.hpp"
+#include "config.hpp"
+#include "insert.hpp"
+#include <algorithm>
+#include <mosquitto.h>
+
+/**
+ * SwingingDoor Handler Class Member Function: SwingingDoor
+ * Description:
+ *   SwingingDoor Constructor
+ * Args:
+ *   spec - compiled handler configuration
+ *   client - mosquitto client
+ */
+SwingingDoor::SwingingDoor(const HandlerSpec &spec, mosquitto *client) :
+	Handlers(spec, client), deviation{ spec.deviation }, max_interval{ spec.max_interval }
+{
+	// Setup type of handler
+	type = HandlerTypes::filter;
+}
+
+/**
+ * SwingingDoor Handler Class Member Function: storeReading
+ * Description:
+ *   Decide whether the reading of a message matching the subscription topic
+ *   is stored, a held back reading may be stored instead
+ * Args:
+ *   message - current message
+ * Returns:
+ *   true to store the reading
+ */
+bool SwingingDoor::storeReading(const Message &message)
+{
+	long int now = sampleTime(message);
+	unique_lock<mutex> guard(lock);
+
+	Door &door = doors.get(message.topic);
+	if (!door.series) door.series = series().intern(message);
+	door.idle = false;
+
+	if (!door.started || (max_interval && now - door.archived_time >= max_interval)) {
+		// First reading or heartbeat, the held reading is stored first
+		if (door.started && door.held) {
+			insert_reading(Config, door.series, door.held_time / 1000, door.held_value);
+		}
+		door.started = true;
+		door.archived_time = now;
+		door.archived_value = message.reading;
+		door.held = false;
+		return true;
+	}
+
+	// Door slopes through this reading +-deviation
+	double elapsed = max(now - door.archived_time, 1L);
+	double upper = (message.reading + deviation - door.archived_value) / elapsed;
+	double lower = (message.reading - deviation - door.archived_value) / elapsed;
+
+	if (door.held) {
+		door.upper = min(door.upper, upper);
+		door.lower = max(door.lower, lower);
+	}
+	else {
+		door.upper = upper;
+		door.lower = lower;
+	}
+
+	if (door.lower > door.upper) {
+		// Doors opened past parallel, store the held reading and restart the
+		// doors from it
+		insert_reading(Config, door.series, door.held_time / 1000, door.held_value);
+		door.archived_time = door.held_time;
+		door.archived_value = door.held_value;
+
+		elapsed = max(now - door.archived_time, 1L);
+		door.upper = (message.reading + deviation - door.archived_value) / elapsed;
+		door.lower = (message.reading - deviation - door.archived_value) / elapsed;
+	}
+
+	door.held = true;
+	door.held_time = now;
+	door.held_value = message.reading;
+	return false;
+}
+
+/**
+ * SwingingDoor Handler Class Member Function: flushReadings
+ * Description:
+ *   Store the held readings of series without a reading since the previous
+ *   flush, they become the new start of their lines
+ * Args:
+ *   all - store every held reading, the handler is being released
+ */
+void SwingingDoor::flushReadings(bool all)
+{
+	unique_lock<mutex> guard(lock);
+
+	doors.each([all](const string&, Door &door) {
+		if (!door.held) return;
+		if (!all && !door.idle) {
+			door.idle = true;
+			return;
+		}
+
+		insert_reading(Config, door.series, door.held_time / 1000, door.held_value);
+		door.archived_time = door.held_time;
+		door.archived_value = door.held_value;
+		door.held = false;
+	});
+}
+
+/**
+ * SwingingDoor Handler Class Member Function: getFlushInterval
+ * Returns:
+ *   maxInterval in milliseconds, 0 flushes only on release
+ */
+unsigned int SwingingDoor::getFlushInterval(void)
+{
+	return (unsigned int) max_interval;
+}
@@ -4,52 +4,486 @@
 
 #include "insert.hpp"
 #include "config.hpp"
+#include "log.hpp"
+#include "message.hpp"
+#include "metrics.hpp"
+#include "pool.hpp"
+#include "rollup.hpp"
+#include "series.hpp"
+#include "spool.hpp"
+#include "writer.hpp"
+#include <algorithm>
+#include <chrono>
 #include <ctime>
-#include <iostream>
 #include <pqxx/pqxx>
+#include <stdexcept>
+#include <tuple>
+#include <vector>
+
+// Background writer for readings, or the durable spool when configured
+static ReadingWriter *writer = nullptr;
+static ReadingSpool *spool = nullptr;
+
+// Aggregation of written readings into rollup buckets, when configured
+static RollupStage *rollups = nullptr;
+
+// Metrics
+static Counter &rows_written = metrics().counter("controller_db_rows_total", "Readings written to the DB");
+static Counter &db_errors = metrics().counter("controller_db_errors_total", "Failed DB batch writes");
+static Counter &series_rejected = metrics().counter("controller_messages_dropped_total", "Messages dropped by a pipeline stage", "reason=\"series_rejected\"");
+static Counter &rows_rejected = metrics().counter("controller_messages_dropped_total", "Messages dropped by a pipeline stage", "reason=\"db_row_rejected\"");
+static Counter &spool_dropped = metrics().counter("controller_messages_dropped_total", "Messages dropped by a pipeline stage", "reason=\"spool_full\"");
+static Histogram &batch_latency = metrics().histogram("controller_db_batch_latency_seconds", "DB batch write time");
 
 /**
- *  Function: insert_reading
+ *  Function: format_timestamp
  *  Description:
- *	  Handle writing device readings to DB
+ *    Format epoch seconds as a PostgreSQL timestamp with time zone literal
  *  Args:
- *    config - application configuration
- *    location - device location
- *    device_type - type of device
- *    device_id - id of device
- *    sensor - name of sensor
- *    reading - sensor reading to store
+ *    ts - seconds since epoch
+ *  Returns:
+ *    string - UTC timestamp
+ */
+static string format_timestamp(long int ts)
+{
+	char buf[32];
+	time_t t = static_cast<time_t> (ts);
+	struct tm tm;
+
+	gmtime_r(&t, &tm);
+	strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S+00", &tm);
+	return string(buf);
+}
+
+/**
+ *  Function: resolve_series
+ *  Description:
+ *    Upsert the series of a batch not known to have a series table id yet
+ *    and store their ids.  Each series is upserted in its own transaction so
+ *    a series whose names the DB rejects as invalid data only loses its own
+ *    readings.  Other errors are thrown, so the whole batch fails and is
+ *    retried rather than dropping the readings of series left without an id.
+ *    Writer threads racing on a new series get the same id.
+ *  Args:
+ *    connection - DB connection
+ *    batch - readings to write
+ *    count - number of valid readings in batch
  */
-void insert_reading(appConfig *config, const char *location, const char *device_type, const char *device_id, const char *sensor, int reading)
+static void resolve_series(pqxx::connection &connection, const vector<Reading> &batch, size_t count)
 {
-	// Mark insert with a timestamp
-	long int ts = static_cast<long int> (std::time(0));
-	cout << "DEBUG [insert] Prepare readings for location: " << location << ", device_type: " << device_type << ", device_id: " << device_id << ", sensor: " << sensor << ", ts: " << ts << ", reading: " << reading << endl;
+	vector<Series *> pending;
+	for (size_t idx = 0; idx < count; idx++) {
+		if (!batch[idx].series->id.load(memory_order_acquire)) pending.push_back(batch[idx].series);
+	}
+	if (pending.empty()) return;
+
+	sort(pending.begin(), pending.end());
+	pending.erase(unique(pending.begin(), pending.end()), pending.end());
 
+	for (Series *entry : pending) {
+		try
+		{
+			pqxx::work transaction{connection};
+			pqxx::result result = transaction.exec_prepared("series_upsert", entry->location, entry->device_type, entry->device_id, entry->sensor);
+			transaction.commit();
+			entry->id.store(result[0][0].as<int32_t>(), memory_order_release);
+		}
+		catch (pqxx::data_exception const &e)
+		{
+			LOG_ERROR("insert") << "Series: " << e.what();
+		}
+	}
+}
+
+/**
+ *  Function: load_series
+ *  Description:
+ *    Intern the series already in the series table with their ids, so
+ *    readings of known series are written without an upsert
+ */
+static void load_series(void)
+{
 	try
 	{
-		// Create new PG connection
-		pqxx::connection connection{config->pg_connection};
+		ConnectionPool::Lease connection = DBPool->acquire();
+		pqxx::work transaction{*connection};
+		pqxx::result result = transaction.exec("SELECT id, location, device_type, device_id, sensor FROM series");
+		for (const auto &row : result) {
+			Series *entry = series().intern(row[1].c_str(), row[2].c_str(), row[3].c_str(), row[4].c_str());
+			entry->id.store(row[0].as<int32_t>(), memory_order_release);
+		}
+		transaction.commit();
 
-		// Prepare Reading
-		std::string sql = "INSERT INTO readings(location, device_type, device_id, sensor, ts, reading) VALUES ($1, $2, $3, $4, to_timestamp($5), $6)";
-		connection.prepare("readings_insert", sql);
+		LOG_INFO("insert") << "Loaded series: " << result.size();
+	}
+	catch (std::exception const &e)
+	{
+		// Series are upserted as their readings are written
+		LOG_ERROR("insert") << "Series: " << e.what();
+	}
+}
 
-		// Perform transaction
-		pqxx::work transaction{connection};
-		transaction.exec_prepared("readings_insert", location, device_type, device_id, sensor, ts, reading);
-		transaction.commit();
+/**
+ *  Function: copy_readings
+ *  Description:
+ *    Write a batch of readings to the DB in a single transaction using
+ *    COPY readings FROM STDIN
+ *  Args:
+ *    connection - DB connection
+ *    batch - readings to write
+ *    count - number of valid readings in batch
+ *  Returns:
+ *    number of rows written, readings of rejected series are skipped
+ */
+static size_t copy_readings(pqxx::connection &connection, const vector<Reading> &batch, size_t count)
+{
+	size_t rows = 0;
+	pqxx::work transaction{connection};
+	pqxx::stream_to stream{transaction, "readings", vector<string>{"series_id", "ts", "reading"}};
+	for (size_t idx = 0; idx < count; idx++) {
+		const Reading &r = batch[idx];
+		int32_t id = r.series->id.load(memory_order_acquire);
+		if (!id) continue;
+		stream << make_tuple(id, format_timestamp(r.ts), r.reading);
+		rows++;
+	}
+	stream.complete();
+	transaction.commit();
+	return rows;
+}
+
+/**
+ *  Function: insert_readings
+ *  Description:
+ *    Write a batch of readings one row per transaction with the prepared
+ *    insert statement, so a rejected row doesn't lose the whole batch
+ *  Args:
+ *    connection - DB connection
+ *    batch - readings to write
+ *    count - number of valid readings in batch
+ *  Returns:
+ *    number of rows written, rejected rows and readings of rejected series
+ *    are skipped
+ */
+static size_t insert_readings(pqxx::connection &connection, const vector<Reading> &batch, size_t count)
+{
+	size_t rows = 0;
+	for (size_t idx = 0; idx < count; idx++) {
+		const Reading &r = batch[idx];
+		int32_t id = r.series->id.load(memory_order_acquire);
+		if (!id) continue;
+
+		try
+		{
+			pqxx::work transaction{connection};
+			transaction.exec_prepared("readings_insert", id, r.ts, r.reading);
+			transaction.commit();
+			rows++;
+		}
+		catch (pqxx::sql_error const &e)
+		{
+			LOG_ERROR("insert") << "SQL: " << e.what();
+			rows_rejected.add();
+		}
+	}
+	return rows;
+}
+
+/**
+ *  Function: upsert_rollups
+ *  Description:
+ *    Write rollup buckets in a single transaction, merging them into any
+ *    stored bucket for the same series, window and start.  Buckets of series
+ *    the series table rejected are skipped.
+ *  Args:
+ *    connection - DB connection
+ *    buckets - rollup buckets to write
+ *    count - number of valid buckets
+ */
+static void upsert_rollups(pqxx::connection &connection, const vector<Rollup> &buckets, size_t count)
+{
+	pqxx::work transaction{connection};
+	for (size_t idx = 0; idx < count; idx++) {
+		const Rollup &r = buckets[idx];
+		int32_t id = r.series->id.load(memory_order_acquire);
+		if (id) transaction.exec_prepared("rollups_upsert", id, r.window, r.bucket, r.count, r.min, r.max, r.sum, r.last, r.last_ts);
 	}
-	catch (pqxx::sql_error const &e)
+	transaction.commit();
+}
+
+/**
+ *  Function: write_rollups
+ *  Description:
+ *    Write the closed rollup buckets using a pooled connection.  Buckets are
+ *    kept for the next write if the DB can't be reached.
+ *  Args:
+ *    all - also write the open buckets
+ */
+static void write_rollups(bool all)
+{
+	try
 	{
-		// Handle SQL errors
-		std::cerr << "ERROR [insert] SQL: " << e.what() << std::endl;
-		return;
+		rollups->drain(all, [](const vector<Rollup> &buckets, size_t count) {
+			ConnectionPool::Lease connection = DBPool->acquire();
+			try
+			{
+				upsert_rollups(*connection, buckets, count);
+			}
+			catch (pqxx::sql_error const &e)
+			{
+				// Rejected buckets are dropped
+				LOG_ERROR("insert") << "SQL: " << e.what();
+			}
+			catch (pqxx::broken_connection const &e)
+			{
+				connection.invalidate();
+				throw;
+			}
+		});
 	}
 	catch (std::exception const &e)
 	{
-		// Handle other errors
-		std::cerr << "ERROR [insert] Other: " << e.what() << std::endl;
-		return;
+		LOG_ERROR("insert") << "Rollups: " << e.what();
+		db_errors.add();
+	}
+}
+
+/**
+ *  Function: write_readings
+ *  Description:
+ *    Write a batch of readings using a pooled connection.  A broken pooled
+ *    connection is dropped and the batch retried once on a new connection,
+ *    as is a batch whose series couldn't be upserted.  Readings of series
+ *    the series table rejected are dropped.
+ *  Args:
+ *    batch - readings to write
+ *    count - number of valid readings in batch
+ *  Returns:
+ *    true if written, false if the DB couldn't be reached
+ */
+static bool write_readings(const vector<Reading> &batch, size_t count)
+{
+	LOG_DEBUG("insert") << "Writing readings batch: " << count;
+	auto start = chrono::steady_clock::now();
+	bool written = false;
+
+	for (int attempt = 0; attempt < 2; attempt++) {
+		try
+		{
+			ConnectionPool::Lease connection = DBPool->acquire();
+			size_t rows;
+			try
+			{
+				resolve_series(*connection, batch, count);
+			}
+			catch (pqxx::broken_connection const &e)
+			{
+				connection.invalidate();
+				throw;
+			}
+			try
+			{
+				rows = copy_readings(*connection, batch, count);
+			}
+			catch (pqxx::sql_error const &e)
+			{
+				// Fall back to row inserts to isolate the rejected rows
+				LOG_ERROR("insert") << "SQL: " << e.what();
+				rows = insert_readings(*connection, batch, count);
+			}
+			catch (pqxx::broken_connection const &e)
+			{
+				connection.invalidate();
+				throw;
+			}
+			size_t rejected = 0;
+			for (size_t idx = 0; idx < count; idx++) {
+				if (!batch[idx].series->id.load(memory_order_acquire)) rejected++;
+			}
+			series_rejected.add(rejected);
+			rows_written.add(rows);
+			batch_latency.record(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count());
+			written = true;
+			break;
+		}
+		catch (pqxx::broken_connection const &e)
+		{
+			// Handle connection errors
+			LOG_ERROR("insert") << "Connection: " << e.what();
+		}
+		catch (pqxx::sql_error const &e)
+		{
+			// Series upsert failed, retry the batch
+			LOG_ERROR("insert") << "Series: " << e.what();
+		}
+		catch (std::exception const &e)
+		{
+			// Handle other errors
+			LOG_ERROR("insert") << "Other: " << e.what();
+			break;
+		}
+	}
+
+	if (!written) {
+		db_errors.add();
+		return false;
+	}
+
+	// Roll up the written readings, rollup failures never fail the batch
+	if (rollups) {
+		rollups->add(batch, count);
+		write_rollups(false);
+	}
+	return true;
+}
+
+/**
+ *  Function: start_writer
+ *  Description:
+ *    Start the background writer that batches readings to the DB.  With a
+ *    spool directory configured readings go through the durable spool,
+ *    otherwise through the in-memory queue.
+ *  Args:
+ *    config - application configuration
+ */
+void start_writer(appConfig *config)
+{
+	// Statements used by the writer threads
+	DBPool->prepare("series_upsert", "INSERT INTO series(location, device_type, device_id, sensor) VALUES ($1, $2, $3, $4) "
+		"ON CONFLICT (location, device_type, device_id, sensor) DO UPDATE SET sensor = EXCLUDED.sensor RETURNING id");
+	DBPool->prepare("readings_insert", "INSERT INTO readings(series_id, ts, reading) VALUES ($1, to_timestamp($2), $3)");
+	load_series();
+
+	if (config->rollup_windows.size()) {
+		LOG_INFO("insert") << "Starting rollups: windows = " << config->rollup_windows.size() << ", grace = " << config->rollup_grace << "s";
+
+		DBPool->prepare("rollups_upsert", "INSERT INTO readings_rollup(series_id, window_seconds, bucket, count, min, max, sum, last, last_ts) "
+			"VALUES ($1, $2, to_timestamp($3), $4, $5, $6, $7, $8, to_timestamp($9)) "
+			"ON CONFLICT (series_id, window_seconds, bucket) DO UPDATE SET "
+			"count = readings_rollup.count + EXCLUDED.count, "
+			"min = LEAST(readings_rollup.min, EXCLUDED.min), "
+			"max = GREATEST(readings_rollup.max, EXCLUDED.max), "
+			"sum = readings_rollup.sum + EXCLUDED.sum, "
+			"last = CASE WHEN EXCLUDED.last_ts >= readings_rollup.last_ts THEN EXCLUDED.last ELSE readings_rollup.last END, "
+			"last_ts = GREATEST(readings_rollup.last_ts, EXCLUDED.last_ts)");
+
+		rollups = new RollupStage(config->rollup_windows, config->rollup_grace, config->rollup_queue_size);
+
+		metrics().gauge("controller_queue_depth", "Queued entries per pipeline queue", "queue=\"rollup\"",
+			[]() { return rollups ? (double) rollups->size() : 0.0; });
+	}
+
+	if (config->spool_dir.length()) {
+		LOG_INFO("insert") << "Starting spool writer: dir = " << config->spool_dir
+			<< ", segment size = " << config->spool_segment_size
+			<< ", segments = " << config->spool_max_segments
+			<< ", batch = " << config->db_batch_size
+			<< ", interval = " << config->db_flush_interval << "ms";
+
+		try
+		{
+			spool = new ReadingSpool(config->spool_dir, config->spool_segment_size, config->spool_max_segments, config->db_batch_size, config->db_flush_interval, write_readings);
+			spool->start();
+
+			metrics().gauge("controller_queue_depth", "Queued entries per pipeline queue", "queue=\"db_spool\"",
+				[]() { return spool ? (double) spool->size() : 0.0; });
+			metrics().gauge("controller_spool_bytes", "Disk space used by the spool segments", "",
+				[]() { return spool ? (double) spool->bytes() : 0.0; });
+			return;
+		}
+		catch (std::exception const &e)
+		{
+			// Fall back to the in-memory queue
+			LOG_ERROR("insert") << "Spool: " << e.what();
+		}
+	}
+
+	LOG_INFO("insert") << "Starting writer: queue = " << config->db_queue_size
+		<< ", batch = " << config->db_batch_size
+		<< ", interval = " << config->db_flush_interval << "ms"
+		<< ", threads = " << config->db_writer_threads
+		<< ", overload = " << config->db_overload_policy;
+
+	OverloadSettings overload;
+	parse_overload_policy(config->db_overload_policy, overload.policy);
+	overload.sample_rate = config->db_sample_rate;
+	overload.hold_timeout = config->db_hold_timeout;
+
+	writer = new ReadingWriter(config->db_queue_size, config->db_batch_size, config->db_flush_interval, config->db_writer_threads, overload, write_readings);
+	writer->start();
+
+	metrics().gauge("controller_queue_depth", "Queued entries per pipeline queue", "queue=\"db_writer\"",
+		[]() { return writer ? (double) writer->size() : 0.0; });
+}
+
+/**
+ *  Function: stop_writer
+ *  Description:
+ *    Flush any queued readings and rollups and stop the background writer.
+ *    Spooled readings that can't be written are kept for the next start.
+ */
+void stop_writer(void)
+{
+	if (writer) {
+		LOG_INFO("insert") << "Stopping writer";
+		delete writer;
+		writer = nullptr;
+	}
+
+	if (spool) {
+		LOG_INFO("insert") << "Stopping spool writer";
+		delete spool;
+		spool = nullptr;
+	}
+
+	// Write the open rollup buckets, later readings merge into them
+	if (rollups) {
+		LOG_INFO("insert") << "Writing open rollups";
+		write_rollups(true);
+		delete rollups;
+		rollups = nullptr;
+	}
+}
+
+/**
+ *  Function: insert_reading
+ *  Description:
+ *	  Queue device readings to be written to DB by the background writer,
+ *	  with the device timestamp if the payload had one
+ *  Args:
+ *    config - application configuration
+ *    message - parsed message holding the device topic and sensor reading
+ */
+void insert_reading(appConfig *config, const Message &message)
+{
+	// Mark insert with a timestamp, unless the device sent one
+	long int ts = message.ts ? message.ts : static_cast<long int> (std::time(0));
+	insert_reading(config, series().intern(message), ts, message.reading, message.trace);
+}
+
+/**
+ *  Function: insert_reading
+ *  Description:
+ *	  Queue a reading of a series with its own timestamp and value, e.g. a
+ *	  reading held back by a filter
+ *  Args:
+ *    config - application configuration
+ *    entry - series of the reading
+ *    ts - reading timestamp in seconds since epoch
+ *    reading - sensor reading to store
+ *    trace - trace id of the message, 0 if not traced
+ */
+void insert_reading(appConfig *config, Series *entry, long int ts, double reading, uint32_t trace)
+{
+	LOG_DEBUG("insert") << "Queue readings for location: " << entry->location << ", device_type: " << entry->device_type << ", device_id: " << entry->device_id << ", sensor: " << entry->sensor << ", ts: " << ts << ", reading: " << reading;
+
+	if (spool) {
+		if (!spool->append(entry, ts, reading)) {
+			spool_dropped.add();
+		}
+	}
+	else if (writer) {
+		// Readings the queue can't take are counted by the writer
+		writer->enqueue(entry, ts, reading, trace);
 	}
 }
@@ -0,0 +1,194 @@
+/**
+ * Logging
+ *
+ * Log lines are formatted by the calling thread into a lock-free ring
+ * buffer and written to stdout (stderr for errors) by a background thread,
+ * so logging never flushes on the hot path.  Lines are dropped and counted
+ * when the ring buffer is full.
+ */
+
+#include "log.hpp"
+#include "metrics.hpp"
+#include "queue.hpp"
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+
+using namespace std;
+
+// Structures
+typedef struct {
+	LogLevels::level level;
+	size_t length;
+	char text[LOG_LINE_SIZE];
+} LogRecord;
+
+// Current runtime log level
+atomic<int> LogLevel{LogLevels::info};
+
+// Logging state
+static BoundedQueue<LogRecord> records(LOG_BUFFER_LINES);
+static atomic<bool> running{false};
+static thread writer;
+
+// Metrics
+static Counter &lines_dropped = metrics().counter("controller_log_dropped_total", "Log lines dropped with the log buffer full");
+
+// Level names
+static const char *level_names[] = { "DEBUG", "INFO", "ERROR" };
+
+//
+// LogLine Class
+//
+
+/**
+ * LogLine Class Member Function: LogLine
+ * Description:
+ *   LogLine Constructor, starts the line with "<LEVEL> [<tag>] "
+ * Args:
+ *   level - log level
+ *   tag - component name
+ */
+LogLine::LogLine(LogLevels::level level, const char *tag) : level{ level }
+{
+	*this << level_names[level] << " [" << tag << "] ";
+}
+
+/**
+ * LogLine Class Member Function: ~LogLine
+ * Description:
+ *   LogLine Destructor, queues the line for the logging thread
+ */
+LogLine::~LogLine()
+{
+	bool queued = records.push([this](LogRecord &record) {
+		record.level = level;
+		record.length = length;
+		memcpy(record.text, text, length);
+	});
+
+	if (!queued) lines_dropped.add();
+}
+
+/**
+ * LogLine Class Member Function: operator<<
+ * Description:
+ *   Append text, truncated at the line size
+ * Args:
+ *   value - text to append
+ */
+LogLine &LogLine::operator<<(string_view value)
+{
+	size_t count = min(value.size(), sizeof(text) - length);
+	memcpy(text + length, value.data(), count);
+	length += count;
+	return *this;
+}
+
+LogLine &LogLine::operator<<(const char *value)
+{
+	return *this << string_view(value ? value : "(null)");
+}
+
+LogLine &LogLine::operator<<(const string &value)
+{
+	return *this << string_view(value);
+}
+
+LogLine &LogLine::operator<<(char value)
+{
+	return *this << string_view(&value, 1);
+}
+
+/**
+ * Function: append_number
+ * Description:
+ *   Append an integer formatted without allocating
+ * Args:
+ *   line - log line
+ *   value - integer to append
+ */
+template <typename T>
+static LogLine &append_number(LogLine &line, T value)
+{
+	char buf[24];
+	return line << string_view(buf, to_chars(buf, buf + sizeof(buf), value).ptr - buf);
+}
+
+LogLine &LogLine::operator<<(int value) { return append_number(*this, value); }
+LogLine &LogLine::operator<<(long value) { return append_number(*this, value); }
+LogLine &LogLine::operator<<(long long value) { return append_number(*this, value); }
+LogLine &LogLine::operator<<(unsigned int value) { return append_number(*this, value); }
+LogLine &LogLine::operator<<(unsigned long value) { return append_number(*this, value); }
+LogLine &LogLine::operator<<(unsigned long long value) { return append_number(*this, value); }
+
+LogLine &LogLine::operator<<(double value)
+{
+	char buf[32];
+	int count = snprintf(buf, sizeof(buf), "%g", value);
+	return *this << string_view(buf, count > 0 ? count : 0);
+}
+
+/**
+ * Function: drain_logs
+ * Description:
+ *   Write all queued log lines
+ * Returns:
+ *   true if any line was written
+ */
+static bool drain_logs(void)
+{
+	bool written = false;
+
+	while (records.pop([](LogRecord &record) {
+		FILE *out = record.level >= LogLevels::error ? stderr : stdout;
+		fwrite(record.text, 1, record.length, out);
+		fputc('\n', out);
+	})) {
+		written = true;
+	}
+
+	if (written) {
+		fflush(stdout);
+		fflush(stderr);
+	}
+	return written;
+}
+
+/**
+ * Function: start_logging
+ * Description:
+ *   Set the log level and start the logging thread
+ * Args:
+ *   level - debug, info, error or none
+ */
+void start_logging(string level)
+{
+	if (level == "debug") LogLevel = LogLevels::debug;
+	else if (level == "error") LogLevel = LogLevels::error;
+	else if (level == "none") LogLevel = LogLevels::none;
+	else LogLevel = LogLevels::info;
+
+	if (running.exchange(true)) return;
+
+	writer = thread([]() {
+		while (running.load()) {
+			if (!drain_logs()) this_thread::sleep_for(chrono::milliseconds(10));
+		}
+		drain_logs();
+	});
+}
+
+/**
+ * Function: stop_logging
+ * Description:
+ *   Write any queued log lines and stop the logging thread
+ */
+void stop_logging(void)
+{
+	if (!running.exchange(false)) return;
+	writer.join();
+}
@@ -2,13 +2,66 @@
  *  Main
  */
 
+#include "batch.hpp"
+#include "codec.hpp"
 #include "config.hpp"
+#include "insert.hpp"
+#include "log.hpp"
+#include "metrics.hpp"
 #include "mqtt.hpp"
-#include <iostream>
+#include "pool.hpp"
+#include "publisher.hpp"
+#include "timers.hpp"
+#include "trace.hpp"
+#include "workers.hpp"
+#include "writer.hpp"
+#include <csignal>
 
 using namespace std;
 
 appConfig *Config;
+ConnectionPool *DBPool;
+WorkerPool *Workers;
+TimerService *Timers;
+PublishStage *Publisher;
+BatchStage *Batcher;
+
+/**
+ *  Function: handle_signal
+ *  Description:
+ *    Stop the MQTT Client on SIGINT/SIGTERM so the application shuts down
+ *    cleanly
+ *  Args:
+ *    sig - signal number
+ */
+static void handle_signal(int sig)
+{
+	stop_mqtt();
+}
+
+/**
+ *  Function: handle_reload
+ *  Description:
+ *    Reload the handler configuration on SIGHUP
+ *  Args:
+ *    sig - signal number
+ */
+static void handle_reload(int sig)
+{
+	request_reload();
+}
+
+/**
+ *  Function: handle_trace_dump
+ *  Description:
+ *    Write the message traces on SIGUSR1
+ *  Args:
+ *    sig - signal number
+ */
+static void handle_trace_dump(int sig)
+{
+	request_trace_dump();
+}
 
 /**
  *  Function: main
@@ -17,15 +70,88 @@ appConfig *Config;
  */
 int main (int argc, char **argv)
 {
+	// Start logging first so startup is logged
+	start_logging(get_env("LOG_LEVEL", "info"));
+
 	// get application configuration
 	Config = process_env();
 
+	// Handler configuration is validated once, before anything starts
+	if (!load_handler_config(Config->handlers)) {
+		LOG_ERROR("main") << "Exiting, invalid handler configuration";
+		stop_logging();
+		return 1;
+	}
+
+	if (!set_payload_codecs(Config->payload_codecs)) {
+		LOG_ERROR("main") << "Exiting, invalid PAYLOAD_CODECS";
+		stop_logging();
+		return 1;
+	}
+
+	OverloadPolicies::type policy;
+	if (!parse_overload_policy(Config->db_overload_policy, policy)) {
+		LOG_ERROR("main") << "Exiting, DB_OVERLOAD_POLICY must be hold, drop_newest, drop_oldest or sample";
+		stop_logging();
+		return 1;
+	}
+
+	if (Config->cluster_node_id >= Config->cluster_nodes) {
+		LOG_ERROR("main") << "Exiting, CLUSTER_NODE_ID must be below CLUSTER_NODES";
+		stop_logging();
+		return 1;
+	}
+
+	// Sample messages for tracing, off unless TRACE_RATE is set
+	start_tracing(Config->trace_rate, Config->trace_buffer);
+
+	// Serve metrics over HTTP
+	if (Config->metrics_port) start_metrics_server(Config->metrics_address, Config->metrics_port);
+
+	// Create DB connection pool shared by all DB access
+	DBPool = new ConnectionPool(Config->pg_connection, Config->pg_pool_size);
+
+	// Start DB writer
+	start_writer(Config);
+
+	// Start handler workers, none runs handlers on the MQTT thread
+	Workers = new WorkerPool(Config->handler_threads, Config->handler_queue_size);
+	Workers->start();
+
+	// Collect messages into batches for the handlers taking them
+	if (Config->batch_interval) Batcher = new BatchStage(Config->batch_size, Config->batch_interval);
+
+	// Queue handler commands for the MQTT network thread
+	Publisher = new PublishStage(Config->publish_queue_size, Config->publish_coalesce, Config->publish_suppress_repeats);
+
+	// Start timer service for timer based handlers
+	Timers = new TimerService();
+	Timers->start();
+
+	// Shutdown cleanly on signals
+	signal(SIGINT, handle_signal);
+	signal(SIGTERM, handle_signal);
+	signal(SIGHUP, handle_reload);
+	signal(SIGUSR1, handle_trace_dump);
+
 	// Start MQTT Client
 	start_mqtt();
 
+	// Stop timers, then run queued handler jobs
+	stop_metrics_server();
+	delete Timers;
+	delete Workers;
+	delete Batcher;
+	delete Publisher;
+
+	// Flush pending readings
+	stop_writer();
+	delete DBPool;
+
 	// Cleanup config
 	delete Config;
 
-	cout << "INFO Exiting..." << endl;
+	LOG_INFO("main") << "Exiting...";
+	stop_logging();
 	return 0;
 }
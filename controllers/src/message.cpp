@@ -0,0 +1,71 @@
+/**
+ * Message
+ *
+ * Functions to parse received messages without copying them
+ */
+
+#include "message.hpp"
+#include <algorithm>
+#include <climits>
+#include <string_view>
+
+using namespace std;
+
+/**
+ * Function: next_level
+ * Description:
+ *   Split the next level off a topic
+ * Args:
+ *   rest - remaining topic levels, advanced past the returned level
+ * Returns:
+ *   string_view - topic level, empty if no levels remain
+ */
+static string_view next_level(string_view &rest)
+{
+	size_t slash = rest.find('/');
+	string_view level = rest.substr(0, slash);
+	rest = slash == string_view::npos ? string_view() : rest.substr(slash + 1);
+	return level;
+}
+
+/**
+ * Function: parse_topic
+ * Description:
+ *   Parse a message topic of <location>/<device>/<device ID>/<sensor>
+ * Args:
+ *   message - parsed message views
+ *   topic - NUL terminated message topic
+ * Returns:
+ *   false if the topic is empty
+ */
+bool parse_topic(Message &message, const char *topic)
+{
+	message.topic = string_view(topic);
+
+	// Get topic tokens
+	string_view rest = message.topic;
+	message.location = next_level(rest);
+	message.device_type = next_level(rest);
+	message.device_id = next_level(rest);
+	message.sensor = next_level(rest);
+
+	return !message.topic.empty();
+}
+
+/**
+ * Function: set_reading
+ * Description:
+ *   Set the decoded reading of a message and its integer value, truncated
+ *   toward zero like the atoi() of text payloads and clamped to the int
+ *   range
+ * Args:
+ *   message - parsed message
+ *   reading - decoded reading
+ *   ts - device timestamp in seconds since epoch, 0 if none
+ */
+void set_reading(Message &message, double reading, long int ts)
+{
+	message.reading = reading;
+	message.value = (int) max((double) INT_MIN, min((double) INT_MAX, reading));
+	message.ts = ts;
+}
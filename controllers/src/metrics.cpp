@@ -0,0 +1,358 @@
+/**
+ * Metrics
+ *
+ * Registry of counters, latency histograms and gauges, rendered in the
+ * Prometheus text format and served on a local HTTP /metrics endpoint
+ */
+
+#include "metrics.hpp"
+#include "log.hpp"
+#include <arpa/inet.h>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <netinet/in.h>
+#include <sstream>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <thread>
+#include <unistd.h>
+
+using namespace std;
+
+// Histogram bucket bounds rendered, powers of 4 from 1us to ~17s
+static const double histogram_bounds[] = {
+	1e-6, 4e-6, 16e-6, 64e-6, 256e-6, 1024e-6, 4096e-6, 16384e-6,
+	65536e-6, 262144e-6, 1048576e-6, 4194304e-6, 16777216e-6
+};
+
+// Seconds a client has to send its request and take the response
+#define CLIENT_TIMEOUT 2
+
+// HTTP server state
+static int server_socket = -1;
+static thread server_thread;
+
+//
+// Histogram Class
+//
+
+/**
+ * Histogram Class Static Member Function: bucket
+ * Description:
+ *   Bucket index of a value, exact below 16 then 8 buckets per power of two
+ * Args:
+ *   ns - value in nanoseconds
+ * Returns:
+ *   bucket index
+ */
+size_t Histogram::bucket(uint64_t ns)
+{
+	if (ns < 16) return ns;
+
+	size_t magnitude = 63 - __builtin_clzll(ns);
+	if (magnitude > 43) return BUCKETS - 1;
+
+	return 16 + (magnitude - 4) * 8 + ((ns >> (magnitude - 3)) & 7);
+}
+
+/**
+ * Histogram Class Static Member Function: upperBound
+ * Description:
+ *   Largest value counted in a bucket
+ * Args:
+ *   idx - bucket index
+ * Returns:
+ *   value in nanoseconds
+ */
+uint64_t Histogram::upperBound(size_t idx)
+{
+	if (idx < 16) return idx;
+
+	size_t magnitude = 4 + (idx - 16) / 8;
+	uint64_t low = (8 + (idx - 16) % 8) << (magnitude - 3);
+	return low + (1ull << (magnitude - 3)) - 1;
+}
+
+//
+// Metrics Class
+//
+
+/**
+ * Metrics Class Member Function: counter
+ * Description:
+ *   Get or create a counter
+ * Args:
+ *   name - metric name
+ *   help - metric description
+ *   labels - Prometheus label set, e.g. handler="door"
+ * Returns:
+ *   counter, valid for the life of the process
+ */
+Counter &Metrics::counter(string name, string help, string labels)
+{
+	unique_lock<mutex> guard(lock);
+	auto &counters = family(name, help, "counter").counters;
+	auto &entry = counters[labels];
+	if (!entry) entry.reset(new Counter);
+	return *entry;
+}
+
+/**
+ * Metrics Class Member Function: histogram
+ * Description:
+ *   Get or create a latency histogram
+ * Args:
+ *   name - metric name, values are rendered in seconds
+ *   help - metric description
+ *   labels - Prometheus label set
+ * Returns:
+ *   histogram, valid for the life of the process
+ */
+Histogram &Metrics::histogram(string name, string help, string labels)
+{
+	unique_lock<mutex> guard(lock);
+	auto &histograms = family(name, help, "histogram").histograms;
+	auto &entry = histograms[labels];
+	if (!entry) entry.reset(new Histogram);
+	return *entry;
+}
+
+/**
+ * Metrics Class Member Function: gauge
+ * Description:
+ *   Register a gauge sampled when rendering, replaces a gauge with the same
+ *   name and labels
+ * Args:
+ *   name - metric name
+ *   help - metric description
+ *   labels - Prometheus label set
+ *   sample - function returning the current value
+ */
+void Metrics::gauge(string name, string help, string labels, GaugeFunc sample)
+{
+	unique_lock<mutex> guard(lock);
+	family(name, help, "gauge").gauges[labels] = sample;
+}
+
+/**
+ * Metrics Class Member Function: render
+ * Description:
+ *   Render all metrics in the Prometheus text exposition format
+ * Returns:
+ *   string - metrics text
+ */
+string Metrics::render(void)
+{
+	unique_lock<mutex> guard(lock);
+	ostringstream out;
+
+	for (auto &entry : families) {
+		const string &name = entry.first;
+		Family &family = entry.second;
+
+		out << "# HELP " << name << " " << family.help << "\n";
+		out << "# TYPE " << name << " " << family.type << "\n";
+
+		for (auto &counter : family.counters) {
+			out << name << (counter.first.empty() ? "" : "{" + counter.first + "}") << " " << counter.second->value() << "\n";
+		}
+
+		for (auto &gauge : family.gauges) {
+			out << name << (gauge.first.empty() ? "" : "{" + gauge.first + "}") << " " << gauge.second() << "\n";
+		}
+
+		for (auto &histogram : family.histograms) {
+			string labels = histogram.first.empty() ? "" : histogram.first + ",";
+			uint64_t cumulative = 0;
+			size_t idx = 0;
+
+			// Cumulative counts of buckets fully below each rendered bound
+			for (double bound : histogram_bounds) {
+				while (idx < Histogram::BUCKETS && Histogram::upperBound(idx) < bound * 1e9) {
+					cumulative += histogram.second->count(idx++);
+				}
+				out << name << "_bucket{" << labels << "le=\"" << bound << "\"} " << cumulative << "\n";
+			}
+			while (idx < Histogram::BUCKETS) cumulative += histogram.second->count(idx++);
+
+			out << name << "_bucket{" << labels << "le=\"+Inf\"} " << cumulative << "\n";
+			out << name << "_sum" << (histogram.first.empty() ? "" : "{" + histogram.first + "}") << " " << histogram.second->total() / 1e9 << "\n";
+			out << name << "_count" << (histogram.first.empty() ? "" : "{" + histogram.first + "}") << " " << cumulative << "\n";
+		}
+	}
+
+	return out.str();
+}
+
+/**
+ * Metrics Class private Member Function: family
+ * Description:
+ *   Get or create a metric family, lock must be held
+ * Args:
+ *   name - metric name
+ *   help - metric description
+ *   type - Prometheus metric type
+ * Returns:
+ *   metric family
+ */
+Metrics::Family &Metrics::family(const string &name, const string &help, const string &type)
+{
+	Family &family = families[name];
+	if (family.type.empty()) {
+		family.help = help;
+		family.type = type;
+	}
+	return family;
+}
+
+/**
+ * Function: metrics
+ * Description:
+ *   Process wide metrics registry, safe to use during static initialization
+ * Returns:
+ *   Metrics - registry
+ */
+Metrics &metrics(void)
+{
+	static Metrics registry;
+	return registry;
+}
+
+/**
+ * Function: serve_metrics
+ * Description:
+ *   HTTP server thread, answers GET /metrics with the rendered metrics.
+ *   Clients are served one at a time, each gets CLIENT_TIMEOUT seconds to
+ *   send its request and read the response, so an idle connection can't
+ *   hold up scraping.
+ * Args:
+ *   listener - listening socket
+ */
+static void serve_metrics(int listener)
+{
+	while (true) {
+		int client = accept(listener, NULL, NULL);
+		if (client < 0) {
+			// Listening socket was shut down
+			if (errno == EINTR) continue;
+			break;
+		}
+
+		struct timeval timeout = { CLIENT_TIMEOUT, 0 };
+		setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+		char request[1024];
+		ssize_t length = read(client, request, sizeof(request) - 1);
+		if (length <= 0) {
+			// Timed out or closed without a request
+			close(client);
+			continue;
+		}
+		request[length] = '\0';
+
+		string body, status;
+		if (!strncmp(request, "GET /metrics", 12)) {
+			status = "200 OK";
+			body = metrics().render();
+		}
+		else {
+			status = "404 Not Found";
+			body = "Not Found\n";
+		}
+
+		string response = "HTTP/1.0 " + status + "\r\n"
+			"Content-Type: text/plain; version=0.0.4\r\n"
+			"Content-Length: " + to_string(body.size()) + "\r\n"
+			"Connection: close\r\n\r\n" + body;
+
+		const char *data = response.c_str();
+		size_t remaining = response.size();
+		while (remaining) {
+			ssize_t sent = write(client, data, remaining);
+			if (sent <= 0) break;
+			data += sent;
+			remaining -= sent;
+		}
+		close(client);
+	}
+}
+
+/**
+ * Function: label_value
+ * Description:
+ *   Quote a label value for the Prometheus text format, escaping backslash,
+ *   double quote and newline
+ * Args:
+ *   value - label value, e.g. a handler name from the configuration
+ * Returns:
+ *   quoted label value
+ */
+string label_value(string_view value)
+{
+	string quoted = "\"";
+	for (char c : value) {
+		if (c == '\\') quoted += "\\\\";
+		else if (c == '"') quoted += "\\\"";
+		else if (c == '\n') quoted += "\\n";
+		else quoted += c;
+	}
+	return quoted + "\"";
+}
+
+/**
+ * Function: start_metrics_server
+ * Description:
+ *   Serve the metrics on http://<address>:<port>/metrics
+ * Args:
+ *   address - IPv4 address to listen on, 0.0.0.0 for all interfaces
+ *   port - TCP port to listen on
+ */
+void start_metrics_server(const string &address, unsigned short int port)
+{
+	struct sockaddr_in addr = {};
+	int enable = 1;
+
+	server_socket = socket(AF_INET, SOCK_STREAM, 0);
+	if (server_socket < 0) {
+		LOG_ERROR("metrics") << "Can't create socket: " << strerror(errno);
+		return;
+	}
+
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	if (inet_pton(AF_INET, address.c_str(), &addr.sin_addr) != 1) {
+		LOG_ERROR("metrics") << "Invalid listen address " << address;
+		close(server_socket);
+		server_socket = -1;
+		return;
+	}
+	setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+
+	if (bind(server_socket, (struct sockaddr *) &addr, sizeof(addr)) || listen(server_socket, 8)) {
+		LOG_ERROR("metrics") << "Can't listen on " << address << ":" << port << ": " << strerror(errno);
+		close(server_socket);
+		server_socket = -1;
+		return;
+	}
+
+	LOG_INFO("metrics") << "Serving metrics on " << address << ":" << port;
+	server_thread = thread(serve_metrics, server_socket);
+}
+
+/**
+ * Function: stop_metrics_server
+ * Description:
+ *   Stop the HTTP metrics server
+ */
+void stop_metrics_server(void)
+{
+	if (server_socket < 0) return;
+
+	shutdown(server_socket, SHUT_RDWR);
+	server_thread.join();
+	close(server_socket);
+	server_socket = -1;
+}
@@ -3,20 +3,78 @@
  */
 
 #include "mqtt.hpp"
+#include "batch.hpp"
+#include "capture.hpp"
+#include "checkpoint.hpp"
+#include "cluster.hpp"
+#include "codec.hpp"
 #include "config.hpp"
 #include "handlers.hpp"
 #include "insert.hpp"
+#include "log.hpp"
+#include "message.hpp"
+#include "metrics.hpp"
+#include "publisher.hpp"
+#include "timers.hpp"
+#include "topics.hpp"
+#include "trace.hpp"
+#include "workers.hpp"
+#include <algorithm>
+#include <atomic>
 #include <chrono>
-#include <functional>
-#include <iostream>
+#include <memory>
+#include <set>
 #include <mosquitto.h>
-#include <sstream>
+#include <stdexcept>
 #include <string.h>
 #include <thread>
+#include <unordered_map>
 #include <vector>
 
 using namespace std;
 
+// Network loop runs until stopped
+static atomic<bool> running{false};
+
+// Subscription identifiers in cluster mode, readings to store arrive on the
+// shared subscription and messages for owned handlers on their own
+// subscriptions
+#define INGEST_SUBSCRIPTION 1
+#define HANDLER_SUBSCRIPTION 2
+
+// Handler topics subscribed, only used by the network thread, and whether
+// the current handler set wants other topics
+static set<string> subscribed;
+static atomic<bool> subscriptions_changed{false};
+
+// Current handler set and dispatch epoch, odd while a message is dispatched
+static atomic<HandlerSet *> current_handlers{nullptr};
+static atomic<unsigned long> dispatch_epoch{0};
+
+// Handler state checkpoint, nullptr if disabled
+static StateCheckpoint *checkpoint = nullptr;
+
+// Capture of the received messages, nullptr if disabled
+static MessageCapture *capture = nullptr;
+
+// Reload requests and the reload thread state
+static atomic<bool> reload_requested{false};
+static atomic<bool> reloading{false};
+static void run_reloader(mosquitto*);
+static void run_network_loop(mosquitto*);
+static void publish_metrics(mosquitto*, chrono::steady_clock::time_point&);
+static void save_checkpoint(bool);
+static bool subscribe_ingest(mosquitto*);
+static void sync_subscriptions(mosquitto*);
+static void handle_message(const struct mosquitto_message*, bool, bool);
+static void handle_reading(const Message&, bool, bool);
+
+// Metrics
+static Counter &messages_received = metrics().counter("controller_messages_received_total", "MQTT messages received");
+static Counter &messages_invalid = metrics().counter("controller_messages_dropped_total", "Messages dropped by a pipeline stage", "reason=\"invalid\"");
+static Counter &config_reloads = metrics().counter("controller_config_reloads_total", "Handler configuration reloads");
+static Counter &readings_filtered = metrics().counter("controller_readings_filtered_total", "Readings not stored due to a filter handler");
+
 /**
  *  Function: start_mqtt
  *  Description:
@@ -24,73 +82,212 @@ using namespace std;
  */
 void start_mqtt()
 {
-	int ret;
 	struct mosquitto *mosq_client;
-	vector<Handlers *> handlers;
 
-	cout << "INFO [mqtt] Intialize MQTT Client" << endl;
+	LOG_INFO("mqtt") << "Intialize MQTT Client";
 
 	// Initialize Mosquitto Library
 	mosquitto_lib_init();
 
 	// Start MQTT Client
-	mosq_client = create_mqtt_client(&handlers);
+	mosq_client = create_mqtt_client();
 
 	// Check if a client was created
 	if (mosq_client != nullptr) {
-		// Initialize Handlers
-		init_handlers(handlers, mosq_client);
+		// Open the state saved by the last run
+		if (!Config->checkpoint_file.empty()) {
+			try
+			{
+				checkpoint = new StateCheckpoint(Config->checkpoint_file);
+			}
+			catch (const runtime_error &e)
+			{
+				LOG_ERROR("checkpoint") << e.what() << ", handler state won't be saved";
+			}
+		}
 
-		// Create timer based handlers
-		start_timer_handlers(handlers);
+		// Record the received messages for replay
+		if (!Config->capture_file.empty()) {
+			try
+			{
+				capture = new MessageCapture(Config->capture_file, Config->capture_size);
+			}
+			catch (const runtime_error &e)
+			{
+				LOG_ERROR("capture") << e.what() << ", messages won't be captured";
+			}
+		}
+
+		// Initialize Handlers, index topic handlers and start timer handlers
+		publish_handlers(load_handlers(Config->handlers, mosq_client, nullptr));
 
 		// Setup subscription last
 		// Create subscription to listen for messages from devices
-		ret = mosquitto_subscribe(mosq_client, NULL, Config->mqtt_sub_topic.c_str(), 0);
-		if (ret) {
-			cerr << "ERROR [mqtt] Can't subscribe to topic " << Config->mqtt_sub_topic << " with error: " << ret << endl;
-		} else {
+		if (subscribe_ingest(mosq_client)) {
 			// Add callback for all incomming messages
-			mosquitto_message_callback_set(mosq_client, mqtt_subscription_handler);
+			if (cluster_enabled()) {
+				mosquitto_message_v5_callback_set(mosq_client, mqtt_subscription_handler_v5);
+				sync_subscriptions(mosq_client);
+			}
+			else {
+				mosquitto_message_callback_set(mosq_client, mqtt_subscription_handler);
+			}
 
-			// Wait on mosquitto
-			mosquitto_loop_forever(mosq_client, -1, 1);
+			// Reload handlers and write traces on request, off the MQTT thread
+			reloading = true;
+			thread reloader(run_reloader, mosq_client);
+
+			if (!Config->metrics_topic.empty()) {
+				LOG_INFO("metrics") << "Publishing metrics to " << Config->metrics_topic
+					<< " every " << Config->metrics_interval << "ms";
+			}
+
+			// Run the network loop until stop_mqtt()
+			running = true;
+			run_network_loop(mosq_client);
+
+			reloading = false;
+			reloader.join();
+
+			// Save the final handler state for the next start
+			save_checkpoint(true);
 		}
+
+		// Stop timer handlers and release the handlers
+		publish_handlers(nullptr);
+		delete checkpoint;
+		checkpoint = nullptr;
+		delete capture;
+		capture = nullptr;
 	}
 
-	// When client calls mosquitto_disconnect(), clean up
+	// Network loop has disconnected, clean up
 	mosquitto_destroy(mosq_client);
 	mosquitto_lib_cleanup();
 
 	return;
 }
 
+/**
+ *  Function: stop_mqtt
+ *  Description:
+ *    Stop the network loop so the MQTT Client disconnects and start_mqtt
+ *    returns, safe to call from a signal handler
+ */
+void stop_mqtt()
+{
+	running = false;
+}
+
+/**
+ *  Function: run_network_loop
+ *  Description:
+ *    MQTT network loop, runs until stop_mqtt() is called.  Queued handler
+ *    commands and metrics are published between network iterations, so this
+ *    is the only thread calling mosquitto_publish.  A lost connection is
+ *    reconnected and subscribed again.
+ *  Args:
+ *    client - mosquitto client object
+ */
+static void run_network_loop(mosquitto *client)
+{
+	// Wake up for batches as well as queued commands
+	unsigned int interval = Config->publish_interval;
+	if (Batcher) interval = min(interval, Config->batch_interval);
+	int timeout = max(interval, 1u);
+	auto metrics_due = chrono::steady_clock::now();
+	auto checkpoint_due = metrics_due + chrono::seconds(Config->checkpoint_interval);
+
+	while (running) {
+		int ret = mosquitto_loop(client, timeout, 1);
+		if (Batcher) Batcher->flush(false);
+		if (Publisher) Publisher->flush(client, false);
+		publish_metrics(client, metrics_due);
+		if (Config->checkpoint_interval && chrono::steady_clock::now() >= checkpoint_due) {
+			save_checkpoint(false);
+			checkpoint_due = chrono::steady_clock::now() + chrono::seconds(Config->checkpoint_interval);
+		}
+		if (checkpoint) checkpoint->poll();
+		if (subscriptions_changed.exchange(false)) sync_subscriptions(client);
+
+		if (ret != MOSQ_ERR_SUCCESS && running) {
+			LOG_ERROR("mqtt") << "Connection lost with error: " << ret << ", reconnecting";
+			this_thread::sleep_for(chrono::seconds(1));
+			if (mosquitto_reconnect(client) == MOSQ_ERR_SUCCESS) {
+				// The session is clean, subscribe to all topics again
+				subscribed.clear();
+				subscribe_ingest(client);
+				sync_subscriptions(client);
+			}
+		}
+	}
+
+	// Run the open batches, then publish the commands still queued or
+	// coalescing and disconnect
+	if (Batcher) {
+		Batcher->flush(true);
+		Workers->drain();
+	}
+	if (Publisher) Publisher->flush(client, true);
+	mosquitto_loop(client, timeout, 1);
+	mosquitto_disconnect(client);
+}
+
+/**
+ *  Function: request_reload
+ *  Description:
+ *    Ask for the handler configuration to be reloaded, safe to call from a
+ *    signal handler
+ */
+void request_reload()
+{
+	reload_requested = true;
+}
+
+/**
+ *  Function: run_reloader
+ *  Description:
+ *    Reload thread, reloads the handlers and writes the message traces when
+ *    requested
+ *  Args:
+ *    client - mosquitto client object
+ */
+static void run_reloader(mosquitto *client)
+{
+	while (reloading.load()) {
+		if (trace_dump_requested()) write_trace(Config->trace_file);
+		if (reload_requested.exchange(false)) reload_handlers(client);
+		else this_thread::sleep_for(chrono::milliseconds(100));
+	}
+}
+
 /**
  *  Function: create_mqtt_client
  *  Description:
  *	  Create a MQTT Client instance and start connection
- *  Args:
- *    handlers - pointer to a list of handlers
  *  Returns:
  *    mosquitto - mosquitto client object
  */
-mosquitto *create_mqtt_client(vector<Handlers *> *handlers)
+mosquitto *create_mqtt_client(void)
 {
 	struct mosquitto *mosq = NULL;
 
 	// Create a Mosquitto Runtime instance
 	// Use a random client ID
-	mosq = mosquitto_new(NULL, true, (void *) handlers);
+	mosq = mosquitto_new(NULL, true, NULL);
 
 	if (!mosq) {
-		cerr << "ERROR [mqtt] Can't initialize Mosquitto library" << endl;
+		LOG_ERROR("mqtt") << "Can't initialize Mosquitto library";
 		return mosq;
 	}
 
+	// Shared subscriptions and subscription identifiers need MQTT v5
+	if (cluster_enabled()) mosquitto_int_option(mosq, MOSQ_OPT_PROTOCOL_VERSION, MQTT_PROTOCOL_V5);
+
 	// Client initialized, make connection
 	int ret = mosquitto_connect(mosq, Config->mqtt_hostname.c_str(), Config->mqtt_port, Config->mqtt_keepalive_interval);
 	if (ret) {
-		cerr << "ERROR [mqtt] Can't connect to Mosquitto server: mqtt://" << Config->mqtt_hostname << ":" << Config->mqtt_port << endl;
+		LOG_ERROR("mqtt") << "Can't connect to Mosquitto server: mqtt://" << Config->mqtt_hostname << ":" << Config->mqtt_port;
 		// Clean up mosquitto instance, and return null pointer to indicate no client was created
 		mosquitto_destroy(mosq);
 		return nullptr;
@@ -99,100 +296,463 @@ mosquitto *create_mqtt_client(vector<Handlers *> *handlers)
 	return mosq;
 }
 
+/**
+ *  Function: subscribe_ingest
+ *  Description:
+ *    Subscribe to the device topics, in cluster mode with a shared
+ *    subscription so each message is delivered to one node of the group.
+ *    The trace control topic is subscribed by every node.
+ *  Args:
+ *    client - mosquitto client object
+ *  Returns:
+ *    true if subscribed
+ */
+static bool subscribe_ingest(mosquitto *client)
+{
+	int ret;
+	string topic = Config->mqtt_sub_topic;
+
+	if (cluster_enabled()) {
+		topic = "$share/" + Config->cluster_group + "/" + topic;
+
+		mosquitto_property *properties = nullptr;
+		mosquitto_property_add_varint(&properties, MQTT_PROP_SUBSCRIPTION_IDENTIFIER, INGEST_SUBSCRIPTION);
+		ret = mosquitto_subscribe_v5(client, NULL, topic.c_str(), 0, 0, properties);
+		mosquitto_property_free_all(&properties);
+	}
+	else {
+		ret = mosquitto_subscribe(client, NULL, topic.c_str(), 0);
+	}
+
+	if (ret) {
+		LOG_ERROR("mqtt") << "Can't subscribe to topic " << topic << " with error: " << ret;
+		return false;
+	}
+
+	if (!Config->trace_topic.empty()) {
+		ret = mosquitto_subscribe(client, NULL, Config->trace_topic.c_str(), 0);
+		if (ret) {
+			LOG_ERROR("mqtt") << "Can't subscribe to trace topic " << Config->trace_topic << " with error: " << ret;
+		}
+	}
+	return true;
+}
+
+/**
+ *  Function: sync_subscriptions
+ *  Description:
+ *    Subscribe to the topics of the handlers this node owns and unsubscribe
+ *    from topics no longer used, only called from the network thread
+ *  Args:
+ *    client - mosquitto client object
+ */
+static void sync_subscriptions(mosquitto *client)
+{
+	// Copy the topics while the handler set can't be released
+	dispatch_epoch.fetch_add(1);
+	HandlerSet *handlers = current_handlers.load();
+	set<string> wanted;
+	if (handlers) wanted.insert(handlers->subscriptions.begin(), handlers->subscriptions.end());
+	dispatch_epoch.fetch_add(1, memory_order_release);
+
+	for (const string &topic : subscribed) {
+		if (!wanted.count(topic)) mosquitto_unsubscribe(client, NULL, topic.c_str());
+	}
+
+	for (const string &topic : wanted) {
+		if (subscribed.count(topic)) continue;
+
+		mosquitto_property *properties = nullptr;
+		mosquitto_property_add_varint(&properties, MQTT_PROP_SUBSCRIPTION_IDENTIFIER, HANDLER_SUBSCRIPTION);
+		int ret = mosquitto_subscribe_v5(client, NULL, topic.c_str(), 0, 0, properties);
+		mosquitto_property_free_all(&properties);
+		if (ret) {
+			LOG_ERROR("mqtt") << "Can't subscribe to handler topic " << topic << " with error: " << ret;
+		}
+	}
+
+	subscribed.swap(wanted);
+}
+
 /**
  *  Function: mqtt_subscription_handler
  *  Description:
  *	  Handle all subscription messages and start handler logic based on topic stucture of
- *	  <location>/<device>/<device ID>/<sensor>
+ *	  <location>/<device>/<device ID>/<sensor>.  Must only be called from one
+ *	  thread at a time.
  *  Args:
  *    mosq - mosquitto client object
- *    obj - handlers object as configured with mosquitto_new
+ *    obj - unused
  *    message - received message
  */
 void mqtt_subscription_handler(struct mosquitto *mosq, void *obj, const struct mosquitto_message *message)
 {
-	vector<Handlers *> *handlers = (vector<Handlers *> *) obj;
+	handle_message(message, true, true);
+}
+
+/**
+ *  Function: mqtt_subscription_handler_v5
+ *  Description:
+ *	  Handle subscription messages in cluster mode, the subscription
+ *	  identifiers tell whether the reading is stored by this node, the
+ *	  message is for handlers owned by this node, or both
+ *  Args:
+ *    mosq - mosquitto client object
+ *    obj - unused
+ *    message - received message
+ *    properties - MQTT v5 message properties
+ */
+void mqtt_subscription_handler_v5(struct mosquitto *mosq, void *obj, const struct mosquitto_message *message, const mosquitto_property *properties)
+{
+	bool ingest = false;
+	bool dispatch = false;
+	uint32_t id;
+
+	const mosquitto_property *property = mosquitto_property_read_varint(properties, MQTT_PROP_SUBSCRIPTION_IDENTIFIER, &id, false);
+	while (property) {
+		if (id == INGEST_SUBSCRIPTION) ingest = true;
+		else if (id == HANDLER_SUBSCRIPTION) dispatch = true;
+		property = mosquitto_property_read_varint(property, MQTT_PROP_SUBSCRIPTION_IDENTIFIER, &id, true);
+	}
+
+	handle_message(message, ingest, dispatch);
+}
+
+/**
+ *  Function: handle_message
+ *  Description:
+ *	  Parse a message and decode its payload with the codec of its topic,
+ *	  then handle each decoded reading.  Each field of a multi field payload
+ *	  is a reading of the sensor named by the field.  A message on the trace
+ *	  control topic writes the message traces instead.  Every message
+ *	  delivered for ingest is counted and recorded when capturing.
+ *  Args:
+ *    message - received message
+ *    ingest - store the readings
+ *    dispatch - run the handlers
+ */
+static void handle_message(const struct mosquitto_message *message, bool ingest, bool dispatch)
+{
+	// Only the network thread handles messages, buffers keep their capacity
+	static Payload payload;
+	static string field_topic;
+	Message msg;
+
+	// Sampled before parsing, so the trace includes it
+	uint32_t trace = trace_sample();
+	if (trace) trace_event(trace, TraceStages::receive);
+
+	// In cluster mode a node may also get the handler subscription's copy of
+	// a message, only the copy of the shared ingest subscription is counted
+	// and captured, so each message counts once across the cluster
+	if (ingest) {
+		messages_received.add();
+		if (capture) capture->record(message->topic, message->payload, message->payloadlen > 0 ? message->payloadlen : 0);
+	}
+
+	if (!Config->trace_topic.empty() && Config->trace_topic == message->topic) {
+		request_trace_dump();
+		return;
+	}
+
+	// Received message, parsed in place without copies
+	string_view data((const char *) message->payload, message->payloadlen > 0 ? message->payloadlen : 0);
+	if (!parse_topic(msg, message->topic) || !decode_payload(payload_codec(msg.topic), data, payload)) {
+		messages_invalid.add();
+		LOG_ERROR("mqtt") << "Received invalid message";
+		return;
+	}
+	msg.payload = data;
+	msg.trace = trace;
+
+	// ignore commands sent to devices loopbacked to controller
+	if (msg.sensor == "cmd") return;
+
+	for (size_t idx = 0; idx < payload.count; idx++) {
+		const PayloadField &field = payload.fields[idx];
+		Message reading = msg;
+		if (!field.name.empty()) {
+			// Fields named like the command level are loopbacked commands too
+			if (field.name == "cmd") continue;
+			field_topic.assign(msg.location).append("/").append(msg.device_type).append("/")
+				.append(msg.device_id).append("/").append(field.name);
+			parse_topic(reading, field_topic.c_str());
+		}
+		set_reading(reading, field.reading, payload.ts);
+		handle_reading(reading, ingest, dispatch);
+	}
+}
+
+/**
+ *  Function: handle_reading
+ *  Description:
+ *	  Dispatch a reading to the topic handlers and store it.  A reading of a
+ *	  topic matched by filter handlers is stored by the node owning the
+ *	  lowest ranked of them, which runs all of them.
+ *  Args:
+ *    msg - parsed message with its decoded reading
+ *    ingest - store the reading
+ *    dispatch - run the handlers
+ */
+static void handle_reading(const Message &msg, bool ingest, bool dispatch)
+{
+	if (msg.trace) trace_event(msg.trace, TraceStages::dispatch);
+
+	// The epoch is odd while the handler set is in use, so a reload knows
+	// when the previous set is no longer used
+	dispatch_epoch.fetch_add(1);
+	HandlerSet *set = current_handlers.load();
+
+	// hand off message to the handlers subscribed to the topic, filters
+	// are kept for after the match, reusing the vector's capacity
+	static vector<Handlers *> filters;
+	filters.clear();
+	if (set) {
+		set->index.match(msg.topic, [&msg, dispatch](Handlers *handler) {
+			if (handler->getType() == HandlerTypes::filter) filters.push_back(handler);
+			else if (dispatch) {
+				if (Batcher && handler->handlesBatch()) Batcher->add(handler, msg);
+				else Workers->dispatch(handler, msg);
+			}
+		});
+	}
+
+	// Filters decide here whether the reading is stored
+	bool store = ingest;
+	bool filtered = false;
+	if (!filters.empty()) {
+		const FilterOwner *decider = nullptr;
+		for (Handlers *filter : filters) {
+			auto owner = set->filters.find(filter);
+			if (owner != set->filters.end() && (!decider || owner->second.rank < decider->rank)) decider = &owner->second;
+		}
+
+		store = dispatch && (!decider || decider->owned);
+		if (store) {
+			for (Handlers *filter : filters) {
+				if (!filter->storeReading(msg)) filtered = true;
+			}
+		}
+	}
+	dispatch_epoch.fetch_add(1, memory_order_release);
+
+	// queue device data for the DB writer
+	if (filtered) readings_filtered.add();
+	else if (store) insert_reading(Config, msg);
+}
+
+/**
+ * Function: load_handlers
+ * Description:
+ *   Build a handler set from a handler configuration using Factory Pattern.
+ *   Handlers may be topic, filter or timer based.  Topic and filter handlers
+ *   are added to the topic index by subscription topic, timer handlers are
+ *   started on the timer service and their timeouts run on the handler's
+ *   worker.  Filters holding readings back get a flush timer, run on the
+ *   timer thread.  Handlers with the same configuration fingerprint in the
+ *   previous set are shared with their state instead of created.
+ * Args:
+ *   specs - compiled handler configuration
+ *   client - misquitto client object
+ *   previous - current handler set or nullptr
+ * Returns:
+ *   new handler set, to be published with publish_handlers()
+ */
+HandlerSet *load_handlers(const vector<HandlerSpec> &specs, mosquitto *client, HandlerSet *previous)
+{
+	HandlerSet *set = new HandlerSet;
 
-	// Received message
-	if (strlen(message->topic) && strlen((char *)message->payload)) {
-		int reading = atoi((char *)message->payload);
-		string topic(message->topic);
-		string location, device_type, device_id, sensor;
+	// Handlers that may be carried over
+	unordered_map<string, shared_ptr<Handlers>> existing;
+	if (previous) {
+		for (auto &handler : previous->handlers) existing[handler->getName()] = handler;
+	}
+
+	// iterate over the compiled handlers
+	size_t carried = 0;
+	size_t restored = 0;
+	size_t owned_count = 0;
+	for (const HandlerSpec &spec : specs) {
+		const string &name = spec.name;
+		bool owned = cluster_owns(name);
+		shared_ptr<Handlers> handler;
+
+		auto match = existing.find(name);
+		if (match != existing.end() && match->second->getFingerprint() == spec.fingerprint) {
+			// Unchanged, keep the handler with its state and timer
+			handler = match->second;
+			auto timer = previous->timers.find(name);
+			if (timer != previous->timers.end()) set->timers[name] = timer->second;
+			carried++;
+		}
+		else {
+			handler.reset(Handlers::makeHandler(spec, client));
+			if (!handler) continue;
 
-		istringstream iss(topic);
+			// Continue from the checkpoint on startup
+			if (!previous && checkpoint && checkpoint->restore(handler.get())) restored++;
 
-		// Get topic tokens
-		getline(iss, location, '/');
-		getline(iss, device_type, '/');
-		getline(iss, device_id, '/');
-		getline(iss, sensor, '/');
+			if (handler->getType() == HandlerTypes::timer && owned) {
+				Handlers *timed = handler.get();
+				unsigned int interval = timed->getInterval();
 
-		// ignore commands sent to devices loopbacked to controller
-		if (sensor == "cmd") return;
+				LOG_INFO("handlers") << "Starting timer handler: " << name
+					<< ", interval = " << interval << "ms";
 
-		// write device data to DB
-		insert_reading(Config, location.c_str(), device_type.c_str(), device_id.c_str(), sensor.c_str(), reading);
+				// Start timer
+				set->timers[name] = Timers->schedule(chrono::milliseconds(interval), [timed]() {
+					Workers->dispatchTimeout(timed);
+				});
+			}
 
-		// hand off message to handler
-		for (int idx = 0; idx < handlers->size(); idx++) {
-			Handlers *handler = (*handlers)[idx];
-			if (handler->getType() == HandlerTypes::topic) {
-				// Process message with topic handler
-				handler->handleTopic(string(message->topic), string((char *)message->payload));
+			// Filters holding readings back store them when their series go quiet
+			unsigned int flush_interval = handler->getFlushInterval();
+			if (handler->getType() == HandlerTypes::filter && flush_interval) {
+				Handlers *filter = handler.get();
+				set->timers[name] = Timers->schedule(chrono::milliseconds(flush_interval), [filter]() {
+					filter->flushReadings(false);
+				});
 			}
 		}
 
-	} else {
-		cerr << "ERROR [mqtt] Received invalid message" << endl;
+		set->handlers.push_back(handler);
+		if (owned) owned_count++;
+
+		// Filters are indexed on every node, they decide which node stores a reading
+		HandlerTypes::type type = handler->getType();
+		if (type == HandlerTypes::filter && cluster_enabled()) {
+			set->filters[handler.get()] = FilterOwner{ set->filters.size(), owned };
+		}
+		if ((type == HandlerTypes::topic && owned) || type == HandlerTypes::filter) {
+			set->index.add(handler->getSubTopic(), handler.get());
+		}
+		if ((type == HandlerTypes::topic || type == HandlerTypes::filter) && owned && cluster_enabled()) {
+			set->subscriptions.push_back(handler->getSubTopic());
+		}
 	}
+
+	LOG_INFO("handlers") << "Indexed topic subscriptions: " << set->index.size()
+		<< ", unchanged handlers: " << carried << ", restored handlers: " << restored;
+	if (cluster_enabled()) {
+		LOG_INFO("handlers") << "Cluster node " << Config->cluster_node_id << " of " << Config->cluster_nodes
+			<< " owns " << owned_count << " of " << set->handlers.size() << " handlers";
+	}
+	return set;
 }
 
 /**
- * Function: init_handlers
+ * Function: publish_handlers
  * Description:
- *   Initialize all configured handler plugins using Factory Pattern and add
- *   them to the list of handlers.  Handlers may be topic or timer based.
+ *   Make a handler set current for the MQTT thread with an atomic pointer
+ *   swap.  The previous set is deleted once no message dispatch uses it, its
+ *   removed timer handlers are stopped and the jobs queued for its handlers
+ *   have run.  Filters released with it store their held readings first.
+ *   Handlers shared with the new set live on.
+ * Args:
+ *   set - new handler set, nullptr releases the current set
+ */
+void publish_handlers(HandlerSet *set)
+{
+	HandlerSet *previous = current_handlers.exchange(set);
+	subscriptions_changed = true;
+	if (!previous) return;
+
+	// Wait for a message dispatch that may have loaded the previous set
+	unsigned long epoch = dispatch_epoch.load();
+	if (epoch % 2) {
+		while (dispatch_epoch.load() == epoch) this_thread::yield();
+	}
+
+	// Stop the timers not carried over
+	for (auto &timer : previous->timers) {
+		auto kept = set ? set->timers.find(timer.first) : previous->timers.end();
+		if (!set || kept == set->timers.end() || kept->second != timer.second) {
+			Timers->cancel(timer.second);
+		}
+	}
+
+	// Run batches and jobs queued for the previous handlers before releasing
+	// them
+	if (Batcher) Batcher->flush(true);
+	Workers->drain();
+
+	// Store the readings held back by the filters being released
+	for (auto &handler : previous->handlers) {
+		if (handler.use_count() == 1) handler->flushReadings(true);
+	}
+	delete previous;
+}
+
+/**
+ * Function: reload_handlers
+ * Description:
+ *   Reread the handler configuration and replace the handler set, keeping
+ *   the current handlers if the configuration is invalid
  * Args:
- *   handlers - reference to vector object of handlers
  *   client - misquitto client object
  */
-void init_handlers(vector<Handlers *> &handlers, mosquitto *client)
+void reload_handlers(mosquitto *client)
+{
+	vector<HandlerSpec> specs;
+	if (!load_handler_config(specs)) {
+		LOG_ERROR("handlers") << "Reload failed, keeping the current handlers";
+		return;
+	}
+
+	LOG_INFO("handlers") << "Reloading handlers";
+	publish_handlers(load_handlers(specs, client, current_handlers.load()));
+	config_reloads.add();
+}
+
+/**
+ * Function: publish_metrics
+ * Description:
+ *   Publish the metrics in Prometheus text format to the configured metrics
+ *   topic once the metrics interval has passed
+ * Args:
+ *   client - mosquitto client object
+ *   due - time of the next publish, advanced when published
+ */
+static void publish_metrics(mosquitto *client, chrono::steady_clock::time_point &due)
 {
-	// iterate over configure iterators
-	for(Json::Value::const_iterator it=Config->handlers.begin(); it != Config->handlers.end(); ++it) {
-		string name(it.key().asString());
-		Json::Value hconfig = Config->handlers[name];
-		handlers.push_back(Handlers::makeHandler(hconfig["type"].asString(), name, client, Config));
+	if (Config->metrics_topic.empty()) return;
+
+	auto now = chrono::steady_clock::now();
+	if (now < due) return;
+	due = now + chrono::milliseconds(Config->metrics_interval);
+
+	string text = metrics().render();
+	int ret = mosquitto_publish(client, NULL, Config->metrics_topic.c_str(), text.size(), text.c_str(), 0, false);
+	if (ret) {
+		LOG_ERROR("metrics") << "Can't publish metrics: " << ret;
 	}
 }
 
 /**
- * Function: start_timer_handlers
+ * Function: save_checkpoint
  * Description:
- *   Start any timer based handlers
+ *   Save the state of the current handlers to the checkpoint, if enabled.
+ *   Unless waiting, only queues the state copies on the handler workers and
+ *   the network loop writes the checkpoint once they are taken, so message
+ *   dispatch never waits for a save.
  * Args:
- *   handlers - reference to a list of handlers
- */
-void start_timer_handlers(vector<Handlers *> &handlers)
-{
-	// iterate over all handlers
-	for (int idx = 0; idx < handlers.size(); idx++) {
-		if (handlers[idx]->getType() == HandlerTypes::timer) {
-			cout << "INFO [handlers] Starting timer handler: " << handlers[idx]->getName() << endl;
-
-			// Start timer
-			// Get interval in milliseconds
-			Json::Value *jsonInterval = handlers[idx]->getValue("interval");
-			unsigned int interval = jsonInterval ? jsonInterval->asInt() : 1;
-			interval *= 1000;
-			Handlers *handler = handlers[idx];
-			thread([handler, interval]() {
-				while (true) {
-					auto next_time = std::chrono::steady_clock::now() + std::chrono::milliseconds(interval);
-					handler->handleTimeout();
-					std::this_thread::sleep_until(next_time);
-				}
-			}).detach();
+ *   wait - wait until the checkpoint is written
+ */
+static void save_checkpoint(bool wait)
+{
+	if (!checkpoint) return;
+
+	// Saved state includes the messages already received
+	if (Batcher) Batcher->flush(true);
+
+	// Keep the handler set alive while its handlers are taken
+	dispatch_epoch.fetch_add(1);
+	HandlerSet *handlers = current_handlers.load();
+	if (handlers) {
+		if (wait) checkpoint->save(handlers->handlers);
+		else if (!checkpoint->begin(handlers->handlers)) {
+			LOG_ERROR("checkpoint") << "Previous checkpoint still in progress, skipped";
 		}
 	}
+	dispatch_epoch.fetch_add(1, memory_order_release);
 }
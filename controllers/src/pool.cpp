@@ -0,0 +1,201 @@
+/**
+ * DB Connection Pool
+ *
+ * Fixed size pool of long lived PostgreSQL connections shared by all DB
+ * users.  Connections are opened lazily, checked on every acquire and
+ * reopened transparently when broken.  Statements registered with prepare()
+ * are prepared once per connection.
+ */
+
+#include "pool.hpp"
+#include "log.hpp"
+#include <mutex>
+#include <pqxx/pqxx>
+
+using namespace std;
+
+//
+// ConnectionPool::Lease Class
+//
+
+/**
+ * Lease Class Member Function: Lease
+ * Description:
+ *   Lease Constructor
+ * Args:
+ *   pool - owning pool
+ *   entry - leased pool entry
+ */
+ConnectionPool::Lease::Lease(ConnectionPool *pool, Entry *entry) : pool{ pool }, entry{ entry }
+{
+}
+
+/**
+ * Lease Class Member Function: Lease
+ * Description:
+ *   Lease Move Constructor
+ * Args:
+ *   other - lease to take over
+ */
+ConnectionPool::Lease::Lease(Lease &&other) : pool{ other.pool }, entry{ other.entry }
+{
+	other.entry = nullptr;
+}
+
+/**
+ * Lease Class Member Function: ~Lease
+ * Description:
+ *   Lease Destructor, returns the connection to the pool
+ */
+ConnectionPool::Lease::~Lease()
+{
+	if (entry) pool->release(entry);
+}
+
+/**
+ * Lease Class Member Function: operator*
+ * Returns:
+ *   leased connection
+ */
+pqxx::connection &ConnectionPool::Lease::operator*()
+{
+	return *entry->connection;
+}
+
+/**
+ * Lease Class Member Function: operator->
+ * Returns:
+ *   leased connection
+ */
+pqxx::connection *ConnectionPool::Lease::operator->()
+{
+	return entry->connection.get();
+}
+
+/**
+ * Lease Class Member Function: invalidate
+ * Description:
+ *   Drop the leased connection after a connection failure, the next acquire
+ *   of this entry reconnects
+ */
+void ConnectionPool::Lease::invalidate(void)
+{
+	entry->connection.reset();
+	entry->prepared = 0;
+}
+
+//
+// ConnectionPool Class
+//
+
+/**
+ * ConnectionPool Class Member Function: ConnectionPool
+ * Description:
+ *   ConnectionPool Constructor, connections are opened on first use
+ * Args:
+ *   connection_string - PostgreSQL connection string
+ *   size - number of pooled connections
+ */
+ConnectionPool::ConnectionPool(string connection_string, size_t size) : connection_string{ connection_string }, entries(size ? size : 1)
+{
+	for (Entry &entry : entries) {
+		idle.push_back(&entry);
+	}
+}
+
+/**
+ * ConnectionPool Class Member Function: ~ConnectionPool
+ * Description:
+ *   ConnectionPool Destructor, all leases must be returned
+ */
+ConnectionPool::~ConnectionPool()
+{
+	unique_lock<mutex> guard(lock);
+	available.wait(guard, [this]() { return idle.size() == entries.size(); });
+}
+
+/**
+ * ConnectionPool Class Member Function: prepare
+ * Description:
+ *   Register a prepared statement, prepared once on every pooled connection
+ * Args:
+ *   name - statement name
+ *   sql - statement SQL
+ */
+void ConnectionPool::prepare(string name, string sql)
+{
+	unique_lock<mutex> guard(lock);
+	statements.push_back(make_pair(name, sql));
+}
+
+/**
+ * ConnectionPool Class Member Function: acquire
+ * Description:
+ *   Lease a healthy connection, waits until a connection is idle.  Throws
+ *   pqxx::broken_connection if the DB can't be reached.
+ * Returns:
+ *   connection lease
+ */
+ConnectionPool::Lease ConnectionPool::acquire(void)
+{
+	Entry *entry;
+	{
+		unique_lock<mutex> guard(lock);
+		available.wait(guard, [this]() { return !idle.empty(); });
+		entry = idle.back();
+		idle.pop_back();
+	}
+
+	// Lease first so the entry returns to the pool if connecting fails
+	Lease lease(this, entry);
+	connect(entry);
+	return lease;
+}
+
+/**
+ * ConnectionPool Class private Member Function: release
+ * Description:
+ *   Return a leased entry to the pool
+ * Args:
+ *   entry - pool entry
+ */
+void ConnectionPool::release(Entry *entry)
+{
+	{
+		unique_lock<mutex> guard(lock);
+		idle.push_back(entry);
+	}
+	available.notify_all();
+}
+
+/**
+ * ConnectionPool Class private Member Function: connect
+ * Description:
+ *   (Re)open the entry connection if needed and prepare any statements
+ *   registered since it was last used
+ * Args:
+ *   entry - leased pool entry
+ */
+void ConnectionPool::connect(Entry *entry)
+{
+	if (entry->connection && !entry->connection->is_open()) {
+		LOG_ERROR("pool") << "Connection lost, reconnecting";
+		entry->connection.reset();
+	}
+
+	if (!entry->connection) {
+		LOG_INFO("pool") << "Opening DB connection";
+		entry->connection.reset(new pqxx::connection(connection_string));
+		entry->prepared = 0;
+	}
+
+	// Statements are only ever appended, prepare the new ones
+	unique_lock<mutex> guard(lock);
+	while (entry->prepared < statements.size()) {
+		pair<string, string> statement = statements[entry->prepared];
+		guard.unlock();
+		entry->connection->prepare(statement.first, statement.second);
+		guard.lock();
+		entry->prepared++;
+	}
+}
@@ -0,0 +1,198 @@
+/**
+ * Outbound Publish Stage
+ *
+ * Handlers publish commands by pushing a topic id and value to a lock-free
+ * queue, from whichever thread runs them.  The MQTT network thread drains
+ * the queue between network loop iterations and is the only thread calling
+ * mosquitto_publish.  With a coalescing window, the first command for a
+ * topic opens the window and only the latest value is published when it
+ * ends.  With repeat suppression, a value equal to the last value published
+ * to the topic isn't published again.  Commands of traced messages carry
+ * their trace and are stamped when published, a coalesced command carries
+ * the trace of the latest value.
+ */
+
+#include "publisher.hpp"
+#include "log.hpp"
+#include "metrics.hpp"
+#include "trace.hpp"
+#include <charconv>
+#include <mosquitto.h>
+
+using namespace std;
+
+// Metrics
+static Counter &publishes = metrics().counter("controller_publishes_total", "Values published by handlers");
+static Counter &publish_errors = metrics().counter("controller_publish_errors_total", "Handler publishes rejected by mosquitto");
+static Counter &publishes_dropped = metrics().counter("controller_messages_dropped_total", "Messages dropped by a pipeline stage", "reason=\"publish_queue_full\"");
+static Counter &publishes_coalesced = metrics().counter("controller_publishes_skipped_total", "Handler commands not published", "reason=\"coalesced\"");
+static Counter &publishes_suppressed = metrics().counter("controller_publishes_skipped_total", "Handler commands not published", "reason=\"unchanged\"");
+
+//
+// PublishStage Class
+//
+
+/**
+ * PublishStage Class Member Function: PublishStage
+ * Description:
+ *   PublishStage Constructor
+ * Args:
+ *   capacity - max queued commands, commands are dropped when full
+ *   window - coalescing window in milliseconds, 0 disables coalescing
+ *   suppress - don't publish a value equal to the last published value
+ */
+PublishStage::PublishStage(size_t capacity, unsigned int window, bool suppress) :
+	queue{ capacity }, window{ window }, suppress{ suppress }
+{
+	metrics().gauge("controller_queue_depth", "Queued entries per pipeline queue", "queue=\"publish\"",
+		[this]() { return (double) queue.size(); });
+}
+
+/**
+ * PublishStage Class Member Function: ~PublishStage
+ * Description:
+ *   PublishStage Destructor
+ */
+PublishStage::~PublishStage()
+{
+	metrics().gauge("controller_queue_depth", "Queued entries per pipeline queue", "queue=\"publish\"",
+		[]() { return 0.0; });
+}
+
+/**
+ * PublishStage Class Member Function: topic
+ * Description:
+ *   Get the id of a publish topic, adding the topic if it is new.  Called
+ *   when a handler is created, not per publish.
+ * Args:
+ *   name - publish topic
+ * Returns:
+ *   topic id
+ */
+size_t PublishStage::topic(const string &name)
+{
+	unique_lock<mutex> guard(lock);
+
+	auto id = ids.find(name);
+	if (id != ids.end()) return id->second;
+
+	topics.push_back(Topic{ name, trace_label(name), false, 0, false, 0, 0, {} });
+	ids[name] = topics.size() - 1;
+	return topics.size() - 1;
+}
+
+/**
+ * PublishStage Class Member Function: publish
+ * Description:
+ *   Queue a command, safe to call from any thread.  The command carries the
+ *   trace of the message run by the calling thread's handler.
+ * Args:
+ *   topic - topic id
+ *   value - value to publish
+ * Returns:
+ *   false if the queue is full and the command was dropped
+ */
+bool PublishStage::publish(size_t topic, int value)
+{
+	uint32_t trace = TraceCurrent;
+	bool queued = queue.push([topic, value, trace](Command &command) {
+		command.topic = topic;
+		command.value = value;
+		command.trace = trace;
+	});
+	if (!queued) publishes_dropped.add();
+	return queued;
+}
+
+/**
+ * PublishStage Class Member Function: flush
+ * Description:
+ *   Drain the queue and publish the commands that are due.  Must only be
+ *   called from the MQTT network thread.
+ * Args:
+ *   client - mosquitto client object
+ *   all - also publish values still in their coalescing window
+ */
+void PublishStage::flush(mosquitto *client, bool all)
+{
+	unique_lock<mutex> guard(lock);
+	auto now = chrono::steady_clock::now();
+
+	while (queue.pop([this, client, now](Command &command) {
+		Topic &topic = topics[command.topic];
+
+		if (!window.count()) {
+			send(client, topic, command.value, command.trace);
+			return;
+		}
+
+		// Last value wins within the window opened by the first command
+		if (topic.pending) publishes_coalesced.add();
+		else {
+			topic.pending = true;
+			topic.deadline = now + window;
+			pending.push_back(command.topic);
+		}
+		topic.value = command.value;
+		topic.trace = command.trace;
+	}));
+
+	// Publish the topics whose window ended, keeping the others pending
+	size_t kept = 0;
+	for (size_t id : pending) {
+		Topic &topic = topics[id];
+		if (!all && topic.deadline > now) {
+			pending[kept++] = id;
+			continue;
+		}
+		topic.pending = false;
+		send(client, topic, topic.value, topic.trace);
+	}
+	pending.resize(kept);
+}
+
+/**
+ * PublishStage Class Member Function: size
+ * Returns:
+ *   number of queued commands
+ */
+size_t PublishStage::size(void)
+{
+	return queue.size();
+}
+
+/**
+ * PublishStage Class private Member Function: send
+ * Description:
+ *   Publish a value to a topic unless it repeats the last value and repeats
+ *   are suppressed, lock must be held
+ * Args:
+ *   client - mosquitto client object
+ *   topic - publish topic
+ *   value - value to publish as text
+ *   trace - trace of the command, 0 if none
+ */
+void PublishStage::send(mosquitto *client, Topic &topic, int value, uint32_t trace)
+{
+	if (suppress && topic.published && topic.last == value) {
+		publishes_suppressed.add();
+		return;
+	}
+
+	// Format on the stack, publishing doesn't allocate
+	char text[16];
+	int length = to_chars(text, text + sizeof(text), value).ptr - text;
+
+	LOG_DEBUG("publisher") << "Publishing value: " << value << ", for topic: " << topic.name;
+	int ret = mosquitto_publish(client, NULL, topic.name.c_str(), length, text, 0, false);
+	if (trace) trace_event(trace, TraceStages::publish, topic.label);
+	if (ret) {
+		publish_errors.add();
+		LOG_ERROR("publisher") << "Can't publish to Mosquitto server: " << ret;
+		return;
+	}
+
+	publishes.add();
+	topic.published = true;
+	topic.last = value;
+}
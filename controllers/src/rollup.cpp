@@ -0,0 +1,203 @@
+/**
+ * Reading Rollup
+ *
+ * Streaming aggregation of readings into count/min/max/sum/last buckets per
+ * series (location, device_type, device_id, sensor) and window.  Time is the
+ * reading timestamp: the watermark is the latest timestamp seen, and a
+ * bucket closes once the watermark passes its end plus the grace period.
+ * Readings later than that are emitted as single reading buckets, which the
+ * DB upsert merges into the closed bucket.  Every series keeps a fixed ring
+ * of buckets per window, so memory per series is bounded.  Closed buckets
+ * wait for the DB writer in a capped buffer, buckets closing while it is
+ * full are dropped and counted.
+ */
+
+#include "rollup.hpp"
+#include "metrics.hpp"
+#include <algorithm>
+#include <mutex>
+
+using namespace std;
+
+// Metrics
+static Counter &late_readings = metrics().counter("controller_rollup_late_total", "Readings arriving after their rollup bucket closed");
+static Counter &buckets_dropped = metrics().counter("controller_rollup_dropped_total", "Closed rollup buckets dropped while waiting for the DB");
+
+//
+// RollupStage Class
+//
+
+/**
+ * RollupStage Class Member Function: RollupStage
+ * Description:
+ *   RollupStage Constructor
+ * Args:
+ *   windows - bucket widths in seconds
+ *   grace - seconds a bucket stays open after its end for late readings
+ *   max_closed - max closed buckets waiting to be written
+ */
+RollupStage::RollupStage(vector<unsigned int> windows, unsigned int grace, size_t max_closed) :
+	grace{ grace }, max_closed{ max(max_closed, (size_t) 1) }
+{
+	for (unsigned int window : windows) {
+		if (window) this->windows.push_back(window);
+	}
+
+	// Enough buckets for the open one and all still within the grace period
+	unsigned int smallest = this->windows.empty() ? 1 : *min_element(this->windows.begin(), this->windows.end());
+	slots = grace / smallest + 2;
+}
+
+/**
+ * RollupStage Class Member Function: add
+ * Description:
+ *   Aggregate a batch of readings and close the buckets the new watermark
+ *   has passed
+ * Args:
+ *   batch - readings
+ *   count - number of valid readings in batch
+ */
+void RollupStage::add(const vector<Reading> &batch, size_t count)
+{
+	unique_lock<mutex> guard(lock);
+
+	for (size_t idx = 0; idx < count; idx++) {
+		const Reading &reading = batch[idx];
+		watermark = max(watermark, reading.ts);
+
+		auto entry = series.find(reading.series);
+		if (entry == series.end()) {
+			entry = series.emplace(reading.series, SeriesBuckets{ reading.series, vector<Bucket>(windows.size() * slots, Bucket{}) }).first;
+		}
+		SeriesBuckets &current = entry->second;
+
+		for (size_t w = 0; w < windows.size(); w++) {
+			long int window = windows[w];
+			long int start = reading.ts - ((reading.ts % window) + window) % window;
+
+			// Too late for an open bucket, emit it on its own for the DB to merge
+			if (start + window + (long int) grace <= watermark) {
+				close(current, window, Bucket{ start, 1, reading.reading, reading.reading, reading.reading, reading.reading, reading.ts });
+				late_readings.add();
+				continue;
+			}
+
+			Bucket &bucket = current.buckets[w * slots + (start / window) % slots];
+			if (bucket.count && bucket.start != start) {
+				// Slot still holds an older bucket, it is past the grace period
+				close(current, window, bucket);
+				bucket.count = 0;
+				open--;
+			}
+
+			if (!bucket.count) {
+				bucket = Bucket{ start, 0, reading.reading, reading.reading, 0, reading.reading, reading.ts };
+				if (!open++ || start + window + grace < next_close) next_close = start + window + grace;
+			}
+
+			bucket.count++;
+			bucket.min = min(bucket.min, reading.reading);
+			bucket.max = max(bucket.max, reading.reading);
+			bucket.sum += reading.reading;
+			if (reading.ts >= bucket.last_ts) {
+				bucket.last = reading.reading;
+				bucket.last_ts = reading.ts;
+			}
+		}
+	}
+
+	if (!open || watermark < next_close) return;
+
+	// Close the buckets the watermark has passed and find the next to close
+	next_close = 0;
+	for (auto &entry : series) {
+		for (size_t idx = 0; idx < entry.second.buckets.size(); idx++) {
+			Bucket &bucket = entry.second.buckets[idx];
+			if (!bucket.count) continue;
+
+			long int end = bucket.start + windows[idx / slots] + grace;
+			if (end <= watermark) {
+				close(entry.second, windows[idx / slots], bucket);
+				bucket.count = 0;
+				open--;
+			}
+			else if (!next_close || end < next_close) {
+				next_close = end;
+			}
+		}
+	}
+}
+
+/**
+ * RollupStage Class Member Function: drain
+ * Description:
+ *   Write the closed buckets.  If the write function throws the buckets are
+ *   kept for the next drain.
+ * Args:
+ *   all - also close and write all open buckets, e.g. on shutdown
+ *   write - function writing the buckets
+ */
+void RollupStage::drain(bool all, WriteFunc write)
+{
+	unique_lock<mutex> guard(lock);
+
+	if (all && open) {
+		for (auto &entry : series) {
+			for (size_t idx = 0; idx < entry.second.buckets.size(); idx++) {
+				Bucket &bucket = entry.second.buckets[idx];
+				if (!bucket.count) continue;
+
+				close(entry.second, windows[idx / slots], bucket);
+				bucket.count = 0;
+			}
+		}
+		open = 0;
+	}
+
+	if (!pending) return;
+
+	write(closed, pending);
+	pending = 0;
+}
+
+/**
+ * RollupStage Class Member Function: size
+ * Returns:
+ *   number of open and closed buckets not yet written
+ */
+size_t RollupStage::size(void)
+{
+	unique_lock<mutex> guard(lock);
+	return open + pending;
+}
+
+/**
+ * RollupStage Class private Member Function: close
+ * Description:
+ *   Queue a bucket to be written, dropped if max_closed buckets are queued,
+ *   lock must be held
+ * Args:
+ *   current - series of the bucket
+ *   window - bucket width in seconds
+ *   bucket - bucket statistics
+ */
+void RollupStage::close(const SeriesBuckets &current, unsigned int window, const Bucket &bucket)
+{
+	if (pending == max_closed) {
+		buckets_dropped.add();
+		return;
+	}
+
+	if (pending == closed.size()) closed.emplace_back();
+	Rollup &rollup = closed[pending++];
+
+	rollup.series = current.series;
+	rollup.window = window;
+	rollup.bucket = bucket.start;
+	rollup.count = bucket.count;
+	rollup.min = bucket.min;
+	rollup.max = bucket.max;
+	rollup.sum = bucket.sum;
+	rollup.last = bucket.last;
+	rollup.last_ts = bucket.last_ts;
+}
@@ -0,0 +1,132 @@
+/**
+ * Series Index
+ *
+ * Every reading belongs to a series, its location, device type, device id
+ * and sensor.  Series are interned once per process from the message topic,
+ * and readings carry a pointer to their series through the DB writer, so
+ * the names are not copied per message.  The DB writer upserts each series
+ * into the series table once and writes readings by series id.
+ */
+
+#include "series.hpp"
+#include "message.hpp"
+#include <memory>
+#include <mutex>
+#include <string_view>
+
+using namespace std;
+
+/**
+ * Function: series
+ * Description:
+ *   Get the process wide series index
+ * Returns:
+ *   series index
+ */
+SeriesIndex &series(void)
+{
+	static SeriesIndex index;
+	return index;
+}
+
+//
+// SeriesIndex Class
+//
+
+/**
+ * SeriesIndex Class Member Function: intern
+ * Description:
+ *   Get the series of a parsed message, adding it if it is new.  A topic of
+ *   exactly four levels is its own key, so known series don't copy.
+ * Args:
+ *   message - parsed message
+ * Returns:
+ *   series, valid for the life of the process
+ */
+Series *SeriesIndex::intern(const Message &message)
+{
+	unique_lock<mutex> guard(lock);
+
+	size_t length = message.location.size() + message.device_type.size() + message.device_id.size() + message.sensor.size() + 3;
+	if (length == message.topic.size()) {
+		return find(message.topic, message.location, message.device_type, message.device_id, message.sensor);
+	}
+
+	key.assign(message.location).append("/").append(message.device_type).append("/")
+		.append(message.device_id).append("/").append(message.sensor);
+	return find(key, message.location, message.device_type, message.device_id, message.sensor);
+}
+
+/**
+ * SeriesIndex Class Member Function: intern
+ * Description:
+ *   Get the series of a location, device type, device id and sensor, adding
+ *   it if it is new
+ * Args:
+ *   location - device location
+ *   device_type - type of device
+ *   device_id - id of device
+ *   sensor - name of sensor
+ * Returns:
+ *   series, valid for the life of the process
+ */
+Series *SeriesIndex::intern(string_view location, string_view device_type, string_view device_id, string_view sensor)
+{
+	unique_lock<mutex> guard(lock);
+
+	key.assign(location).append("/").append(device_type).append("/")
+		.append(device_id).append("/").append(sensor);
+	return find(key, location, device_type, device_id, sensor);
+}
+
+/**
+ * SeriesIndex Class Member Function: at
+ * Args:
+ *   index - series index
+ * Returns:
+ *   series with the index, nullptr if none
+ */
+Series *SeriesIndex::at(uint32_t index)
+{
+	unique_lock<mutex> guard(lock);
+	return index < entries.size() ? entries[index].get() : nullptr;
+}
+
+/**
+ * SeriesIndex Class Member Function: size
+ * Returns:
+ *   number of series interned
+ */
+size_t SeriesIndex::size(void)
+{
+	unique_lock<mutex> guard(lock);
+	return entries.size();
+}
+
+/**
+ * SeriesIndex Class private Member Function: find
+ * Description:
+ *   Look up a series by key, adding it if it is new, lock must be held
+ * Args:
+ *   name - series key
+ *   location - device location
+ *   device_type - type of device
+ *   device_id - id of device
+ *   sensor - name of sensor
+ * Returns:
+ *   series
+ */
+Series *SeriesIndex::find(string_view name, string_view location, string_view device_type, string_view device_id, string_view sensor)
+{
+	Series *&entry = ids.get(name);
+	if (entry) return entry;
+
+	entries.emplace_back(new Series);
+	entry = entries.back().get();
+	entry->location.assign(location);
+	entry->device_type.assign(device_type);
+	entry->device_id.assign(device_id);
+	entry->sensor.assign(sensor);
+	entry->index = entries.size() - 1;
+	return entry;
+}
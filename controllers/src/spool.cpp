@@ -0,0 +1,560 @@
+/**
+ * Reading Spool
+ *
+ * Append-only spool of readings in fixed size, memory mapped segment files
+ * (spool-<seq>.dat).  The ingest path appends records with a memcpy, a
+ * background thread reads them back in batches, writes them to the DB and
+ * then commits its position to a mapped checkpoint file (spool.offset).
+ * Segments are deleted once fully committed.  Failed batches are retried
+ * from the committed position, and on start any readings past it are
+ * replayed.  Disk use is bounded by the segment count, readings are dropped
+ * when all segments are full.
+ *
+ * Record layout, native byte order:
+ *   uint32 length, uint32 checksum (FNV-1a of the payload), payload
+ *   payload: int64 ts, float64 reading, uint16 string lengths x 4, strings
+ * A zero length marks the end of the records in a segment.
+ */
+
+#include "spool.hpp"
+#include "log.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+// Record sizes
+#define RECORD_HEADER 8
+#define RECORD_FIXED 24
+
+// Checkpoint file identifier, changes with the record layout
+#define SPOOL_MAGIC 0x53504f4f4c303032ull
+#define SPOOL_MAGIC_INT32 0x53504f4f4c303031ull
+
+/**
+ * Function: checksum
+ * Description:
+ *   FNV-1a hash of a record payload
+ * Args:
+ *   data - payload
+ *   length - payload size
+ * Returns:
+ *   32 bit hash
+ */
+static uint32_t checksum(const char *data, size_t length)
+{
+	uint32_t hash = 2166136261u;
+	for (size_t idx = 0; idx < length; idx++) {
+		hash = (hash ^ (unsigned char) data[idx]) * 16777619u;
+	}
+	return hash;
+}
+
+//
+// ReadingSpool Class
+//
+
+/**
+ * ReadingSpool Class Member Function: ReadingSpool
+ * Description:
+ *   ReadingSpool Constructor, opens or creates the spool in dir and counts
+ *   the readings left to replay.  Throws runtime_error if the spool can't
+ *   be opened.
+ * Args:
+ *   dir - spool directory
+ *   segment_size - size of a segment file in bytes
+ *   max_segments - max number of segment files
+ *   batch_size - number of readings that triggers a flush
+ *   flush_interval - max time in milliseconds a reading waits for a flush,
+ *     also the pause before retrying a failed batch
+ *   flush - function writing a batch of readings
+ */
+ReadingSpool::ReadingSpool(string dir, size_t segment_size, size_t max_segments, size_t batch_size, unsigned int flush_interval, FlushFunc flush) :
+	dir{ dir }, segment_size{ max(segment_size, (size_t) 4096) }, max_segments{ max_segments ? max_segments : 1 },
+	batch_size{ batch_size ? batch_size : 1 }, flush_interval{ flush_interval }, flush{ flush }
+{
+	open();
+}
+
+/**
+ * ReadingSpool Class Member Function: ~ReadingSpool
+ * Description:
+ *   ReadingSpool Destructor, writes what it can and unmaps the spool files
+ */
+ReadingSpool::~ReadingSpool()
+{
+	stop();
+	close();
+}
+
+/**
+ * ReadingSpool Class Member Function: start
+ * Description:
+ *   Start the background drain thread
+ */
+void ReadingSpool::start(void)
+{
+	unique_lock<mutex> guard(lock);
+	if (running) return;
+	running = true;
+	drainer = thread(&ReadingSpool::run, this);
+}
+
+/**
+ * ReadingSpool Class Member Function: stop
+ * Description:
+ *   Stop the drain thread once all readings are written, or on the first
+ *   failed write.  Unwritten readings stay in the spool for the next start.
+ */
+void ReadingSpool::stop(void)
+{
+	{
+		unique_lock<mutex> guard(lock);
+		if (!running) return;
+		running = false;
+	}
+	ready.notify_all();
+	drainer.join();
+}
+
+/**
+ * ReadingSpool Class Member Function: size
+ * Returns:
+ *   number of spooled readings not yet written
+ */
+size_t ReadingSpool::size(void)
+{
+	unique_lock<mutex> guard(lock);
+	return pending;
+}
+
+/**
+ * ReadingSpool Class Member Function: bytes
+ * Returns:
+ *   disk space used by the segment files
+ */
+size_t ReadingSpool::bytes(void)
+{
+	unique_lock<mutex> guard(lock);
+	return segments.size() * segment_size;
+}
+
+/**
+ * ReadingSpool Class Member Function: append
+ * Description:
+ *   Append a reading to the spool.  Never blocks on the database, if all
+ *   segments are full the reading is dropped.
+ * Args:
+ *   series - series of the reading
+ *   ts - reading timestamp in seconds since epoch
+ *   reading - sensor reading to store
+ * Returns:
+ *   true if spooled, false if dropped
+ */
+bool ReadingSpool::append(const Series *series, long int ts, double reading)
+{
+	// Series are spooled by name, ids don't outlive the process
+	string_view fields[] = { series->location, series->device_type, series->device_id, series->sensor };
+	uint32_t length = RECORD_FIXED;
+	for (string_view &field : fields) {
+		if (field.size() > UINT16_MAX) field = field.substr(0, UINT16_MAX);
+		length += field.size();
+	}
+	if (RECORD_HEADER + length > segment_size) return false;
+
+	unique_lock<mutex> guard(lock);
+
+	// Start the next segment when the record doesn't fit
+	if (head.offset + RECORD_HEADER + length > segment_size) {
+		if (segments.size() >= max_segments || !create(head.seq + 1)) return false;
+		head = { head.seq + 1, 0 };
+	}
+
+	char *record = segments.back().data + head.offset;
+	char *data = record + RECORD_HEADER;
+	int64_t timestamp = ts;
+
+	memcpy(data, &timestamp, sizeof(timestamp));
+	memcpy(data + 8, &reading, sizeof(reading));
+	data += RECORD_FIXED;
+	for (size_t idx = 0; idx < 4; idx++) {
+		uint16_t size = fields[idx].size();
+		memcpy(record + RECORD_HEADER + 16 + idx * 2, &size, sizeof(size));
+		memcpy(data, fields[idx].data(), size);
+		data += size;
+	}
+
+	// Header last, a torn record fails its checksum on the next open
+	uint32_t hash = checksum(record + RECORD_HEADER, length);
+	memcpy(record + 4, &hash, sizeof(hash));
+	memcpy(record, &length, sizeof(length));
+	head.offset += RECORD_HEADER + length;
+
+	// Wake the drain thread for every full batch available
+	if (++pending % batch_size == 0) ready.notify_one();
+
+	return true;
+}
+
+/**
+ * ReadingSpool Class private Member Function: open
+ * Description:
+ *   Map the checkpoint and segment files, drop committed segments, find the
+ *   append position after the last valid record and count pending readings
+ */
+void ReadingSpool::open(void)
+{
+	if (mkdir(dir.c_str(), 0755) && errno != EEXIST) {
+		throw runtime_error("Can't create spool directory " + dir + ": " + strerror(errno));
+	}
+
+	// Checkpoint
+	string checkpoint_path = dir + "/spool.offset";
+	int fd = ::open(checkpoint_path.c_str(), O_RDWR | O_CREAT, 0644);
+	if (fd < 0 || ftruncate(fd, sizeof(Checkpoint))) {
+		if (fd >= 0) ::close(fd);
+		throw runtime_error("Can't open " + checkpoint_path + ": " + strerror(errno));
+	}
+	void *mapped = mmap(nullptr, sizeof(Checkpoint), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	::close(fd);
+	if (mapped == MAP_FAILED) {
+		throw runtime_error("Can't map " + checkpoint_path + ": " + strerror(errno));
+	}
+	checkpoint = (Checkpoint *) mapped;
+
+	// Segments of the integer record layout would be misread
+	if (checkpoint->magic == SPOOL_MAGIC_INT32) {
+		close();
+		throw runtime_error("Spool " + dir + " holds integer readings of a previous version, drain or remove it");
+	}
+
+	Position committed = { 0, 0 };
+	if (checkpoint->magic == SPOOL_MAGIC && checkpoint->check == (SPOOL_MAGIC ^ checkpoint->position.seq ^ checkpoint->position.offset)) {
+		committed = checkpoint->position;
+	}
+
+	// Segments, oldest first
+	vector<uint64_t> seqs;
+	DIR *listing = opendir(dir.c_str());
+	if (!listing) {
+		throw runtime_error("Can't read spool directory " + dir + ": " + strerror(errno));
+	}
+	while (struct dirent *entry = readdir(listing)) {
+		uint64_t seq;
+		char suffix[8];
+		if (sscanf(entry->d_name, "spool-%16" SCNu64 ".%4s", &seq, suffix) == 2 && !strcmp(suffix, "dat")) {
+			seqs.push_back(seq);
+		}
+	}
+	closedir(listing);
+	sort(seqs.begin(), seqs.end());
+
+	for (uint64_t seq : seqs) {
+		string segment_path = path(seq);
+		if (seq < committed.seq) {
+			unlink(segment_path.c_str());
+			continue;
+		}
+
+		fd = ::open(segment_path.c_str(), O_RDWR);
+		struct stat info;
+		if (fd < 0 || fstat(fd, &info) || (size_t) info.st_size != segment_size) {
+			LOG_ERROR("spool") << "Skipping segment with a different size: " << segment_path;
+			if (fd >= 0) ::close(fd);
+			continue;
+		}
+		mapped = mmap(nullptr, segment_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		::close(fd);
+		if (mapped == MAP_FAILED) {
+			throw runtime_error("Can't map " + segment_path + ": " + strerror(errno));
+		}
+		segments.push_back({ seq, (char *) mapped });
+	}
+
+	// Start over at the oldest segment if the committed one is gone
+	if (segments.empty()) {
+		if (!create(committed.seq + 1)) {
+			throw runtime_error("Can't create spool segment in " + dir);
+		}
+		committed = { committed.seq + 1, 0 };
+	}
+	else if (segments.front().seq != committed.seq) {
+		committed = { segments.front().seq, 0 };
+	}
+
+	// Count pending readings and clear anything past the valid records, so
+	// the end of every segment is marked by a zero length
+	for (Segment &segment : segments) {
+		size_t count = 0;
+		size_t end = scan(segment, segment.seq == committed.seq ? committed.offset : 0, &count);
+		uint32_t marker = 0;
+		if (end + RECORD_HEADER <= segment_size) memcpy(&marker, segment.data + end, sizeof(marker));
+		if (marker) memset(segment.data + end, 0, segment_size - end);
+
+		pending += count;
+		head = { segment.seq, end };
+	}
+
+	commit(committed);
+	LOG_INFO("spool") << "Opened spool " << dir << ": segments = " << segments.size() << ", pending = " << pending;
+}
+
+/**
+ * ReadingSpool Class private Member Function: create
+ * Description:
+ *   Create, preallocate and map a new segment file, so appends can never
+ *   fault on a full disk
+ * Args:
+ *   seq - segment sequence number
+ * Returns:
+ *   true if created
+ */
+bool ReadingSpool::create(uint64_t seq)
+{
+	string segment_path = path(seq);
+	int fd = ::open(segment_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		LOG_ERROR("spool") << "Can't create " << segment_path << ": " << strerror(errno);
+		return false;
+	}
+
+	int ret = posix_fallocate(fd, 0, segment_size);
+	void *mapped = ret ? MAP_FAILED : mmap(nullptr, segment_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	::close(fd);
+	if (mapped == MAP_FAILED) {
+		LOG_ERROR("spool") << "Can't allocate " << segment_path << ": " << strerror(ret ? ret : errno);
+		unlink(segment_path.c_str());
+		return false;
+	}
+
+	segments.push_back({ seq, (char *) mapped });
+	return true;
+}
+
+/**
+ * ReadingSpool Class private Member Function: close
+ * Description:
+ *   Unmap the segment and checkpoint files
+ */
+void ReadingSpool::close(void)
+{
+	for (Segment &segment : segments) {
+		munmap(segment.data, segment_size);
+	}
+	segments.clear();
+
+	if (checkpoint) munmap(checkpoint, sizeof(Checkpoint));
+	checkpoint = nullptr;
+}
+
+/**
+ * ReadingSpool Class private Member Function: path
+ * Args:
+ *   seq - segment sequence number
+ * Returns:
+ *   segment file path
+ */
+string ReadingSpool::path(uint64_t seq)
+{
+	char name[32];
+	snprintf(name, sizeof(name), "/spool-%016" PRIu64 ".dat", seq);
+	return dir + name;
+}
+
+/**
+ * ReadingSpool Class private Member Function: find
+ * Description:
+ *   Find a mapped segment, lock must be held
+ * Args:
+ *   seq - segment sequence number
+ * Returns:
+ *   segment or nullptr
+ */
+ReadingSpool::Segment *ReadingSpool::find(uint64_t seq)
+{
+	for (Segment &segment : segments) {
+		if (segment.seq == seq) return &segment;
+	}
+	return nullptr;
+}
+
+/**
+ * ReadingSpool Class private Member Function: next
+ * Description:
+ *   Find the segment following a segment, lock must be held
+ * Args:
+ *   seq - segment sequence number
+ * Returns:
+ *   segment or nullptr
+ */
+ReadingSpool::Segment *ReadingSpool::next(uint64_t seq)
+{
+	for (Segment &segment : segments) {
+		if (segment.seq > seq) return &segment;
+	}
+	return nullptr;
+}
+
+/**
+ * ReadingSpool Class private Member Function: scan
+ * Description:
+ *   Walk the valid records of a segment
+ * Args:
+ *   segment - mapped segment
+ *   offset - offset of the first record
+ *   count - incremented for every valid record
+ * Returns:
+ *   offset after the last valid record
+ */
+size_t ReadingSpool::scan(const Segment &segment, size_t offset, size_t *count)
+{
+	while (offset + RECORD_HEADER <= segment_size) {
+		uint32_t length, hash;
+		memcpy(&length, segment.data + offset, sizeof(length));
+		memcpy(&hash, segment.data + offset + 4, sizeof(hash));
+
+		if (length < RECORD_FIXED || offset + RECORD_HEADER + length > segment_size) break;
+		if (checksum(segment.data + offset + RECORD_HEADER, length) != hash) break;
+
+		offset += RECORD_HEADER + length;
+		(*count)++;
+	}
+	return offset;
+}
+
+/**
+ * ReadingSpool Class private Member Function: read
+ * Description:
+ *   Decode spooled readings into a batch, interning their series
+ * Args:
+ *   batch - readings, filled up to its size
+ *   position - position of the first reading, moved past the last one read
+ * Returns:
+ *   number of readings read
+ */
+size_t ReadingSpool::read(vector<Reading> &batch, Position &position)
+{
+	Position limit;
+	Segment *segment;
+	{
+		// Records before the append position never change, read them unlocked
+		unique_lock<mutex> guard(lock);
+		limit = head;
+		segment = find(position.seq);
+	}
+
+	size_t count = 0;
+	while (segment && count < batch.size()) {
+		if (position.seq == limit.seq && position.offset >= limit.offset) break;
+
+		uint32_t length = 0;
+		if (position.offset + RECORD_HEADER <= segment_size) memcpy(&length, segment->data + position.offset, sizeof(length));
+		if (!length) {
+			// End of a full segment, continue with the next one
+			unique_lock<mutex> guard(lock);
+			segment = next(position.seq);
+			if (segment) position = { segment->seq, 0 };
+			continue;
+		}
+
+		const char *data = segment->data + position.offset + RECORD_HEADER;
+		Reading &reading = batch[count++];
+		int64_t timestamp;
+		double value;
+		uint16_t sizes[4];
+
+		memcpy(&timestamp, data, sizeof(timestamp));
+		memcpy(&value, data + 8, sizeof(value));
+		memcpy(sizes, data + 16, sizeof(sizes));
+		data += RECORD_FIXED;
+
+		string_view fields[4];
+		for (size_t idx = 0; idx < 4; idx++) {
+			fields[idx] = string_view(data, sizes[idx]);
+			data += sizes[idx];
+		}
+		reading.series = series().intern(fields[0], fields[1], fields[2], fields[3]);
+		reading.ts = timestamp;
+		reading.reading = value;
+
+		position.offset += RECORD_HEADER + length;
+	}
+
+	return count;
+}
+
+/**
+ * ReadingSpool Class private Member Function: commit
+ * Description:
+ *   Save the position of the first unwritten reading and delete the segments
+ *   before it, lock must be held
+ * Args:
+ *   position - committed position
+ */
+void ReadingSpool::commit(const Position &position)
+{
+	checkpoint->magic = SPOOL_MAGIC;
+	checkpoint->position = position;
+	checkpoint->check = SPOOL_MAGIC ^ position.seq ^ position.offset;
+
+	while (segments.size() > 1 && segments.front().seq < position.seq) {
+		munmap(segments.front().data, segment_size);
+		unlink(path(segments.front().seq).c_str());
+		segments.pop_front();
+	}
+}
+
+/**
+ * ReadingSpool Class private Member Function: run
+ * Description:
+ *   Drain thread, writes spooled readings in batches and commits them.  A
+ *   failed batch is retried from the committed position after a pause.
+ */
+void ReadingSpool::run(void)
+{
+	vector<Reading> batch(batch_size);
+	Position position = checkpoint->position;
+	auto next_flush = chrono::steady_clock::now() + flush_interval;
+
+	unique_lock<mutex> guard(lock);
+	while (running || pending) {
+		// Wait for a full batch, the flush interval or shutdown
+		ready.wait_until(guard, next_flush, [this]() { return !running || pending >= batch_size; });
+
+		if (pending && (pending >= batch_size || !running || chrono::steady_clock::now() >= next_flush)) {
+			// Write the batch without holding the spool lock
+			guard.unlock();
+			Position end = position;
+			size_t count = read(batch, end);
+			bool written = !count || flush(batch, count);
+			guard.lock();
+
+			if (written) {
+				position = end;
+				pending = count ? pending - count : 0;
+				commit(position);
+			}
+			else if (!running) {
+				// Leave the rest for the next start
+				LOG_ERROR("spool") << "Stopping with unwritten readings: " << pending;
+				break;
+			}
+			else {
+				ready.wait_for(guard, flush_interval, [this]() { return !running; });
+			}
+		}
+
+		if (chrono::steady_clock::now() >= next_flush) {
+			next_flush = chrono::steady_clock::now() + flush_interval;
+		}
+	}
+}
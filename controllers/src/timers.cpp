@@ -0,0 +1,177 @@
+/**
+ * Timer Service
+ *
+ * Runs all periodic timers from a single thread using a min-heap ordered by
+ * deadline.  Deadlines advance by whole intervals from the first deadline,
+ * so timers don't drift with callback run time.
+ */
+
+#include "timers.hpp"
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+// Min-heap ordering on the next deadline
+template <typename T>
+static bool later(const T &a, const T &b)
+{
+	return a.next > b.next;
+}
+
+//
+// TimerService Class
+//
+
+/**
+ * TimerService Class Member Function: TimerService
+ * Description:
+ *   TimerService Constructor
+ */
+TimerService::TimerService()
+{
+}
+
+/**
+ * TimerService Class Member Function: ~TimerService
+ * Description:
+ *   TimerService Destructor
+ */
+TimerService::~TimerService()
+{
+	stop();
+}
+
+/**
+ * TimerService Class Member Function: start
+ * Description:
+ *   Start the timer thread
+ */
+void TimerService::start(void)
+{
+	unique_lock<mutex> guard(lock);
+	if (running) return;
+	running = true;
+	runner = thread(&TimerService::run, this);
+}
+
+/**
+ * TimerService Class Member Function: stop
+ * Description:
+ *   Stop the timer thread, waits for a running callback to return
+ */
+void TimerService::stop(void)
+{
+	{
+		unique_lock<mutex> guard(lock);
+		if (!running) return;
+		running = false;
+	}
+	changed.notify_all();
+	runner.join();
+}
+
+/**
+ * TimerService Class Member Function: schedule
+ * Description:
+ *   Add a periodic timer, first called immediately
+ * Args:
+ *   interval - period in milliseconds
+ *   callback - function called on the timer thread for every period
+ * Returns:
+ *   timer id used to cancel the timer, ids of cancelled timers are reused
+ */
+size_t TimerService::schedule(chrono::milliseconds interval, Callback callback)
+{
+	size_t id;
+	{
+		unique_lock<mutex> guard(lock);
+		if (free_ids.size()) {
+			id = free_ids.back();
+			free_ids.pop_back();
+			callbacks[id] = callback;
+		}
+		else {
+			callbacks.push_back(callback);
+			id = callbacks.size() - 1;
+		}
+		heap.push_back({ chrono::steady_clock::now(), max(interval, chrono::milliseconds(1)), id });
+		push_heap(heap.begin(), heap.end(), later<Timer>);
+	}
+	changed.notify_all();
+	return id;
+}
+
+/**
+ * TimerService Class Member Function: cancel
+ * Description:
+ *   Remove a timer, waits if its callback is running, so the callback is
+ *   never called once this returns.  Must not be called from a callback of
+ *   the same timer.
+ * Args:
+ *   id - timer id returned by schedule
+ */
+void TimerService::cancel(size_t id)
+{
+	unique_lock<mutex> guard(lock);
+	changed.wait(guard, [this, id]() { return active != id; });
+
+	auto end = remove_if(heap.begin(), heap.end(), [id](const Timer &timer) { return timer.callback == id; });
+	if (end == heap.end()) return;
+
+	heap.erase(end, heap.end());
+	make_heap(heap.begin(), heap.end(), later<Timer>);
+	callbacks[id] = nullptr;
+	free_ids.push_back(id);
+}
+
+/**
+ * TimerService Class private Member Function: run
+ * Description:
+ *   Timer thread, calls due timers and sleeps until the next deadline
+ */
+void TimerService::run(void)
+{
+	unique_lock<mutex> guard(lock);
+	while (running) {
+		if (heap.empty()) {
+			changed.wait(guard);
+			continue;
+		}
+
+		// Sleep until the earliest deadline or a change
+		// Deadline is copied, the heap may grow while waiting
+		auto now = chrono::steady_clock::now();
+		auto deadline = heap.front().next;
+		if (deadline > now) {
+			changed.wait_until(guard, deadline);
+			continue;
+		}
+
+		// Take the due timer off the heap
+		pop_heap(heap.begin(), heap.end(), later<Timer>);
+		Timer &timer = heap.back();
+		Callback &callback = callbacks[timer.callback];
+		active = timer.callback;
+
+		// Advance by whole intervals, skipping periods missed while stalled
+		do {
+			timer.next += timer.interval;
+		} while (timer.next <= now);
+		push_heap(heap.begin(), heap.end(), later<Timer>);
+
+		// Deque elements don't move and a slot is only reused once cancel()
+		// has waited for its callback, so the reference stays valid unlocked
+		guard.unlock();
+		callback();
+		guard.lock();
+
+		// Wake any cancel() waiting for this callback
+		active = SIZE_MAX;
+		changed.notify_all();
+	}
+}
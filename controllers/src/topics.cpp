@@ -0,0 +1,133 @@
+/**
+ * Topic Index
+ *
+ * Topic level trie mapping MQTT subscription filters, including the '+'
+ * and '#' wildcards, to the handlers subscribed with them.
+ */
+
+#include "topics.hpp"
+#include <algorithm>
+#include <string>
+#include <string_view>
+#include <vector>
+
+using namespace std;
+
+//
+// TopicIndex Class
+//
+
+/**
+ * TopicIndex Class Member Function: TopicIndex
+ * Description:
+ *   TopicIndex Constructor
+ */
+TopicIndex::TopicIndex() : root{ new Node }
+{
+}
+
+/**
+ * TopicIndex Class Member Function: ~TopicIndex
+ * Description:
+ *   TopicIndex Destructor, handlers are not owned by the index
+ */
+TopicIndex::~TopicIndex()
+{
+	destroy(root);
+}
+
+/**
+ * TopicIndex Class Member Function: add
+ * Description:
+ *   Add a handler for a subscription filter
+ * Args:
+ *   filter - MQTT subscription filter, may contain '+' and '#' levels
+ *   handler - handler to call for matching topics
+ */
+void TopicIndex::add(string_view filter, Handlers *handler)
+{
+	Node *node = root;
+
+	while (true) {
+		size_t slash = filter.find('/');
+		string_view level = filter.substr(0, slash);
+
+		if (level == "#") {
+			// Multi level wildcard is always the last level
+			node->multi.push_back(handler);
+			break;
+		}
+
+		node = level == "+" ? (node->plus ? node->plus : (node->plus = new Node)) : child(node, level);
+
+		if (slash == string_view::npos) {
+			node->handlers.push_back(handler);
+			break;
+		}
+		filter = filter.substr(slash + 1);
+	}
+
+	count++;
+}
+
+/**
+ * TopicIndex Class Member Function: size
+ * Returns:
+ *   number of handler subscriptions in the index
+ */
+size_t TopicIndex::size(void)
+{
+	return count;
+}
+
+/**
+ * TopicIndex Class private Member Function: child
+ * Description:
+ *   Get or create the exact level child of a node
+ * Args:
+ *   node - parent node
+ *   level - topic level name
+ * Returns:
+ *   child node
+ */
+TopicIndex::Node *TopicIndex::child(Node *node, string_view level)
+{
+	auto it = lower_bound(node->children.begin(), node->children.end(), level,
+		[](const pair<string, Node*> &entry, string_view name) { return string_view(entry.first) < name; });
+
+	if (it != node->children.end() && it->first == level) return it->second;
+
+	return node->children.insert(it, make_pair(string(level), new Node))->second;
+}
+
+/**
+ * TopicIndex Class private Member Function: find
+ * Description:
+ *   Find the exact level child of a node
+ * Args:
+ *   node - parent node
+ *   level - topic level name
+ * Returns:
+ *   child node or nullptr
+ */
+const TopicIndex::Node *TopicIndex::find(const Node *node, string_view level) const
+{
+	auto it = lower_bound(node->children.begin(), node->children.end(), level,
+		[](const pair<string, Node*> &entry, string_view name) { return string_view(entry.first) < name; });
+
+	return it != node->children.end() && it->first == level ? it->second : nullptr;
+}
+
+/**
+ * TopicIndex Class private Member Function: destroy
+ * Description:
+ *   Free a node and all nodes below it
+ * Args:
+ *   node - node to free
+ */
+void TopicIndex::destroy(Node *node)
+{
+	for (auto &entry : node->children) destroy(entry.second);
+	if (node->plus) destroy(node->plus);
+	delete node;
+}
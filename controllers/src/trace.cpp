@@ -0,0 +1,460 @@
+/**
+ * Message Tracing
+ *
+ * Samples 1 of every TraceRate received messages and stamps the pipeline
+ * points the message passes (receive, dispatch, handler enter and exit,
+ * publish queue and publish, DB queue and commit) with a monotonic time.
+ * Stamps go to a fixed size lock-free ring shared by all threads, the
+ * oldest stamps are overwritten, so the ring always holds the latest
+ * traces.  A dump converts the ring to Chrome trace event JSON, which
+ * loads in chrome://tracing and Perfetto.
+ *
+ * With tracing off, receiving a message costs one load of TraceRate and
+ * every other stage only tests the message trace id.
+ */
+
+#include "trace.hpp"
+#include "log.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+
+// Structures
+// Ring slot, the sequence is the ring position + 1 once the slot is written
+// and 0 while it is being written.  The event packs the trace id (bits
+// 0-31), stage (32-39), thread (40-47) and label (48-63).
+typedef struct {
+	atomic<uint64_t> sequence;
+	atomic<uint64_t> time;
+	atomic<uint64_t> event;
+} TraceSlot;
+
+// Stamp read back from the ring
+typedef struct {
+	uint32_t trace;
+	TraceStages::type stage;
+	unsigned int thread;
+	uint16_t label;
+	uint64_t time;
+} TraceEvent;
+
+// Sampling rate, 0 if tracing is off
+unsigned int TraceRate = 0;
+
+// Trace of the message run by the calling thread's handler
+thread_local uint32_t TraceCurrent = 0;
+
+// Ring of stamps and the next position
+static unique_ptr<TraceSlot[]> slots;
+static size_t mask = 0;
+static atomic<uint64_t> position{0};
+static chrono::steady_clock::time_point origin;
+
+// Messages sampled and threads stamping, thread 0 is unassigned
+static atomic<uint32_t> sampled{0};
+static atomic<unsigned int> threads{0};
+static thread_local unsigned int thread_id = 0;
+
+// Handler and topic names by label, label 0 is no name
+static mutex label_lock;
+static vector<string> labels{ "" };
+static unordered_map<string, uint16_t> label_ids;
+
+// Dump requested by a signal or the control topic
+static atomic<bool> dump_requested{false};
+
+// Stage names in the trace output
+static const char *stage_names[] = {
+	"receive", "dispatch", "handler_enter", "handler_exit", "publish_queue", "publish", "db_queue", "db_commit"
+};
+
+/**
+ * Function: start_tracing
+ * Description:
+ *   Allocate the trace ring and start sampling messages
+ * Args:
+ *   rate - trace 1 of every rate messages, 0 leaves tracing off
+ *   capacity - number of stamps kept, rounded up to a power of two
+ */
+void start_tracing(unsigned int rate, size_t capacity)
+{
+	if (!rate || TraceRate) return;
+
+	size_t size = 2;
+	while (size < capacity) size <<= 1;
+
+	slots.reset(new TraceSlot[size]);
+	for (size_t idx = 0; idx < size; idx++) slots[idx].sequence.store(0, memory_order_relaxed);
+	mask = size - 1;
+	origin = chrono::steady_clock::now();
+
+	LOG_INFO("trace") << "Tracing 1 of every " << rate << " messages, keeping " << size << " events";
+
+	// Set last, messages are only sampled once the ring exists
+	TraceRate = rate;
+}
+
+/**
+ * Function: next_trace
+ * Description:
+ *   Count a received message and sample it
+ * Returns:
+ *   trace id of the message, 0 if the message isn't traced
+ */
+uint32_t next_trace(void)
+{
+	uint32_t count = sampled.fetch_add(1, memory_order_relaxed);
+	if (count % TraceRate) return 0;
+	return count / TraceRate + 1;
+}
+
+/**
+ * Function: trace_event
+ * Description:
+ *   Stamp a pipeline stage of a traced message with the current time, safe
+ *   to call from any thread
+ * Args:
+ *   trace - trace id, 0 stamps nothing
+ *   stage - pipeline stage
+ *   label - handler or topic name label, 0 if none
+ */
+void trace_event(uint32_t trace, TraceStages::type stage, uint16_t label)
+{
+	if (!trace || !slots) return;
+
+	uint64_t time = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - origin).count();
+	if (!thread_id) thread_id = min(threads.fetch_add(1, memory_order_relaxed) + 1, 255u);
+
+	uint64_t pos = position.fetch_add(1, memory_order_relaxed);
+	TraceSlot &slot = slots[pos & mask];
+
+	// Readers skip the slot until its sequence is set again
+	slot.sequence.store(0, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	slot.time.store(time, memory_order_relaxed);
+	slot.event.store((uint64_t) trace | (uint64_t) stage << 32 | (uint64_t) thread_id << 40 | (uint64_t) label << 48, memory_order_relaxed);
+	slot.sequence.store(pos + 1, memory_order_release);
+}
+
+/**
+ * Function: trace_label
+ * Description:
+ *   Get the label of a handler or topic name, adding the name if it is new.
+ *   Called when handlers and topics are created, not per message.
+ * Args:
+ *   name - handler or topic name
+ * Returns:
+ *   label, 0 if all labels are used
+ */
+uint16_t trace_label(const string &name)
+{
+	lock_guard<mutex> guard(label_lock);
+
+	auto found = label_ids.find(name);
+	if (found != label_ids.end()) return found->second;
+	if (labels.size() > UINT16_MAX) return 0;
+
+	labels.push_back(name);
+	label_ids[name] = labels.size() - 1;
+	return labels.size() - 1;
+}
+
+/**
+ * Function: request_trace_dump
+ * Description:
+ *   Ask for the trace ring to be written, safe to call from a signal handler
+ */
+void request_trace_dump(void)
+{
+	dump_requested = true;
+}
+
+/**
+ * Function: trace_dump_requested
+ * Returns:
+ *   true once for every dump requested
+ */
+bool trace_dump_requested(void)
+{
+	return dump_requested.exchange(false);
+}
+
+/**
+ * Function: read_events
+ * Description:
+ *   Copy the stamps in the ring, skipping slots being written
+ * Returns:
+ *   stamps ordered by trace and time
+ */
+static vector<TraceEvent> read_events(void)
+{
+	vector<TraceEvent> events;
+	if (!slots) return events;
+
+	uint64_t end = position.load(memory_order_acquire);
+	uint64_t begin = end > mask + 1 ? end - mask - 1 : 0;
+	events.reserve(end - begin);
+
+	for (uint64_t pos = begin; pos < end; pos++) {
+		TraceSlot &slot = slots[pos & mask];
+		uint64_t sequence = slot.sequence.load(memory_order_acquire);
+		uint64_t time = slot.time.load(memory_order_relaxed);
+		uint64_t event = slot.event.load(memory_order_relaxed);
+		atomic_thread_fence(memory_order_acquire);
+		if (sequence != pos + 1 || slot.sequence.load(memory_order_relaxed) != sequence) continue;
+
+		events.push_back(TraceEvent{ (uint32_t) event, (TraceStages::type) ((event >> 32) & 0xff),
+			(unsigned int) ((event >> 40) & 0xff), (uint16_t) (event >> 48), time });
+	}
+
+	stable_sort(events.begin(), events.end(), [](const TraceEvent &a, const TraceEvent &b) {
+		return a.trace != b.trace ? a.trace < b.trace : a.time < b.time;
+	});
+	return events;
+}
+
+/**
+ * Function: escape
+ * Args:
+ *   text - text for a JSON string
+ * Returns:
+ *   text with quotes, backslashes and control characters escaped
+ */
+static string escape(const string &text)
+{
+	string escaped;
+	for (char c : text) {
+		if (c == '"' || c == '\\') escaped.append(1, '\\').append(1, c);
+		else if ((unsigned char) c < 0x20) {
+			char code[8];
+			snprintf(code, sizeof(code), "\\u%04x", c);
+			escaped.append(code);
+		}
+		else escaped.append(1, c);
+	}
+	return escaped;
+}
+
+//
+// TraceWriter Class
+//
+// Writes the events of one dump, separating them with commas
+//
+
+class TraceWriter
+{
+	public:
+		TraceWriter(ofstream &out) : out{ out } {}
+
+		/**
+		 * TraceWriter Class Member Function: span
+		 * Description:
+		 *   Write a span run on one thread
+		 * Args:
+		 *   name - span name
+		 *   thread - thread running the span
+		 *   begin - start time in nanoseconds
+		 *   end - end time in nanoseconds
+		 *   trace - trace id
+		 *   args - extra JSON members of args, empty if none
+		 */
+		void span(const string &name, unsigned int thread, uint64_t begin, uint64_t end, uint32_t trace, const string &args = "")
+		{
+			next() << "{\"name\":\"" << escape(name) << "\",\"cat\":\"message\",\"ph\":\"X\",\"pid\":1,\"tid\":" << thread
+				<< ",\"ts\":" << micros(begin) << ",\"dur\":" << micros(end - begin)
+				<< ",\"args\":{\"trace\":" << trace << args << "}}";
+		}
+
+		/**
+		 * TraceWriter Class Member Function: wait
+		 * Description:
+		 *   Write a span crossing threads, e.g. time spent in a queue, as an
+		 *   async event pair
+		 * Args:
+		 *   name - span name
+		 *   begin - start time in nanoseconds
+		 *   end - end time in nanoseconds
+		 *   trace - trace id
+		 */
+		void wait(const string &name, uint64_t begin, uint64_t end, uint32_t trace)
+		{
+			string id = to_string(trace) + "." + to_string(++waits);
+			next() << "{\"name\":\"" << escape(name) << "\",\"cat\":\"message\",\"ph\":\"b\",\"pid\":1,\"id\":\"" << id
+				<< "\",\"ts\":" << micros(begin) << ",\"args\":{\"trace\":" << trace << "}}";
+			next() << "{\"name\":\"" << escape(name) << "\",\"cat\":\"message\",\"ph\":\"e\",\"pid\":1,\"id\":\"" << id
+				<< "\",\"ts\":" << micros(end) << "}";
+		}
+
+		/**
+		 * TraceWriter Class Member Function: instant
+		 * Description:
+		 *   Write a stamp without a matching start or end
+		 * Args:
+		 *   event - stamp
+		 *   name - stamp name
+		 */
+		void instant(const TraceEvent &event, const string &name)
+		{
+			next() << "{\"name\":\"" << escape(name) << "\",\"cat\":\"message\",\"ph\":\"i\",\"s\":\"t\",\"pid\":1,\"tid\":" << event.thread
+				<< ",\"ts\":" << micros(event.time) << ",\"args\":{\"trace\":" << event.trace << "}}";
+		}
+
+	private:
+		ofstream &next(void)
+		{
+			if (count++) out << ",\n";
+			return out;
+		}
+
+		static string micros(uint64_t ns)
+		{
+			char text[32];
+			snprintf(text, sizeof(text), "%.3f", ns / 1000.0);
+			return text;
+		}
+
+		ofstream &out;
+		size_t count = 0;
+		unsigned long waits = 0;
+};
+
+/**
+ * Function: write_message
+ * Description:
+ *   Write the spans of one traced message.  Handler runs are spans on their
+ *   thread, parsing a span on the network thread, and time spent queued for
+ *   a handler, for publishing and for the DB are async spans.  Stamps of
+ *   stages started or ended before the ring was overwritten are written as
+ *   instant events.
+ * Args:
+ *   writer - trace output
+ *   events - stamps of the message ordered by time
+ *   names - label names
+ */
+static void write_message(TraceWriter &writer, const vector<TraceEvent> &events, const vector<string> &names)
+{
+	auto name = [&names](const TraceEvent &event) {
+		string text = stage_names[event.stage];
+		if (event.label && event.label < names.size()) text += " " + names[event.label];
+		return text;
+	};
+
+	uint32_t trace = events.front().trace;
+	const TraceEvent *received = nullptr;
+	const TraceEvent *dispatched = nullptr;
+	vector<const TraceEvent *> open;
+
+	// Finds and removes the open stamp a stage ends
+	auto close = [&open](TraceStages::type stage, uint16_t label) -> const TraceEvent * {
+		for (auto idx = open.begin(); idx != open.end(); idx++) {
+			if ((*idx)->stage == stage && (*idx)->label == label) {
+				const TraceEvent *start = *idx;
+				open.erase(idx);
+				return start;
+			}
+		}
+		return nullptr;
+	};
+
+	for (const TraceEvent &event : events) {
+		const TraceEvent *start = nullptr;
+
+		switch (event.stage) {
+			case TraceStages::receive:
+				received = &event;
+				break;
+			case TraceStages::dispatch:
+				if (received && !dispatched) writer.span("parse", received->thread, received->time, event.time, trace);
+				else if (!received) writer.instant(event, name(event));
+				dispatched = &event;
+				break;
+			case TraceStages::handler_enter:
+				if (dispatched && dispatched->thread != event.thread) writer.wait("handler_queue", dispatched->time, event.time, trace);
+				open.push_back(&event);
+				break;
+			case TraceStages::publish_queue:
+			case TraceStages::db_queue:
+				open.push_back(&event);
+				break;
+			case TraceStages::handler_exit:
+				start = close(TraceStages::handler_enter, event.label);
+				if (start) {
+					string label = event.label < names.size() ? names[event.label] : "handler";
+					writer.span(label, event.thread, start->time, event.time, trace);
+				}
+				else writer.instant(event, name(event));
+				break;
+			case TraceStages::publish:
+				start = close(TraceStages::publish_queue, event.label);
+				if (start) writer.wait(name(*start), start->time, event.time, trace);
+				else writer.instant(event, name(event));
+				break;
+			case TraceStages::db_commit:
+				start = close(TraceStages::db_queue, event.label);
+				if (start) writer.wait("db_write", start->time, event.time, trace);
+				else writer.instant(event, name(event));
+				break;
+		}
+	}
+
+	// The whole message from receive to its last stamp
+	if (received) writer.wait("message", received->time, events.back().time, trace);
+	for (const TraceEvent *event : open) writer.instant(*event, name(*event));
+}
+
+/**
+ * Function: write_trace
+ * Description:
+ *   Write the traces in the ring as Chrome trace event JSON.  The file is
+ *   written next to the path and renamed, so a reader never sees a partial
+ *   trace.  Tracing continues while the ring is read.
+ * Args:
+ *   path - trace file
+ * Returns:
+ *   false if the file couldn't be written
+ */
+bool write_trace(const string &path)
+{
+	vector<TraceEvent> events = read_events();
+	vector<string> names;
+	{
+		lock_guard<mutex> guard(label_lock);
+		names = labels;
+	}
+
+	string temporary = path + ".tmp";
+	ofstream out(temporary);
+	if (!out) {
+		LOG_ERROR("trace") << "Can't write trace file " << temporary;
+		return false;
+	}
+
+	TraceWriter writer(out);
+	out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n";
+	size_t traces = 0;
+	for (size_t begin = 0, end = 0; begin < events.size(); begin = end) {
+		while (end < events.size() && events[end].trace == events[begin].trace) end++;
+		write_message(writer, vector<TraceEvent>(events.begin() + begin, events.begin() + end), names);
+		traces++;
+	}
+	out << "\n]}\n";
+	out.close();
+
+	if (!out || rename(temporary.c_str(), path.c_str())) {
+		LOG_ERROR("trace") << "Can't write trace file " << path;
+		remove(temporary.c_str());
+		return false;
+	}
+
+	LOG_INFO("trace") << "Wrote " << traces << " traces to " << path;
+	return true;
+}
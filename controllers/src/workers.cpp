@@ -0,0 +1,374 @@
+/**
+ * Handler Worker Pool
+ *
+ * Runs handler logic on a fixed number of worker threads.  Every handler
+ * instance is pinned to one worker by its shard key, so each handler sees
+ * its messages in order and never runs on two threads at once, while
+ * unrelated handlers run in parallel.  With no worker threads, handlers run
+ * inline on the calling (MQTT network) thread.
+ */
+
+#include "workers.hpp"
+#include "batch.hpp"
+#include "handlers.hpp"
+#include "log.hpp"
+#include "message.hpp"
+#include "metrics.hpp"
+#include "trace.hpp"
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+
+using namespace std;
+
+// Topic capacity reserved in every job, longer topics grow their job once
+#define JOB_TOPIC_RESERVE 128
+
+// Metrics
+static Histogram &handler_latency = metrics().histogram("controller_handler_latency_seconds", "Handler run time per message, timeout or batch");
+
+/**
+ * Function: run_handler
+ * Description:
+ *   Run a handler for a message, or its timeout without a message, and
+ *   record the dispatch and run time.  Commands published by the handler
+ *   for a traced message carry its trace.
+ * Args:
+ *   handler - handler to run
+ *   message - message for topic handlers, nullptr for a timeout
+ */
+static void run_handler(Handlers *handler, const Message *message)
+{
+	auto start = chrono::steady_clock::now();
+	uint32_t trace = message ? message->trace : 0;
+
+	if (trace) {
+		TraceCurrent = trace;
+		trace_event(trace, TraceStages::handler_enter, handler->getTraceLabel());
+	}
+
+	if (message) handler->handleTopic(*message);
+	else handler->handleTimeout();
+
+	if (trace) {
+		trace_event(trace, TraceStages::handler_exit, handler->getTraceLabel());
+		TraceCurrent = 0;
+	}
+
+	handler->getDispatchCounter().add();
+	handler_latency.record(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count());
+}
+
+/**
+ * Function: run_batch
+ * Description:
+ *   Run a handler for a message batch, record the dispatches and run time,
+ *   and return the batch to the batch stage
+ * Args:
+ *   handler - handler taking batches
+ *   batch - messages for the handler
+ */
+static void run_batch(Handlers *handler, MessageBatch *batch)
+{
+	auto start = chrono::steady_clock::now();
+
+	handler->handleBatch(*batch);
+
+	handler->getDispatchCounter().add(batch->count);
+	handler_latency.record(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count());
+	Batcher->release(batch);
+}
+
+//
+// WorkerPool Class
+//
+
+/**
+ * WorkerPool Class Member Function: WorkerPool
+ * Description:
+ *   WorkerPool Constructor
+ * Args:
+ *   threads - number of worker threads, 0 runs handlers inline
+ *   capacity - job queue size per worker
+ */
+WorkerPool::WorkerPool(size_t threads, size_t capacity)
+{
+	for (size_t idx = 0; idx < threads; idx++) {
+		workers.push_back(unique_ptr<Worker>(new Worker(capacity)));
+
+		// Jobs are reused, sized now so no queued message allocates
+		Worker *worker = workers.back().get();
+		worker->queue.prepare([](Job &job) { job.topic.reserve(JOB_TOPIC_RESERVE); });
+		metrics().gauge("controller_queue_depth", "Queued entries per pipeline queue", "queue=\"worker" + to_string(idx) + "\"",
+			[worker]() { return (double) worker->queue.size(); });
+	}
+}
+
+/**
+ * WorkerPool Class Member Function: ~WorkerPool
+ * Description:
+ *   WorkerPool Destructor, runs any queued jobs
+ */
+WorkerPool::~WorkerPool()
+{
+	stop();
+
+	// Queues are going away
+	for (size_t idx = 0; idx < workers.size(); idx++) {
+		metrics().gauge("controller_queue_depth", "Queued entries per pipeline queue", "queue=\"worker" + to_string(idx) + "\"",
+			[]() { return 0.0; });
+	}
+}
+
+/**
+ * WorkerPool Class Member Function: start
+ * Description:
+ *   Start the worker threads
+ */
+void WorkerPool::start(void)
+{
+	if (running.exchange(true)) return;
+
+	LOG_INFO("workers") << "Starting handler workers: " << workers.size();
+	for (auto &worker : workers) {
+		worker->runner = thread(&WorkerPool::run, this, worker.get());
+	}
+}
+
+/**
+ * WorkerPool Class Member Function: stop
+ * Description:
+ *   Stop the worker threads once their queued jobs have run
+ */
+void WorkerPool::stop(void)
+{
+	if (!running.exchange(false)) return;
+
+	for (auto &worker : workers) {
+		{
+			lock_guard<mutex> guard(worker->lock);
+		}
+		worker->ready.notify_one();
+		worker->runner.join();
+	}
+}
+
+/**
+ * WorkerPool Class Member Function: size
+ * Returns:
+ *   number of worker threads
+ */
+size_t WorkerPool::size(void)
+{
+	return workers.size();
+}
+
+/**
+ * WorkerPool Class Member Function: dispatch
+ * Description:
+ *   Run a topic handler for a message on the handler's worker
+ * Args:
+ *   handler - topic handler
+ *   message - message for the handler, its topic, reading and trace are
+ *     copied if queued
+ */
+void WorkerPool::dispatch(Handlers *handler, const Message &message)
+{
+	if (workers.empty()) {
+		run_handler(handler, &message);
+		return;
+	}
+
+	push(handler, [handler, &message](Job &job) {
+		job.handler = handler;
+		job.type = JobTypes::message;
+		job.topic.assign(message.topic);
+		job.reading = message.reading;
+		job.ts = message.ts;
+		job.trace = message.trace;
+	});
+}
+
+/**
+ * WorkerPool Class Member Function: dispatchTimeout
+ * Description:
+ *   Run a timer handler timeout on the handler's worker
+ * Args:
+ *   handler - timer handler
+ */
+void WorkerPool::dispatchTimeout(Handlers *handler)
+{
+	if (workers.empty()) {
+		run_handler(handler, nullptr);
+		return;
+	}
+
+	push(handler, [handler](Job &job) {
+		job.handler = handler;
+		job.type = JobTypes::timeout;
+	});
+}
+
+/**
+ * WorkerPool Class Member Function: dispatchSnapshot
+ * Description:
+ *   Copy a handler's state for the state checkpoint on the handler's
+ *   worker, between its messages.  The counter is decremented once the copy
+ *   is complete.
+ * Args:
+ *   handler - handler to snapshot
+ *   snapshots - snapshots left to take
+ */
+void WorkerPool::dispatchSnapshot(Handlers *handler, atomic<size_t> *snapshots)
+{
+	if (workers.empty()) {
+		handler->snapshot();
+		snapshots->fetch_sub(1, memory_order_release);
+		return;
+	}
+
+	push(handler, [handler, snapshots](Job &job) {
+		job.handler = handler;
+		job.type = JobTypes::snapshot;
+		job.snapshots = snapshots;
+	});
+}
+
+/**
+ * WorkerPool Class Member Function: dispatchBatch
+ * Description:
+ *   Run a handler for a message batch on the handler's worker, in order
+ *   with its other jobs
+ * Args:
+ *   handler - handler taking batches
+ *   batch - messages for the handler, released to the batch stage once run
+ */
+void WorkerPool::dispatchBatch(Handlers *handler, MessageBatch *batch)
+{
+	if (workers.empty()) {
+		run_batch(handler, batch);
+		return;
+	}
+
+	push(handler, [handler, batch](Job &job) {
+		job.handler = handler;
+		job.type = JobTypes::batch;
+		job.batch = batch;
+	});
+}
+
+/**
+ * WorkerPool Class Member Function: drain
+ * Description:
+ *   Wait until all jobs queued before the call have run, e.g. before
+ *   deleting handlers that may still have queued jobs
+ */
+void WorkerPool::drain(void)
+{
+	if (!running.load()) return;
+
+	vector<unsigned long> passed;
+	for (auto &worker : workers) {
+		passed.push_back(worker->barriers.load());
+		push(worker.get(), [](Job &job) {
+			job.handler = nullptr;
+		});
+	}
+
+	for (size_t idx = 0; idx < workers.size(); idx++) {
+		while (workers[idx]->barriers.load() == passed[idx]) {
+			this_thread::sleep_for(chrono::milliseconds(1));
+		}
+	}
+}
+
+/**
+ * WorkerPool Class private Member Function: push
+ * Description:
+ *   Queue a job on the worker owning the handler and wake the worker.
+ *   Waits while the worker queue is full.
+ * Args:
+ *   handler - handler selecting the worker
+ *   fill - callable filling the job in place
+ */
+template <typename F>
+void WorkerPool::push(Handlers *handler, F &&fill)
+{
+	push(workers[handler->getShard() % workers.size()].get(), fill);
+}
+
+/**
+ * WorkerPool Class private Member Function: push
+ * Description:
+ *   Queue a job on a worker and wake the worker.  Waits while the worker
+ *   queue is full.
+ * Args:
+ *   worker - worker to run the job
+ *   fill - callable filling the job in place
+ */
+template <typename F>
+void WorkerPool::push(Worker *worker, F &&fill)
+{
+	while (!worker->queue.push(fill)) {
+		this_thread::yield();
+	}
+
+	// Wake the worker if it's waiting for jobs
+	atomic_thread_fence(memory_order_seq_cst);
+	if (worker->sleeping.load(memory_order_relaxed)) {
+		lock_guard<mutex> guard(worker->lock);
+		worker->ready.notify_one();
+	}
+}
+
+/**
+ * WorkerPool Class private Member Function: run
+ * Description:
+ *   Worker thread, runs queued jobs in order
+ * Args:
+ *   worker - worker to run
+ */
+void WorkerPool::run(Worker *worker)
+{
+	Message message = {};
+
+	auto execute = [&message, worker](Job &job) {
+		if (!job.handler) {
+			worker->barriers.fetch_add(1);
+		}
+		else if (job.type == JobTypes::timeout) {
+			run_handler(job.handler, nullptr);
+		}
+		else if (job.type == JobTypes::snapshot) {
+			job.handler->snapshot();
+			job.snapshots->fetch_sub(1, memory_order_release);
+		}
+		else if (job.type == JobTypes::batch) {
+			run_batch(job.handler, job.batch);
+		}
+		else {
+			// The payload was decoded by the dispatching thread
+			parse_topic(message, job.topic.c_str());
+			set_reading(message, job.reading, job.ts);
+			message.trace = job.trace;
+			run_handler(job.handler, &message);
+		}
+	};
+
+	while (true) {
+		if (worker->queue.pop(execute)) continue;
+
+		// Queue drained, exit if stopping
+		if (!running.load()) break;
+
+		// Sleep until a producer queues a job
+		unique_lock<mutex> guard(worker->lock);
+		worker->sleeping.store(true, memory_order_relaxed);
+		atomic_thread_fence(memory_order_seq_cst);
+		if (!worker->queue.size() && running.load()) {
+			worker->ready.wait_for(guard, chrono::milliseconds(100));
+		}
+		worker->sleeping.store(false, memory_order_relaxed);
+	}
+}
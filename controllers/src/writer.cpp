@@ -0,0 +1,327 @@
+/**
+ * Reading Writer
+ *
+ * Bounded in-memory queue of readings drained by background threads that
+ * hand accumulated readings to a flush function in batches.  A batch is
+ * flushed once the batch size is reached or the flush interval expires.
+ *
+ * The queue is the only buffer between ingest and a slow DB, so it decides
+ * what happens to readings the DB can't keep up with: drop the newest (the
+ * default) or oldest reading, sample each series once the queue is half
+ * full, or hold them for a bounded time.  Readings are queued from the MQTT
+ * network thread, which also carries the commands, so enqueue never waits.
+ * Held readings are kept in a backlog of the queue size instead, moved into
+ * the queue in order by the writer threads as they make space, and dropped
+ * once held longer than the hold timeout.  Every reading shed is counted by
+ * reason.
+ */
+
+#include "writer.hpp"
+#include "log.hpp"
+#include "metrics.hpp"
+#include "trace.hpp"
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+// Metrics
+static Counter &queue_full = metrics().counter("controller_messages_dropped_total", "Messages dropped by a pipeline stage", "reason=\"db_queue_full\"");
+static Counter &queue_oldest = metrics().counter("controller_messages_dropped_total", "Messages dropped by a pipeline stage", "reason=\"db_queue_oldest\"");
+static Counter &queue_sampled = metrics().counter("controller_messages_dropped_total", "Messages dropped by a pipeline stage", "reason=\"db_sampled\"");
+static Counter &hold_timeouts = metrics().counter("controller_messages_dropped_total", "Messages dropped by a pipeline stage", "reason=\"db_hold_timeout\"");
+static Counter &queue_held = metrics().counter("controller_queue_held_total", "Items held back for space in a full pipeline queue", "queue=\"db_writer\"");
+
+/**
+ * Function: parse_overload_policy
+ * Description:
+ *   Parse an overload policy name
+ * Args:
+ *   name - hold, drop_newest, drop_oldest or sample
+ *   policy - set to the parsed policy
+ * Returns:
+ *   true if the name is a policy
+ */
+bool parse_overload_policy(const string &name, OverloadPolicies::type &policy)
+{
+	if (name == "hold") policy = OverloadPolicies::hold;
+	else if (name == "drop_newest") policy = OverloadPolicies::drop_newest;
+	else if (name == "drop_oldest") policy = OverloadPolicies::drop_oldest;
+	else if (name == "sample") policy = OverloadPolicies::sample;
+	else return false;
+	return true;
+}
+
+//
+// ReadingWriter Class
+//
+
+/**
+ * ReadingWriter Class Member Function: ReadingWriter
+ * Description:
+ *   ReadingWriter Constructor
+ * Args:
+ *   capacity - max number of readings queued before readings are dropped
+ *   batch_size - number of readings that triggers a flush
+ *   flush_interval - max time in milliseconds a reading waits for a flush
+ *   threads - number of writer threads flushing batches concurrently
+ *   overload - what to do with readings when the queue fills up
+ *   flush - function writing a batch of readings, called from all writer
+ *     threads, failed batches are dropped
+ */
+ReadingWriter::ReadingWriter(size_t capacity, size_t batch_size, unsigned int flush_interval, size_t threads, const OverloadSettings &overload, FlushFunc flush) :
+	slots(capacity ? capacity : 1), overload{ overload }, batch_size{ batch_size ? batch_size : 1 }, flush_interval{ flush_interval },
+	flush{ flush }, threads{ threads ? threads : 1 }
+{
+	if (this->overload.sample_rate < 1) this->overload.sample_rate = 1;
+	if (this->overload.policy == OverloadPolicies::hold) backlog.resize(slots.size());
+}
+
+/**
+ * ReadingWriter Class Member Function: ~ReadingWriter
+ * Description:
+ *   ReadingWriter Destructor, flushes any queued readings
+ */
+ReadingWriter::~ReadingWriter()
+{
+	stop();
+}
+
+/**
+ * ReadingWriter Class Member Function: start
+ * Description:
+ *   Start the background writer threads
+ */
+void ReadingWriter::start(void)
+{
+	unique_lock<mutex> guard(lock);
+	if (running) return;
+	running = true;
+	for (size_t idx = 0; idx < threads; idx++) {
+		workers.push_back(thread(&ReadingWriter::run, this));
+	}
+}
+
+/**
+ * ReadingWriter Class Member Function: stop
+ * Description:
+ *   Stop the background writer threads once all queued readings are flushed
+ */
+void ReadingWriter::stop(void)
+{
+	{
+		unique_lock<mutex> guard(lock);
+		if (!running) return;
+		running = false;
+	}
+	ready.notify_all();
+	for (thread &worker : workers) {
+		worker.join();
+	}
+	workers.clear();
+}
+
+/**
+ * ReadingWriter Class Member Function: size
+ * Returns:
+ *   number of queued readings
+ */
+size_t ReadingWriter::size(void)
+{
+	unique_lock<mutex> guard(lock);
+	return count + waiting;
+}
+
+/**
+ * ReadingWriter Class Member Function: enqueue
+ * Description:
+ *   Queue a reading for the writer thread.  Never waits, a full queue sheds
+ *   readings by the overload policy, or holds them back with hold.
+ * Args:
+ *   series - series of the reading
+ *   ts - reading timestamp in seconds since epoch
+ *   reading - sensor reading to store
+ *   trace - trace id of the message, 0 if not traced
+ * Returns:
+ *   true if queued, false if dropped
+ */
+bool ReadingWriter::enqueue(Series *series, long int ts, double reading, uint32_t trace)
+{
+	unique_lock<mutex> guard(lock);
+
+	if (overload.policy == OverloadPolicies::sample && count * 2 >= slots.size() && !admit(series)) {
+		queue_sampled.add();
+		return false;
+	}
+
+	// Hold back readings while the queue is full, or behind those held back
+	if (overload.policy == OverloadPolicies::hold && (count == slots.size() || waiting)) {
+		if (!defer({ series, ts, reading, trace })) return false;
+		if (trace) trace_event(trace, TraceStages::db_queue);
+		return true;
+	}
+
+	if (count == slots.size()) {
+		if (overload.policy == OverloadPolicies::drop_oldest) {
+			head = (head + 1) % slots.size();
+			count--;
+			dropped++;
+			queue_oldest.add();
+		}
+		else {
+			dropped++;
+			queue_full.add();
+			return false;
+		}
+	}
+
+	store({ series, ts, reading, trace });
+	if (trace) trace_event(trace, TraceStages::db_queue);
+	return true;
+}
+
+/**
+ * ReadingWriter Class private Member Function: admit
+ * Description:
+ *   Sample readings per series, lock must be held
+ * Args:
+ *   series - series of the reading
+ * Returns:
+ *   true for 1 of every sample_rate readings of the series
+ */
+bool ReadingWriter::admit(Series *series)
+{
+	return series->samples++ % overload.sample_rate == 0;
+}
+
+/**
+ * ReadingWriter Class private Member Function: store
+ * Description:
+ *   Add a reading to the queue, lock must be held and the queue not full
+ * Args:
+ *   reading - reading to queue
+ */
+void ReadingWriter::store(const Reading &reading)
+{
+	slots[(head + count) % slots.size()] = reading;
+
+	// Wake a writer for every full batch available
+	if (++count % batch_size == 0) ready.notify_one();
+}
+
+/**
+ * ReadingWriter Class private Member Function: defer
+ * Description:
+ *   Hold back a reading until the queue has space, lock must be held
+ * Args:
+ *   reading - reading to hold back
+ * Returns:
+ *   false if the backlog is full and the reading is dropped
+ */
+bool ReadingWriter::defer(const Reading &reading)
+{
+	auto now = chrono::steady_clock::now();
+	expire(now);
+
+	if (waiting == backlog.size()) {
+		dropped++;
+		hold_timeouts.add();
+		return false;
+	}
+
+	Deferred &entry = backlog[(backlog_head + waiting) % backlog.size()];
+	entry.reading = reading;
+	entry.since = now;
+	waiting++;
+	queue_held.add();
+	return true;
+}
+
+/**
+ * ReadingWriter Class private Member Function: expire
+ * Description:
+ *   Drop the readings held back longer than the hold timeout, lock must be
+ *   held
+ * Args:
+ *   now - current time
+ */
+void ReadingWriter::expire(chrono::steady_clock::time_point now)
+{
+	auto timeout = chrono::milliseconds(overload.hold_timeout);
+	while (waiting && now - backlog[backlog_head].since >= timeout) {
+		backlog_head = (backlog_head + 1) % backlog.size();
+		waiting--;
+		dropped++;
+		hold_timeouts.add();
+	}
+}
+
+/**
+ * ReadingWriter Class private Member Function: release
+ * Description:
+ *   Move held back readings into the queue while it has space, lock must be
+ *   held
+ */
+void ReadingWriter::release(void)
+{
+	if (!waiting) return;
+	expire(chrono::steady_clock::now());
+
+	while (waiting && count < slots.size()) {
+		store(backlog[backlog_head].reading);
+		backlog_head = (backlog_head + 1) % backlog.size();
+		waiting--;
+	}
+}
+
+/**
+ * ReadingWriter Class private Member Function: run
+ * Description:
+ *   Writer thread, moves queued readings into a batch and flushes the batch
+ *   outside of the queue lock.  Traced readings are stamped once written.
+ */
+void ReadingWriter::run(void)
+{
+	vector<Reading> batch(batch_size);
+	auto next_flush = chrono::steady_clock::now() + flush_interval;
+
+	unique_lock<mutex> guard(lock);
+	while (running || count || waiting) {
+		// Wait for a full batch, the flush interval or shutdown
+		ready.wait_until(guard, next_flush, [this]() { return !running || count >= batch_size; });
+		release();
+
+		if (count && (count >= batch_size || !running || chrono::steady_clock::now() >= next_flush)) {
+			// Swap queued readings into the batch
+			size_t n = count < batch_size ? count : batch_size;
+			for (size_t idx = 0; idx < n; idx++) {
+				swap(batch[idx], slots[(head + idx) % slots.size()]);
+			}
+			head = (head + n) % slots.size();
+			count -= n;
+			release();
+
+			size_t lost = dropped;
+			dropped = 0;
+
+			// Write batch without holding the queue lock
+			guard.unlock();
+			if (lost) {
+				LOG_ERROR("writer") << "Queue full, dropped readings: " << lost;
+			}
+			if (flush(batch, n) && TraceRate) {
+				for (size_t idx = 0; idx < n; idx++) {
+					if (batch[idx].trace) trace_event(batch[idx].trace, TraceStages::db_commit);
+				}
+			}
+			guard.lock();
+		}
+
+		if (chrono::steady_clock::now() >= next_flush) {
+			next_flush = chrono::steady_clock::now() + flush_interval;
+		}
+	}
+}
@@ -6,13 +6,36 @@ GRANT CONNECT ON DATABASE sample to sample;
 
 \connect sample sample
 
+CREATE TABLE series (
+	id serial PRIMARY KEY,
+	location text NOT NULL,
+	device_type text NOT NULL,
+	device_id text NOT NULL,
+	sensor text NOT NULL,
+	UNIQUE (location, device_type, device_id, sensor)
+);
+
+CREATE INDEX series_device_id ON series (device_id);
+
 CREATE TABLE readings (
-	location text,
-	device_type text,
-	device_id text,
-	sensor text,
+	series_id integer NOT NULL,
 	ts timestamp with time zone,
-	reading integer
+	reading double precision
+);
+
+CREATE INDEX readings_series_ts ON readings (series_id, ts);
+
+CREATE TABLE readings_rollup (
+	series_id integer NOT NULL,
+	window_seconds integer,
+	bucket timestamp with time zone,
+	count bigint,
+	min double precision,
+	max double precision,
+	sum double precision,
+	last double precision,
+	last_ts timestamp with time zone,
+	PRIMARY KEY (series_id, window_seconds, bucket)
 );
 
 CREATE OR REPLACE FUNCTION get_readings(
@@ -22,8 +45,8 @@ CREATE OR REPLACE FUNCTION get_readings(
 	_sensor text,
 	_start_time timestamp with time zone,
 	_end_time timestamp with time zone,
-	_min_value integer,
-	_max_value integer
+	_min_value double precision,
+	_max_value double precision
 )
 RETURNS TABLE (
 	location TEXT,
@@ -31,25 +54,26 @@ RETURNS TABLE (
 	device_id TEXT,
 	sensor TEXT,
 	ts TIMESTAMP WITH TIME ZONE,
-	reading INTEGER
+	reading DOUBLE PRECISION
 )
 LANGUAGE plpgsql
 AS $$
 BEGIN
 	RETURN QUERY SELECT
-		readings.location,
-		readings.device_type,
-		readings.device_id,
-		readings.sensor,
+		series.location,
+		series.device_type,
+		series.device_id,
+		series.sensor,
 		readings.ts,
 		readings.reading
 	FROM
-		readings
+		series
+		JOIN readings ON readings.series_id = series.id
 	WHERE
-		(_location IS NULL OR readings.location = _location) AND
-		(_device_type IS NULL OR readings.device_type = _device_type) AND
-		(_device_id IS NULL OR readings.device_id = _device_id) AND
-		(_sensor IS NULL OR readings.sensor = _sensor) AND
+		(_location IS NULL OR series.location = _location) AND
+		(_device_type IS NULL OR series.device_type = _device_type) AND
+		(_device_id IS NULL OR series.device_id = _device_id) AND
+		(_sensor IS NULL OR series.sensor = _sensor) AND
 		(_start_time IS NULL OR readings.ts >= _start_time) AND
 		(_end_time IS NULL OR readings.ts <= _end_time) AND
 		(_min_value IS NULL OR readings.reading >= _min_value) AND
@@ -57,6 +81,57 @@ BEGIN
 END;
 $$;
 
+\echo Create function get_rollups
+CREATE OR REPLACE FUNCTION get_rollups(
+	_location text,
+	_device_type text,
+	_device_id text,
+	_sensor text,
+	_window_seconds integer,
+	_start_time timestamp with time zone,
+	_end_time timestamp with time zone
+)
+RETURNS TABLE (
+	location TEXT,
+	device_type TEXT,
+	device_id TEXT,
+	sensor TEXT,
+	bucket TIMESTAMP WITH TIME ZONE,
+	count BIGINT,
+	min DOUBLE PRECISION,
+	max DOUBLE PRECISION,
+	avg DOUBLE PRECISION,
+	last DOUBLE PRECISION
+)
+LANGUAGE plpgsql
+AS $$
+BEGIN
+	RETURN QUERY SELECT
+		series.location,
+		series.device_type,
+		series.device_id,
+		series.sensor,
+		readings_rollup.bucket,
+		readings_rollup.count,
+		readings_rollup.min,
+		readings_rollup.max,
+		readings_rollup.sum / readings_rollup.count,
+		readings_rollup.last
+	FROM
+		series
+		JOIN readings_rollup ON readings_rollup.series_id = series.id
+	WHERE
+		readings_rollup.window_seconds = _window_seconds AND
+		(_location IS NULL OR series.location = _location) AND
+		(_device_type IS NULL OR series.device_type = _device_type) AND
+		(_device_id IS NULL OR series.device_id = _device_id) AND
+		(_sensor IS NULL OR series.sensor = _sensor) AND
+		(_start_time IS NULL OR readings_rollup.bucket >= _start_time) AND
+		(_end_time IS NULL OR readings_rollup.bucket <= _end_time)
+	ORDER BY readings_rollup.bucket;
+END;
+$$;
+
 \echo Create function get_sensors
 CREATE OR REPLACE FUNCTION get_sensors (
 	_device_id TEXT
@@ -69,7 +144,7 @@ AS $$
 		_sensors = ARRAY(
 			SELECT
 				DISTINCT(sensor)
-			FROM readings
+			FROM series
 			WHERE
 				device_id = _device_id
 		);
@@ -99,14 +174,14 @@ BEGIN
 	FROM (
 		SELECT
 			DISTINCT
-				readings.location AS location,
-				readings.device_type AS device_type,
-				readings.device_id AS device_id
-		FROM readings
+				series.location AS location,
+				series.device_type AS device_type,
+				series.device_id AS device_id
+		FROM series
 		WHERE (
-			(_location IS NULL OR readings.location = _location) AND
-			(_device_type IS NULL OR readings.device_type = _device_type) AND
-			(_device_id IS NULL OR readings.device_id = _device_id)
+			(_location IS NULL OR series.location = _location) AND
+			(_device_type IS NULL OR series.device_type = _device_type) AND
+			(_device_id IS NULL OR series.device_id = _device_id)
 		)
 	) AS results;
 END;
@@ -0,0 +1,273 @@
+-- Migrate a database created before readings and rollups referenced their
+-- series.  Readings and rollups kept the location, device type, device id
+-- and sensor in every row, and older databases stored integer readings.
+-- The series are moved into the series table, the readings and rollups
+-- rewritten by series id, and the functions replaced, all in one
+-- transaction.  Run once as the owner:
+--
+--   psql -h localhost -U sample -d sample -f db/migrations/01-series.sql
+
+\set ON_ERROR_STOP on
+
+BEGIN;
+
+-- Databases created before rollups have no rollup table yet, an empty one
+-- is converted like the others
+CREATE TABLE IF NOT EXISTS readings_rollup (
+	location text,
+	device_type text,
+	device_id text,
+	sensor text,
+	window_seconds integer,
+	bucket timestamp with time zone,
+	count bigint,
+	min double precision,
+	max double precision,
+	sum double precision,
+	last double precision,
+	last_ts timestamp with time zone,
+	PRIMARY KEY (location, device_type, device_id, sensor, window_seconds, bucket)
+);
+
+CREATE TABLE series (
+	id serial PRIMARY KEY,
+	location text NOT NULL,
+	device_type text NOT NULL,
+	device_id text NOT NULL,
+	sensor text NOT NULL,
+	UNIQUE (location, device_type, device_id, sensor)
+);
+
+CREATE INDEX series_device_id ON series (device_id);
+
+\echo Move series
+INSERT INTO series (location, device_type, device_id, sensor)
+SELECT
+	COALESCE(location, ''),
+	COALESCE(device_type, ''),
+	COALESCE(device_id, ''),
+	COALESCE(sensor, '')
+FROM readings
+UNION
+SELECT location, device_type, device_id, sensor
+FROM readings_rollup;
+
+\echo Rewrite readings by series id
+ALTER TABLE readings RENAME TO readings_old;
+
+CREATE TABLE readings (
+	series_id integer NOT NULL,
+	ts timestamp with time zone,
+	reading double precision
+);
+
+INSERT INTO readings (series_id, ts, reading)
+SELECT
+	series.id,
+	readings_old.ts,
+	readings_old.reading
+FROM
+	readings_old
+	JOIN series ON
+		series.location = COALESCE(readings_old.location, '') AND
+		series.device_type = COALESCE(readings_old.device_type, '') AND
+		series.device_id = COALESCE(readings_old.device_id, '') AND
+		series.sensor = COALESCE(readings_old.sensor, '');
+
+DROP TABLE readings_old;
+
+CREATE INDEX readings_series_ts ON readings (series_id, ts);
+
+\echo Rewrite rollups by series id
+ALTER TABLE readings_rollup RENAME TO readings_rollup_old;
+ALTER TABLE readings_rollup_old RENAME CONSTRAINT readings_rollup_pkey TO readings_rollup_old_pkey;
+
+CREATE TABLE readings_rollup (
+	series_id integer NOT NULL,
+	window_seconds integer,
+	bucket timestamp with time zone,
+	count bigint,
+	min double precision,
+	max double precision,
+	sum double precision,
+	last double precision,
+	last_ts timestamp with time zone,
+	PRIMARY KEY (series_id, window_seconds, bucket)
+);
+
+INSERT INTO readings_rollup (series_id, window_seconds, bucket, count, min, max, sum, last, last_ts)
+SELECT
+	series.id,
+	readings_rollup_old.window_seconds,
+	readings_rollup_old.bucket,
+	readings_rollup_old.count,
+	readings_rollup_old.min,
+	readings_rollup_old.max,
+	readings_rollup_old.sum,
+	readings_rollup_old.last,
+	readings_rollup_old.last_ts
+FROM
+	readings_rollup_old
+	JOIN series ON
+		series.location = readings_rollup_old.location AND
+		series.device_type = readings_rollup_old.device_type AND
+		series.device_id = readings_rollup_old.device_id AND
+		series.sensor = readings_rollup_old.sensor;
+
+DROP TABLE readings_rollup_old;
+
+-- Return types changed, so the functions are dropped before being replaced
+DROP FUNCTION IF EXISTS get_readings(text, text, text, text, timestamp with time zone, timestamp with time zone, integer, integer);
+DROP FUNCTION IF EXISTS get_rollups(text, text, text, text, integer, timestamp with time zone, timestamp with time zone);
+
+\echo Create function get_readings
+CREATE OR REPLACE FUNCTION get_readings(
+	_location text,
+	_device_type text,
+	_device_id text,
+	_sensor text,
+	_start_time timestamp with time zone,
+	_end_time timestamp with time zone,
+	_min_value double precision,
+	_max_value double precision
+)
+RETURNS TABLE (
+	location TEXT,
+	device_type TEXT,
+	device_id TEXT,
+	sensor TEXT,
+	ts TIMESTAMP WITH TIME ZONE,
+	reading DOUBLE PRECISION
+)
+LANGUAGE plpgsql
+AS $$
+BEGIN
+	RETURN QUERY SELECT
+		series.location,
+		series.device_type,
+		series.device_id,
+		series.sensor,
+		readings.ts,
+		readings.reading
+	FROM
+		series
+		JOIN readings ON readings.series_id = series.id
+	WHERE
+		(_location IS NULL OR series.location = _location) AND
+		(_device_type IS NULL OR series.device_type = _device_type) AND
+		(_device_id IS NULL OR series.device_id = _device_id) AND
+		(_sensor IS NULL OR series.sensor = _sensor) AND
+		(_start_time IS NULL OR readings.ts >= _start_time) AND
+		(_end_time IS NULL OR readings.ts <= _end_time) AND
+		(_min_value IS NULL OR readings.reading >= _min_value) AND
+		(_max_value IS NULL OR readings.reading <= _max_value);
+END;
+$$;
+
+\echo Create function get_rollups
+CREATE OR REPLACE FUNCTION get_rollups(
+	_location text,
+	_device_type text,
+	_device_id text,
+	_sensor text,
+	_window_seconds integer,
+	_start_time timestamp with time zone,
+	_end_time timestamp with time zone
+)
+RETURNS TABLE (
+	location TEXT,
+	device_type TEXT,
+	device_id TEXT,
+	sensor TEXT,
+	bucket TIMESTAMP WITH TIME ZONE,
+	count BIGINT,
+	min DOUBLE PRECISION,
+	max DOUBLE PRECISION,
+	avg DOUBLE PRECISION,
+	last DOUBLE PRECISION
+)
+LANGUAGE plpgsql
+AS $$
+BEGIN
+	RETURN QUERY SELECT
+		series.location,
+		series.device_type,
+		series.device_id,
+		series.sensor,
+		readings_rollup.bucket,
+		readings_rollup.count,
+		readings_rollup.min,
+		readings_rollup.max,
+		readings_rollup.sum / readings_rollup.count,
+		readings_rollup.last
+	FROM
+		series
+		JOIN readings_rollup ON readings_rollup.series_id = series.id
+	WHERE
+		readings_rollup.window_seconds = _window_seconds AND
+		(_location IS NULL OR series.location = _location) AND
+		(_device_type IS NULL OR series.device_type = _device_type) AND
+		(_device_id IS NULL OR series.device_id = _device_id) AND
+		(_sensor IS NULL OR series.sensor = _sensor) AND
+		(_start_time IS NULL OR readings_rollup.bucket >= _start_time) AND
+		(_end_time IS NULL OR readings_rollup.bucket <= _end_time)
+	ORDER BY readings_rollup.bucket;
+END;
+$$;
+
+\echo Create function get_sensors
+CREATE OR REPLACE FUNCTION get_sensors (
+	_device_id TEXT
+)
+RETURNS TEXT[]
+AS $$
+	DECLARE
+		_sensors TEXT[];
+	BEGIN
+		_sensors = ARRAY(
+			SELECT
+				DISTINCT(sensor)
+			FROM series
+			WHERE
+				device_id = _device_id
+		);
+		RETURN _sensors;
+	END;
+$$ LANGUAGE 'plpgsql';
+
+\echo Create function device_get_json
+CREATE OR REPLACE FUNCTION get_devices(
+	_location TEXT,
+	_device_type TEXT,
+	_device_id TEXT
+)
+RETURNS TABLE (
+	location TEXT,
+	device_type TEXT,
+	device_id TEXT,
+	sensors TEXT[]
+)
+AS $$
+BEGIN
+	RETURN QUERY SELECT
+		results.location,
+		results.device_type,
+		results.device_id,
+		get_sensors(results.device_id) AS sensors
+	FROM (
+		SELECT
+			DISTINCT
+				series.location AS location,
+				series.device_type AS device_type,
+				series.device_id AS device_id
+		FROM series
+		WHERE (
+			(_location IS NULL OR series.location = _location) AND
+			(_device_type IS NULL OR series.device_type = _device_type) AND
+			(_device_id IS NULL OR series.device_id = _device_id)
+		)
+	) AS results;
+END;
+$$ LANGUAGE 'plpgsql';
+
+COMMIT;